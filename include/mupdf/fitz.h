@@ -46,6 +46,7 @@ extern "C" {
 #include "mupdf/fitz/device.h"
 #include "mupdf/fitz/display-list.h"
 #include "mupdf/fitz/structured-text.h"
+#include "mupdf/fitz/text-index.h"
 
 #include "mupdf/fitz/transition.h"
 #include "mupdf/fitz/glyph-cache.h"
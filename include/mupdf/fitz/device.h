@@ -198,6 +198,9 @@ enum
 	FZ_DONT_INTERPOLATE_IMAGES = 1,
 	FZ_MAINTAIN_CONTAINER_STACK = 2,
 	FZ_NO_CACHE = 4,
+	/* The device only consumes text: interpreters may skip paths,
+	 * images, shadings and transparency groups. */
+	FZ_TEXT_ONLY = 8,
 };
 
 /*
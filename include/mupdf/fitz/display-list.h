@@ -112,4 +112,14 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 */
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+/*
+	fz_display_list_size: Return the number of bytes held by a display
+	list's nodes.
+
+	Resources the list refers to (fonts, images and so on) are shared
+	and not counted. Used to account for lists held in the resource
+	store.
+*/
+size_t fz_display_list_size(fz_context *ctx, const fz_display_list *list);
+
 #endif
@@ -50,6 +50,7 @@ enum
 */
 struct fz_stext_page_s
 {
+	int refs;
 	fz_pool *pool;
 	fz_rect mediabox;
 	fz_stext_block *first_block, *last_block;
@@ -115,8 +116,16 @@ const fz_stext_char *fz_stext_char_at(fz_context *ctx, fz_stext_page *page, int
 	mediabox: optional mediabox information.
 */
 fz_stext_page *fz_new_stext_page(fz_context *ctx, const fz_rect *mediabox);
+fz_stext_page *fz_keep_stext_page(fz_context *ctx, fz_stext_page *page);
 void fz_drop_stext_page(fz_context *ctx, fz_stext_page *page);
 
+/*
+	fz_stext_page_size: Return the number of bytes held by a text page.
+
+	Used to account for text pages held in the resource store.
+*/
+size_t fz_stext_page_size(fz_context *ctx, fz_stext_page *page);
+
 /*
 	fz_print_stext_page_as_html: Output a page to a file in HTML (visual) format.
 */
@@ -150,6 +159,109 @@ void fz_print_stext_page_as_text(fz_context *ctx, fz_output *out, fz_stext_page
 */
 int fz_search_stext_page(fz_context *ctx, fz_stext_page *text, const char *needle, fz_rect *hit_bbox, int hit_max);
 
+/*
+	fz_compact_stext: A compact, read-only copy of the text of a page,
+	for keeping the text of many pages in memory and searching it.
+
+	Characters are held in flat arrays: their code points, their boxes
+	quantized to 16 bits within the bounds of the page's text, and
+	tables of where each line and block starts. Alongside is the page
+	text already folded for searching, so a search is a linear scan
+	with nothing to rebuild. Fonts, origins and images are not kept.
+*/
+typedef struct fz_compact_stext_s fz_compact_stext;
+
+fz_compact_stext *fz_new_compact_stext(fz_context *ctx, fz_stext_page *page);
+fz_compact_stext *fz_keep_compact_stext(fz_context *ctx, fz_compact_stext *text);
+void fz_drop_compact_stext(fz_context *ctx, fz_compact_stext *text);
+
+/*
+	fz_compact_stext_size: Return the number of bytes held by text.
+*/
+size_t fz_compact_stext_size(fz_context *ctx, fz_compact_stext *text);
+
+/*
+	fz_compact_stext_haystack: Return the folded text that
+	fz_search_compact_stext scans: one character for each character
+	of the page, folded the same way searches fold them, with a space
+	after every line and every block.
+
+	len: Set to the length in bytes, if not NULL.
+*/
+const char *fz_compact_stext_haystack(fz_context *ctx, fz_compact_stext *text, int *len);
+
+/*
+	fz_search_compact_stext: Search compact text for needle. Finds the
+	same hits as fz_search_stext_page on the page the text was made
+	from, give or take the precision of the quantized boxes.
+*/
+int fz_search_compact_stext(fz_context *ctx, fz_compact_stext *text, const char *needle, fz_rect *hit_bbox, int hit_max);
+
+/*
+	fz_stext_needles: A set of needles compiled for searching a page
+	for all of them in a single pass over its text, as for the parts
+	of a compound query. Empty needles may be included; they never
+	match.
+*/
+typedef struct fz_stext_needles_s fz_stext_needles;
+
+fz_stext_needles *fz_new_stext_needles(fz_context *ctx, int count, const char **needles);
+void fz_drop_stext_needles(fz_context *ctx, fz_stext_needles *needles);
+
+/*
+	fz_search_stext_page_needles: Search a text page for every needle
+	in a set at once.
+
+	hit_bbox, hit_max: For each needle, the array to store its hit
+	bboxes in and the size of that array.
+
+	hit_count: Set to the number of hits found for each needle. These
+	are the hits fz_search_stext_page finds for the needle alone.
+
+	Returns the total number of hits.
+*/
+int fz_search_stext_page_needles(fz_context *ctx, fz_stext_page *text, fz_stext_needles *needles, fz_rect **hit_bbox, const int *hit_max, int *hit_count);
+
+/*
+	fz_search_compact_stext_needles: Search compact text for every
+	needle in a set at once, as fz_search_stext_page_needles.
+*/
+int fz_search_compact_stext_needles(fz_context *ctx, fz_compact_stext *text, fz_stext_needles *needles, fz_rect **hit_bbox, const int *hit_max, int *hit_count);
+
+/*
+	fz_stext_grid: A spatial index over a set of boxes on a page,
+	such as the hits returned by fz_search_stext_page, for
+	neighbourhood queries that do not have to visit every box.
+
+	Boxes are referred to by their position in the array the grid
+	was built from.
+*/
+typedef struct fz_stext_grid_s fz_stext_grid;
+
+/*
+	fz_new_stext_grid: Build a grid over n boxes. The boxes are
+	copied, so the array may be reused once this returns.
+*/
+fz_stext_grid *fz_new_stext_grid(fz_context *ctx, const fz_rect *boxes, int n);
+void fz_drop_stext_grid(fz_context *ctx, fz_stext_grid *grid);
+
+/*
+	fz_query_stext_grid: Find the boxes that intersect area.
+
+	Stores up to max box numbers in found, and returns the total
+	number of boxes that intersect.
+*/
+int fz_query_stext_grid(fz_context *ctx, fz_stext_grid *grid, const fz_rect *area, int *found, int max);
+
+/*
+	fz_nearest_stext_grid: Find the box whose top left corner lies
+	nearest to p and strictly within radius of it.
+
+	Returns the box number (the lowest one on ties) or -1 if there
+	is no such box.
+*/
+int fz_nearest_stext_grid(fz_context *ctx, fz_stext_grid *grid, const fz_point *p, float radius);
+
 /*
 	fz_highlight_selection: Return a list of rectangles to highlight lines inside the selection points.
 */
@@ -0,0 +1,117 @@
+#ifndef MUPDF_FITZ_TEXT_INDEX_H
+#define MUPDF_FITZ_TEXT_INDEX_H
+
+#include "mupdf/fitz/system.h"
+#include "mupdf/fitz/context.h"
+#include "mupdf/fitz/geometry.h"
+#include "mupdf/fitz/structured-text.h"
+
+/*
+	Document text index: Maps the words on the pages of a document
+	to the places where they occur.
+
+	Words are runs of characters between spaces, folded the same way
+	as fz_search_stext_page folds them (lower case, all kinds of
+	whitespace and line breaks treated as spaces). Every occurrence is
+	recorded as a posting of page number and bounding box.
+
+	Pages are added one at a time as their text becomes available, so
+	an index may be partial. Queries about pages that have not been
+	added yet always answer "maybe".
+
+	(In development - Subject to change in future versions)
+*/
+
+typedef struct fz_text_index_s fz_text_index;
+typedef struct fz_text_posting_s fz_text_posting;
+
+struct fz_text_posting_s
+{
+	int page;
+	fz_rect bbox;
+};
+
+/*
+	fz_new_text_index: Create an empty index for a document with
+	page_count pages.
+*/
+fz_text_index *fz_new_text_index(fz_context *ctx, int page_count);
+fz_text_index *fz_keep_text_index(fz_context *ctx, fz_text_index *index);
+void fz_drop_text_index(fz_context *ctx, fz_text_index *index);
+
+/*
+	fz_index_stext_page: Add the words of a page to the index.
+
+	Does nothing if the page has already been indexed.
+*/
+void fz_index_stext_page(fz_context *ctx, fz_text_index *index, int number, fz_stext_page *text);
+
+/*
+	fz_text_index_has_page: Return non zero if the page has been indexed.
+*/
+int fz_text_index_has_page(fz_context *ctx, fz_text_index *index, int number);
+
+/*
+	fz_text_index_is_complete: Return non zero if every page has been indexed.
+*/
+int fz_text_index_is_complete(fz_context *ctx, fz_text_index *index);
+
+/*
+	fz_count_text_index_pages: Return the number of pages indexed so far.
+*/
+int fz_count_text_index_pages(fz_context *ctx, fz_text_index *index);
+
+/*
+	fz_lookup_text_index: Find the postings for a single word.
+
+	The word is folded before lookup. Returns the number of
+	occurrences, and, if postings is not NULL, copies up to max of
+	them into the array in the order they were indexed.
+*/
+int fz_lookup_text_index(fz_context *ctx, fz_text_index *index, const char *word, fz_text_posting *postings, int max);
+
+/*
+	fz_text_index_may_contain: Return zero if fz_search_stext_page is
+	known to find no hits for needle on the given page.
+
+	Pages that have not been indexed always return non zero. This
+	allows searches to skip over pages without loading their text.
+
+	strict: Set if the search is done with FZ_CTX_FLAGS_STRICT_MATCH.
+*/
+int fz_text_index_may_contain(fz_context *ctx, fz_text_index *index, int number, const char *needle, int strict);
+
+/*
+	fz_text_index_candidates: Answer fz_text_index_may_contain for every
+	page at once.
+
+	pages: One byte per page, set to non zero for the pages that may
+	hold a hit for needle and to zero for the rest.
+
+	Cheaper than asking page by page when many needles are searched
+	together, since each needle only has to be looked up once.
+*/
+void fz_text_index_candidates(fz_context *ctx, fz_text_index *index, const char *needle, int strict, unsigned char *pages);
+
+/*
+	fz_save_text_index: Write the index to a file, so that later
+	sessions can load it instead of extracting the text again.
+
+	fingerprint: 16 bytes identifying the document contents (such as
+	an MD5 digest). fz_load_text_index only accepts the file for a
+	document with the same fingerprint.
+
+	The file is written under a new, uniquely named temporary file
+	(never one that already exists) and renamed into place.
+*/
+void fz_save_text_index(fz_context *ctx, fz_text_index *index, const char *filename, const unsigned char fingerprint[16]);
+
+/*
+	fz_load_text_index: Read an index written by fz_save_text_index.
+
+	Throws if the file is missing, damaged, or was written for a
+	document with a different fingerprint or page count.
+*/
+fz_text_index *fz_load_text_index(fz_context *ctx, const char *filename, const unsigned char fingerprint[16], int page_count);
+
+#endif
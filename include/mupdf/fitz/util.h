@@ -42,6 +42,71 @@ fz_stext_page *fz_new_stext_page_from_page(fz_context *ctx, fz_page *page, const
 fz_stext_page *fz_new_stext_page_from_page_number(fz_context *ctx, fz_document *doc, int number, const fz_stext_options *options);
 fz_stext_page *fz_new_stext_page_from_display_list(fz_context *ctx, fz_display_list *list, const fz_stext_options *options);
 
+/*
+	fz_load_stext_page: Extract structured text from a page, reusing
+	a previous extraction of the same page with the same options if
+	one is still held in the resource store.
+
+	The returned text page is shared; treat it as read-only and
+	release it with fz_drop_stext_page.
+*/
+fz_stext_page *fz_load_stext_page(fz_context *ctx, fz_document *doc, int number, const fz_stext_options *options);
+
+/*
+	fz_cache_stext_page: Hand a text page extracted elsewhere to the
+	store, so that fz_load_stext_page finds it for this document.
+
+	Lets text be extracted on another thread, from a separate instance
+	of the same document, ahead of the page being needed. The store
+	takes its own reference; if the page is already cached the old
+	copy is kept.
+*/
+void fz_cache_stext_page(fz_context *ctx, fz_document *doc, int number, const fz_stext_options *options, fz_stext_page *text);
+
+/*
+	fz_load_display_list: Record the contents of a page (without
+	annotations) into a display list, reusing the list from an
+	earlier call for the same page if it is still held in the
+	resource store.
+
+	fz_load_stext_page extracts text from a page's cached list when
+	there is one, rather than interpreting the page again.
+
+	The returned list is shared; release it with fz_drop_display_list.
+*/
+fz_display_list *fz_load_display_list(fz_context *ctx, fz_document *doc, int number);
+
+/*
+	fz_find_cached_display_list: Return the display list fz_load_display_list
+	recorded for a page if it is still in the store, otherwise NULL.
+	Never loads the page.
+*/
+fz_display_list *fz_find_cached_display_list(fz_context *ctx, fz_document *doc, int number);
+
+/*
+	fz_cache_display_list: Hand a display list recorded elsewhere to
+	the store, so that fz_load_display_list finds it for this document.
+
+	Lets a page be recorded ahead of time on another thread, from a
+	separate instance of the same document. The store takes its own
+	reference; if the page already has a list the old one is kept.
+*/
+void fz_cache_display_list(fz_context *ctx, fz_document *doc, int number, fz_display_list *list);
+
+/*
+	fz_empty_display_list_cache: Evict all display lists recorded
+	from a document from the resource store. Called automatically
+	when the document is dropped or laid out again.
+*/
+void fz_empty_display_list_cache(fz_context *ctx, fz_document *doc);
+
+/*
+	fz_empty_stext_cache: Evict all text pages extracted from a
+	document from the resource store. Called automatically when the
+	document is dropped or laid out again.
+*/
+void fz_empty_stext_cache(fz_context *ctx, fz_document *doc);
+
 /*
 	fz_new_buffer_from_stext_page: Convert structured text into plain text.
 */
@@ -54,6 +119,9 @@ fz_buffer *fz_new_buffer_from_display_list(fz_context *ctx, fz_display_list *lis
 	fz_search_page: Search for the 'needle' text on the page.
 	Record the hits in the hit_bbox array and return the number of hits.
 	Will stop looking once it has filled hit_max rectangles.
+
+	fz_search_page_number extracts the text through fz_load_stext_page,
+	so repeated searches of the same page do not re-run its contents.
 */
 int fz_search_page(fz_context *ctx, fz_page *page, const char *needle, fz_rect *hit_bbox, int hit_max);
 int fz_search_page_number(fz_context *ctx, fz_document *doc, int number, const char *needle, fz_rect *hit_bbox, int hit_max);
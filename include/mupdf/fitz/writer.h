@@ -6,6 +6,7 @@
 #include "mupdf/fitz/output.h"
 #include "mupdf/fitz/document.h"
 #include "mupdf/fitz/device.h"
+#include "mupdf/fitz/structured-text.h"
 
 typedef struct fz_document_writer_s fz_document_writer;
 
@@ -97,6 +98,20 @@ fz_document_writer *fz_new_svg_writer(fz_context *ctx, const char *path, const c
 
 fz_document_writer *fz_new_text_writer(fz_context *ctx, const char *format, const char *path, const char *options);
 
+/*
+	fz_is_text_writer: Check whether a document writer writes one of
+	the text formats (text, html, xhtml, stext).
+*/
+int fz_is_text_writer(fz_context *ctx, fz_document_writer *wri);
+
+/*
+	fz_write_stext_page: Write out a page of text that has already
+	been extracted, in place of fz_begin_page/fz_end_page. Only for
+	text writers; lets the text be extracted ahead of time, on other
+	threads.
+*/
+void fz_write_stext_page(fz_context *ctx, fz_document_writer *wri, fz_stext_page *page);
+
 fz_document_writer *fz_new_ps_writer(fz_context *ctx, const char *path, const char *options);
 fz_document_writer *fz_new_pcl_writer(fz_context *ctx, const char *path, const char *options);
 fz_document_writer *fz_new_pwg_writer(fz_context *ctx, const char *path, const char *options);
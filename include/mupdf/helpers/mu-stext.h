@@ -0,0 +1,103 @@
+#ifndef MUPDF_HELPERS_MU_STEXT_H
+#define MUPDF_HELPERS_MU_STEXT_H
+
+/*
+	Parallel text extraction helper.
+
+	Extracts structured text for a range of pages with several
+	worker threads, built on the mu-threads helper. A document
+	can't be used from more than one thread at a time, so each
+	worker opens its own copy of it with a clone of the caller's
+	context. The context needs locking functions for that (see
+	fz_new_context); without them, or without threads, the pages
+	are extracted one after another in the calling thread.
+*/
+
+#include "mupdf/fitz.h"
+
+/*
+	mu_stext_source: How a worker thread opens its own copy of
+	the document.
+
+	filename: The file the document was opened from.
+
+	password: Password to authenticate with, if needed.
+
+	layout_w, layout_h, layout_em: Layout for reflowable
+	documents, as given to fz_layout_document.
+*/
+typedef struct mu_stext_source_s mu_stext_source;
+
+struct mu_stext_source_s
+{
+	const char *filename;
+	const char *password;
+	float layout_w, layout_h, layout_em;
+};
+
+/*
+	mu_stext_pool: The worker threads' copies of a document.
+
+	Each worker opens its copy the first time it is used and
+	keeps it until the pool is dropped, so a caller extracting
+	text a run of pages at a time should keep one pool for as
+	long as it has the document open.
+*/
+typedef struct mu_stext_pool_s mu_stext_pool;
+
+/*
+	mu_new_stext_pool: Create a pool of workers for a document.
+
+	src: How the workers open their own copies of the document.
+	The strings are copied. If src or its filename is NULL, the
+	pool has no workers.
+
+	threads: Number of threads to use, including the calling
+	one.
+*/
+mu_stext_pool *mu_new_stext_pool(fz_context *ctx, const mu_stext_source *src, int threads);
+
+/*
+	mu_drop_stext_pool: Close the workers' documents and free
+	the pool. Does nothing if pool is NULL.
+*/
+void mu_drop_stext_pool(fz_context *ctx, mu_stext_pool *pool);
+
+/*
+	mu_new_stext_pages: Extract structured text for the pages
+	from start up to (but not including) end, as
+	fz_new_stext_page_from_page_number would.
+
+	pool: The workers to share the pages with, or NULL to
+	extract them all in the calling thread. Only one call may
+	use a pool at a time.
+
+	doc: The document, already open in ctx. The calling thread
+	works through pages of it alongside the workers.
+
+	options: Text extraction options, or NULL.
+
+	annotations: If non-zero, run each whole page as fz_run_page
+	does, annotations and widgets included, so the text matches
+	what a text document writer makes of the page. Otherwise only
+	the page contents are run.
+
+	cookie: NULL, or a cookie to stop early with. Its progress
+	counts the pages done out of progress_max. Pages not reached
+	when abort is set are left out.
+
+	Returns an array of end - start text pages in page order.
+	Pages that could not be extracted are NULL. Release with
+	mu_drop_stext_pages.
+*/
+fz_stext_page **mu_new_stext_pages(fz_context *ctx, mu_stext_pool *pool, fz_document *doc, int start, int end, const fz_stext_options *options, int annotations, fz_cookie *cookie);
+
+/*
+	mu_drop_stext_pages: Drop the pages returned by
+	mu_new_stext_pages and free the array.
+
+	count: The number of pages asked for (end - start).
+*/
+void mu_drop_stext_pages(fz_context *ctx, fz_stext_page **pages, int count);
+
+#endif
@@ -95,6 +95,8 @@ struct texture
 	GLuint id;
 	int x, y, w, h;
 	float s, t;
+	int storage_w, storage_h; /* size of the texture's storage, 0 until allocated */
+	int storage_format; /* GL_RGBA or GL_LUMINANCE */
 };
 
 void ui_draw_image(struct texture *tex, float x, float y);
@@ -5,19 +5,24 @@
 #include "mupdf/keyboard.h"
 #include "mupdf/ddi.h"
 #include "mupdf/pdf.h" /* for pdf specifics and forms */
+#include "mupdf/helpers/mu-threads.h"
+#include "mupdf/helpers/mu-stext.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #define FL __FILE__, __LINE__
 #ifndef _WIN32
 #include <unistd.h> // for fork and exec
 #else
 #include <tlhelp32.h> // for getppid()
+#include <direct.h> // for _mkdir
 #endif
 
 #ifdef __APPLE__
@@ -245,6 +250,9 @@ static const int zoom_list[] = {18, 24, 36, 54, 72, 96, 120, 144, 180, 216, 288,
 #define MAXRES (zoom_list[nelem(zoom_list) - 1]*retina_factor*0.75)
 #define DEFRES 96
 
+/* resource store budget; extracted page text is cached in here too */
+#define STORE_MAX (512 << 20)
+
 #define SEARCH_STATUS_NONE 0
 #define SEARCH_STATUS_INPAGE 1
 #define SEARCH_STATUS_SEEKING 2
@@ -289,8 +297,6 @@ struct search_s {
 	int flags;
 	int hit_count_a, hit_count_b, hit_count_c; // hit_count_a is also current page max index
 	fz_rect hit_bbox_a[500];
-	fz_rect hit_bbox_b[500];
-	fz_rect hit_bbox_c[500];
 
 	int page;
 	int inpage_index;
@@ -303,6 +309,18 @@ struct search_s {
 static struct search_s this_search;
 static struct search_s prior_search;
 
+/*
+ * Every hit for each part of a compound search on the current page.
+ * These grow as needed, so busy pages (hundreds of GND/NC labels)
+ * are not cut short before the parts are matched up.
+ */
+struct hit_list {
+	fz_rect *box;
+	int len, cap;
+};
+
+static struct hit_list hits_a, hits_b, hits_c, hits_alt;
+
 static int drawable_x, drawable_y;
 static int retina_factor = 1;
 static char filename[PATH_MAX];
@@ -330,15 +348,21 @@ static const char *title    = "FlexBV Schematic Viewer";
 static fz_document *doc     = NULL;
 static fz_page *page        = NULL;
 static fz_stext_page *text  = NULL;
+static fz_text_index *doc_index = NULL;
+static char doc_index_path[PATH_MAX]; // empty if the document can't be fingerprinted
+static unsigned char doc_fingerprint[16];
+static int doc_index_saved = 0; // pages in the sidecar when last loaded/saved
 static pdf_document *pdf    = NULL;
 static fz_outline *outline  = NULL;
 static fz_link *links       = NULL;
+static fz_display_list *page_list = NULL; // contents of page, shared with the store
 
 static int number = 0;
 // static int show_help = 0;
 
 static struct texture page_tex = {0};
 static int scroll_x = 0, scroll_y = 0;
+static int band_threads = -1; // -T, -1 for one per core
 static int canvas_x = 0, canvas_w = 100;
 static int canvas_y = 0, canvas_h = 100;
 
@@ -348,14 +372,25 @@ static int canvas_y = 0, canvas_h = 100;
 static double compsearch_radius = 500.0f;
 static int compsearch_highlight = 8; // 0b0111 (highlight all 3 elements)
 static char *headless_data;
+static char *batch_data; // queries from '!batchsearch:', until they've been answered
+static int hitlist_requested; // '!hitlist:' seen, send every hit back with the reply
+static int server_idle = 0; // seconds a headless server waits for a query, 0 for one-shot
 static int window_w = 1, window_h = 1;
 static int origin_x, origin_y;
 
 #define RUNMODE_NORMAL 0
 #define RUNMODE_HEADLESS 1
 
+#define SERVER_IDLE_DEFAULT 300
+#define DDI_IDLE_MS 50 // how often an idle window looks for DDI files
+#define SERVER_MAX_DOCS 8
+
 static int reload_required = 0;
 static int runmode         = RUNMODE_NORMAL; // 0 == standard
+static int redraw          = 1; // frames still to draw; the SDL loop sleeps at zero
+static int color_mode      = 0; // COLOR_AUTO/RGB/GRAY, -C
+static Uint32 wake_event   = 0; // SDL user event the workers send when they have something
+static SDL_atomic_t wake_pending;
 static int debug           = 0;
 static time_t process_start_time;
 static int oldinvert = 0, currentinvert = 0;
@@ -364,6 +399,9 @@ static int currently_viewed_page = 0; // which page is on screen right now
 static float oldzoom = DEFRES, currentzoom = DEFRES;
 static float oldrotate = 0, currentrotate = 0;
 static fz_matrix page_ctm, page_inv_ctm;
+static fz_matrix tile_ctm; // page_ctm without the rotation; tiles are rendered upright
+static fz_matrix view_rotate; // takes tile device space to page_ctm's
+static fz_irect tile_bounds; // the page in tile device space
 static int loaded = 0;
 
 static int isfullscreen = 0;
@@ -438,12 +476,121 @@ static void update_title(void) {
 	SDL_SetWindowTitle(sdlWindow, buf);
 }
 
-void texture_from_pixmap(struct texture *tex, fz_pixmap *pix) {
-	if (!tex->id) glGenTextures(1, &tex->id);
+/*
+ * Texture upload
+ *
+ * Tiles are rendered as RGBA (or gray, see Colour mode), so rows are
+ * aligned and the driver can take the pixels as they are instead of
+ * repacking 3-byte RGB. Where the GL has pixel buffer objects (2.1 or
+ * ARB_pixel_buffer_object) the pixels are copied into the next of a
+ * small ring of PBOs and the texture is updated from there, so
+ * glTexSubImage2D returns without waiting on the transfer; otherwise
+ * they go straight from client memory. A texture keeps its storage and
+ * only re-specifies it when the size changes.
+ *
+ */
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+#define GL_WRITE_ONLY 0x88B9
+#endif
 
-	glBindTexture(GL_TEXTURE_2D, tex->id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+#define UPLOAD_PBOS 4
+
+typedef void (APIENTRY *gen_buffers_fn)(GLsizei n, GLuint *buffers);
+typedef void (APIENTRY *bind_buffer_fn)(GLenum target, GLuint buffer);
+typedef void (APIENTRY *buffer_data_fn)(GLenum target, ptrdiff_t size, const void *data, GLenum usage);
+typedef void *(APIENTRY *map_buffer_fn)(GLenum target, GLenum access);
+typedef GLboolean (APIENTRY *unmap_buffer_fn)(GLenum target);
+
+static gen_buffers_fn gen_buffers;
+static bind_buffer_fn bind_buffer;
+static buffer_data_fn buffer_data;
+static map_buffer_fn map_buffer;
+static unmap_buffer_fn unmap_buffer;
+
+static int has_pixel_buffer_object = 0;
+static GLuint upload_pbo[UPLOAD_PBOS];
+static int upload_next = 0;
+
+static void *gl_proc(const char *name, const char *arb_name) {
+	void *fn = SDL_GL_GetProcAddress(name);
+	return fn ? fn : SDL_GL_GetProcAddress(arb_name);
+}
+
+/* look for pixel buffer objects, once there's a GL context */
+static void init_texture_upload(void) {
+	const char *version = (const char *)glGetString(GL_VERSION);
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	int major = 0, minor = 0;
+
+	if (version) sscanf(version, "%d.%d", &major, &minor);
+	if (major * 10 + minor < 21 && !(extensions && strstr(extensions, "GL_ARB_pixel_buffer_object"))) return;
+
+	gen_buffers = (gen_buffers_fn)gl_proc("glGenBuffers", "glGenBuffersARB");
+	bind_buffer = (bind_buffer_fn)gl_proc("glBindBuffer", "glBindBufferARB");
+	buffer_data = (buffer_data_fn)gl_proc("glBufferData", "glBufferDataARB");
+	map_buffer = (map_buffer_fn)gl_proc("glMapBuffer", "glMapBufferARB");
+	unmap_buffer = (unmap_buffer_fn)gl_proc("glUnmapBuffer", "glUnmapBufferARB");
+	if (!gen_buffers || !bind_buffer || !buffer_data || !map_buffer || !unmap_buffer) return;
+
+	gen_buffers(UPLOAD_PBOS, upload_pbo);
+	has_pixel_buffer_object = 1;
+	flog("%s:%d: Uploading textures through pixel buffer objects\r\n", FL);
+}
+
+/*
+ * Bind a PBO holding a copy of the pixmap's samples and return the
+ * offset to hand glTexSubImage2D, or return the samples themselves
+ * when there's no PBO to be had. Follow with end_upload().
+ *
+ */
+static const void *begin_upload(fz_pixmap *pix) {
+	size_t size = (size_t)pix->stride * pix->h;
+	void *dst;
+
+	if (!has_pixel_buffer_object) return pix->samples;
+
+	bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload_pbo[upload_next]);
+	upload_next = (upload_next + 1) % UPLOAD_PBOS;
+
+	/* orphan the old contents, so mapping doesn't wait for their transfer */
+	buffer_data(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	dst = map_buffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	if (!dst) {
+		bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return pix->samples;
+	}
+	memcpy(dst, pix->samples, size);
+	unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+
+	return NULL;
+}
+
+static void end_upload(void) {
+	if (has_pixel_buffer_object) bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void texture_from_pixmap(struct texture *tex, fz_pixmap *pix) {
+	GLenum format = pix->n == 1 ? GL_LUMINANCE : pix->n == 4 ? GL_RGBA : GL_RGB;
+	GLenum storage = pix->n == 1 ? GL_LUMINANCE : GL_RGBA;
+	int w2, h2;
+
+	if (!tex->id) {
+		glGenTextures(1, &tex->id);
+		glBindTexture(GL_TEXTURE_2D, tex->id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, tex->id);
+	}
 
 	tex->x = pix->x;
 	tex->y = pix->y;
@@ -451,72 +598,243 @@ void texture_from_pixmap(struct texture *tex, fz_pixmap *pix) {
 	tex->h = pix->h;
 
 	if (has_ARB_texture_non_power_of_two) {
-		if (tex->w > max_texture_size || tex->h > max_texture_size)
-			fz_warn(ctx, "texture size (%d x %d) exceeds implementation limit (%d)", tex->w, tex->h, max_texture_size);
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tex->w, tex->h, 0, pix->n == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, pix->samples);
-		tex->s = 1;
-		tex->t = 1;
+		w2 = tex->w;
+		h2 = tex->h;
 	} else {
-		int w2 = next_power_of_two(tex->w);
-		int h2 = next_power_of_two(tex->h);
-		if (w2 > max_texture_size || h2 > max_texture_size)
-			fz_warn(ctx, "texture size (%d x %d) exceeds implementation limit (%d)", w2, h2, max_texture_size);
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w2, h2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex->w, tex->h, pix->n == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, pix->samples);
-		tex->s = (float)tex->w / w2;
-		tex->t = (float)tex->h / h2;
+		w2 = next_power_of_two(tex->w);
+		h2 = next_power_of_two(tex->h);
 	}
+	if (w2 > max_texture_size || h2 > max_texture_size)
+		fz_warn(ctx, "texture size (%d x %d) exceeds implementation limit (%d)", w2, h2, max_texture_size);
+
+	/* keep the storage we have if it's the same, as it is for most tiles; gray gets one channel */
+	if (tex->storage_w != w2 || tex->storage_h != h2 || tex->storage_format != (int)storage) {
+		glTexImage2D(GL_TEXTURE_2D, 0, storage, w2, h2, 0, storage, GL_UNSIGNED_BYTE, NULL);
+		tex->storage_w = w2;
+		tex->storage_h = h2;
+		tex->storage_format = storage;
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, pix->stride % 4 == 0 ? 4 : 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tex->w, tex->h, format, GL_UNSIGNED_BYTE, begin_upload(pix));
+	end_upload();
+
+	tex->s = (float)tex->w / w2;
+	tex->t = (float)tex->h / h2;
 }
 
-void load_page(void) {
-	fz_rect rect;
-	fz_irect irect;
+/*
+ * Colour mode
+ *
+ * Most schematics are black and white line art, so by default a page
+ * is tested once with the test device (fz_new_test_device) and, if it
+ * has no colour, its tiles are rendered as 8-bit gray pixmaps and kept
+ * in single channel textures: a third of the memory and upload of RGB,
+ * a quarter of the RGBA used otherwise. -C gray or rgb (or the DDI
+ * colormode: command) forces one or the other.
+ *
+ * The answer for each page is kept in page_colors. The text worker
+ * finds it while it records a page for prefetching; otherwise the
+ * page's display list is replayed through the test device, which stops
+ * at the first colour it meets.
+ *
+ */
+#define COLOR_AUTO 0
+#define COLOR_RGB 1
+#define COLOR_GRAY 2
+
+#define PAGE_COLOR_UNKNOWN 0
+#define PAGE_COLOR_GRAY 1
+#define PAGE_COLOR_COLOR 2
+
+static unsigned char *page_colors = NULL; // PAGE_COLOR_* for each page of doc
+static int page_colors_len = 0;
+static int page_gray = 0; // the current page renders in gray
+
+static void reset_page_colors(int count) {
+	free(page_colors);
+	page_colors = calloc(fz_maxi(count, 1), 1);
+	page_colors_len = page_colors ? count : 0;
+}
+
+static void note_page_color(int number, int is_color) {
+	if (number >= 0 && number < page_colors_len) page_colors[number] = is_color ? PAGE_COLOR_COLOR : PAGE_COLOR_GRAY;
+}
+
+/* non-zero if page number, with contents list, is to be rendered in gray */
+static int page_is_gray(int number, fz_display_list *list) {
+	fz_device *dev = NULL;
+	int is_color = 0;
+
+	if (color_mode != COLOR_AUTO) return color_mode == COLOR_GRAY;
+	if (number < 0 || number >= page_colors_len) return 0;
+	if (page_colors[number] != PAGE_COLOR_UNKNOWN) return page_colors[number] == PAGE_COLOR_GRAY;
+	if (!list) return 0;
+
+	fz_var(dev);
+	fz_try(ctx) {
+		dev = fz_new_test_device(ctx, &is_color, 0.02f, 0, NULL);
+		fz_run_display_list(ctx, list, dev, &fz_identity, NULL, NULL);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx) fz_drop_device(ctx, dev);
+	fz_catch(ctx) {
+		/* the test device throws to stop at the first colour */
+		if (!is_color) return 0;
+	}
+
+	note_page_color(number, is_color);
+	return !is_color;
+}
+
+static void set_color_mode(const char *mode) {
+	if (!strncmp(mode, "gray", 4) || !strncmp(mode, "grey", 4)) color_mode = COLOR_GRAY;
+	else if (!strncmp(mode, "rgb", 3) || !strncmp(mode, "color", 5)) color_mode = COLOR_RGB;
+	else color_mode = COLOR_AUTO;
+
+	if (page) page_gray = page_is_gray(currently_viewed_page, page_list);
+}
+
+/*
+ * Page text kept for searching
+ *
+ * Every page whose text has been extracted keeps a compact copy of it
+ * (flat arrays of characters and quantized boxes, plus the folded text
+ * the search scans) for as long as the document is open. A page costs
+ * a few kilobytes that way rather than the hundreds a structured text
+ * page takes, so whole-document searches never go back to the store or
+ * the interpreter for a page they have seen once.
+ *
+ * The workers that extract the text in bulk keep their own copies of the
+ * document open in 'pool' for just as long.
+ *
+ */
+struct page_texts {
+	fz_compact_stext **page;
+	int count;
+	size_t bytes;
+	mu_stext_pool *pool;
+};
+
+static struct page_texts doc_text = { NULL, 0, 0, NULL };
+
+static void init_page_texts(struct page_texts *t, int count) {
+	t->page = calloc(fz_maxi(count, 1), sizeof(*t->page));
+	t->count = t->page ? count : 0;
+	t->bytes = 0;
+	t->pool = NULL;
+}
+
+static void drop_page_texts(struct page_texts *t) {
+	int i;
+
+	for (i = 0; i < t->count; i++) fz_drop_compact_stext(ctx, t->page[i]);
+	free(t->page);
+	mu_drop_stext_pool(ctx, t->pool);
+	t->page = NULL;
+	t->count = 0;
+	t->bytes = 0;
+	t->pool = NULL;
+}
+
+/* Index the text of page number and keep a compact copy of it. */
+static void note_page_text(int number, fz_stext_page *stext) {
+	fz_index_stext_page(ctx, doc_index, number, stext);
+	if (number < 0 || number >= doc_text.count || doc_text.page[number]) return;
+	doc_text.page[number] = fz_new_compact_stext(ctx, stext);
+	doc_text.bytes += fz_compact_stext_size(ctx, doc_text.page[number]);
+}
 
-	fz_scale(&page_ctm, currentzoom / 72, currentzoom / 72);
+/*
+ * Work out the transforms and bounds for the current zoom and rotation.
+ * Rotating only needs this, not a reload, as the tiles don't change.
+ *
+ */
+static void update_page_ctm(void) {
+	fz_rect rect, bounds;
+	fz_irect irect;
 
-	fz_pre_rotate(&page_ctm, -currentrotate);
+	fz_scale(&tile_ctm, currentzoom / 72, currentzoom / 72);
+	fz_rotate(&view_rotate, -currentrotate);
+	fz_concat(&page_ctm, &tile_ctm, &view_rotate);
 	fz_invert_matrix(&page_inv_ctm, &page_ctm);
 
+	if (!page) return;
+
+	fz_bound_page(ctx, page, &bounds);
+	rect = bounds;
+	fz_transform_rect(&rect, &page_ctm);
+	fz_round_rect(&irect, &rect);
+	page_tex.x = irect.x0;
+	page_tex.y = irect.y0;
+	page_tex.w = irect.x1 - irect.x0;
+	page_tex.h = irect.y1 - irect.y0;
+
+	rect = bounds;
+	fz_transform_rect(&rect, &tile_ctm);
+	fz_round_rect(&tile_bounds, &rect);
+}
+
+/*
+ * Page overlays
+ *
+ * Search hits, links and the selection are highlighted with batches of
+ * quads: an overlay keeps the rects in device space along with a
+ * vertex array of their corners, built once for a given page, ctm and
+ * set of rects, and drawn with a single glDrawArrays per colour,
+ * translated to wherever the page is on the canvas. Per frame only the
+ * highlight that stands out (the current hit, the link under the
+ * mouse) is drawn on its own.
+ *
+ */
+struct overlay {
+	int page;
+	fz_matrix ctm;
+	const void *source; // what the rects came from
+	unsigned int hash; // and a hash of them, for sources that change in place
+	int count, cap;
+	fz_rect *rects; // in page_ctm device space
+	float *verts; // 4 corners per rect, x and y each
+};
+
+static struct overlay hit_overlay = { -1 };
+static struct overlay link_overlay = { -1 };
+static struct overlay selection_overlay = { -1 };
+
+void load_page(void) {
 	fz_drop_stext_page(ctx, text);
 	text = NULL;
 	fz_drop_link(ctx, links);
 	links = NULL;
+	link_overlay.page = -1; // a new link list can reuse the old one's address
+	fz_drop_display_list(ctx, page_list);
+	page_list = NULL;
 	fz_drop_page(ctx, page);
 	page = NULL;
 
 	currently_viewed_page = fz_clampi(currently_viewed_page, 0, fz_count_pages(ctx, doc) - 1);
 	page                  = fz_load_page(ctx, doc, currently_viewed_page);
 	links                 = fz_load_links(ctx, page);
-	text                  = fz_new_stext_page_from_page(ctx, page, NULL);
+
+	/* record the page once; tiles and the text below are replayed from the list */
+	if (runmode == RUNMODE_NORMAL) {
+		fz_try(ctx) page_list = fz_load_display_list(ctx, doc, currently_viewed_page);
+		fz_catch(ctx) page_list = NULL;
+	}
+	page_gray = page_is_gray(currently_viewed_page, page_list);
+
+	text                  = fz_load_stext_page(ctx, doc, currently_viewed_page, NULL);
+	note_page_text(currently_viewed_page, text);
 
 	/* compute bounds here for initial window size */
-	fz_bound_page(ctx, page, &rect);
-	fz_transform_rect(&rect, &page_ctm);
-	fz_round_rect(&irect, &rect);
-	page_tex.w = irect.x1 - irect.x0;
-	page_tex.h = irect.y1 - irect.y0;
+	update_page_ctm();
 
 	loaded = 1;
 }
 
 void render_page(void) {
-	// fz_annot *annot;
-	fz_pixmap *pix;
-
 	if (!loaded) load_page();
 
-	pix = fz_new_pixmap_from_page_contents(ctx, page, &page_ctm, fz_device_rgb(ctx), 0);
-	// pix = fz_new_pixmap_from_page_contents(ctx, currently_viewed_page, &page_ctm, fz_device_rgb(ctx), 0);
-	if (currentinvert) {
-		fz_invert_pixmap(ctx, pix);
-		fz_gamma_pixmap(ctx, pix, 1 / 1.4f);
-	}
-
-	texture_from_pixmap(&page_tex, pix);
-	fz_drop_pixmap(ctx, pix);
-
 	/*
 		annot_count = 0;
 		for (annot = fz_first_annot(ctx, page); annot; annot = fz_next_annot(ctx, annot))
@@ -535,471 +853,2361 @@ void render_page(void) {
 	loaded = 0;
 }
 
-static struct mark save_mark() {
-	struct mark mark;
-	mark.page     = currently_viewed_page;
-	mark.scroll.x = scroll_x;
-	mark.scroll.y = scroll_y;
-	fz_transform_point(&mark.scroll, &page_inv_ctm);
-	return mark;
-}
+/*
+ * Wake the SDL loop from a worker thread, so a finished tile or page
+ * gets drawn without the loop having to poll for it. Only one wake is
+ * queued at a time.
+ *
+ */
+static void wake_ui(void) {
+	SDL_Event e;
 
-static void restore_mark(struct mark mark) {
-	currently_viewed_page = mark.page;
-	fz_transform_point(&mark.scroll, &page_ctm);
-	scroll_x = mark.scroll.x;
-	scroll_y = mark.scroll.y;
-}
+	if (!wake_event || !SDL_AtomicCAS(&wake_pending, 0, 1)) return;
 
-static void push_history(void) {
-	if (history_count + 1 >= nelem(history)) {
-		memmove(history, history + 1, sizeof *history * (nelem(history) - 1));
-		history[history_count] = save_mark();
-	} else {
-		history[history_count++] = save_mark();
-	}
+	memset(&e, 0, sizeof(e));
+	e.type = wake_event;
+	SDL_PushEvent(&e);
 }
 
-static void push_future(void) {
-	if (future_count + 1 >= nelem(future)) {
-		memmove(future, future + 1, sizeof *future * (nelem(future) - 1));
-		future[future_count] = save_mark();
-	} else {
-		future[future_count++] = save_mark();
-	}
-}
+/*
+ * Page tiles
+ *
+ * The page isn't rasterised in one piece; only the TILE_SIZE squares
+ * that are on the canvas (or within TILE_MARGIN of it) are rendered,
+ * from the page's display list, each into its own texture. Tiles are
+ * kept in an LRU cache keyed by page and zoom, so panning and going
+ * back to a page reuse what's already been drawn. Memory follows the
+ * window size rather than the page size, and no texture gets near
+ * max_texture_size however far in we zoom.
+ *
+ * Tiles are rendered upright with tile_ctm, and tile (col, row) covers
+ * the TILE_SIZE square at that position from the top left corner of
+ * tile_bounds. Rotation and inversion are applied as the tiles are
+ * drawn (draw_tile), so neither costs a render.
+ *
+ * When the zoom changes on a page that's already been shown, the tiles
+ * from the last complete view are drawn scaled to the new zoom at once,
+ * and the exact tiles are rendered by the tile worker (below) and
+ * swapped in as they arrive. Zooming again cancels the render in
+ * progress through its cookie.
+ *
+ */
+#define TILE_SIZE 512
+#define TILE_MARGIN (TILE_SIZE / 2)
+#define TILE_CACHE_MAX 192
+#define TILE_JOBS_MAX 64
 
-static void clear_future(void) {
-	future_count = 0;
+struct tile_key {
+	int page;
+	float zoom;
+	int gray; // rendered to a gray pixmap
+	int col, row;
+};
+
+struct tile {
+	int used; // zero if the slot is free
+	struct tile_key key;
+	unsigned int last_used;
+	struct texture tex;
+};
+
+static struct tile tile_cache[TILE_CACHE_MAX];
+static unsigned int tile_clock = 0;
+
+/* the last view that was drawn without missing tiles, for zoom fallback */
+static struct tile_key shown_view = { -1 };
+
+static int same_view(const struct tile_key *a, const struct tile_key *b) {
+	return a->page == b->page && a->zoom == b->zoom && a->gray == b->gray;
 }
 
-static void jump_to_page(int newpage) {
-	newpage = fz_clampi(newpage, 0, fz_count_pages(ctx, doc) - 1);
-	clear_future();
-	push_history();
-	this_search.page      = newpage;
-	currently_viewed_page = newpage;
-	push_history();
+static int same_tile(const struct tile_key *a, const struct tile_key *b) {
+	return same_view(a, b) && a->col == b->col && a->row == b->row;
 }
 
-static void jump_to_page_xy(int newpage, float x, float y) {
-	flog("%s:%d: Jumping to %d[%f %f]\r\n", FL, newpage, x, y);
-	fz_point p = {x, y};
-	newpage    = fz_clampi(newpage, 0, fz_count_pages(ctx, doc) - 1);
-	fz_transform_point(&p, &page_ctm);
-	clear_future();
-	push_history();
-	currently_viewed_page = newpage;
-	scroll_x              = p.x;
-	scroll_y              = p.y;
-	push_history();
+static struct tile_key current_tile_key(int col, int row) {
+	struct tile_key k;
+
+	k.page = currently_viewed_page;
+	k.zoom = currentzoom;
+	k.gray = page_gray;
+	k.col = col;
+	k.row = row;
+
+	return k;
 }
 
-static void pop_history(void) {
-	int here = currently_viewed_page;
-	push_future();
-	while (history_count > 0 && currently_viewed_page == here) restore_mark(history[--history_count]);
+/* forget every tile, ie, when the document changes */
+static void tile_cache_clear(void) {
+	int i;
+
+	for (i = 0; i < TILE_CACHE_MAX; i++) tile_cache[i].used = 0;
+	shown_view.page = -1;
 }
 
-static void pop_future(void) {
-	int here = currently_viewed_page;
-	push_history();
-	while (future_count > 0 && currently_viewed_page == here) restore_mark(future[--future_count]);
-	push_history();
+static struct tile *tile_lookup(const struct tile_key *key) {
+	int i;
+
+	for (i = 0; i < TILE_CACHE_MAX; i++) {
+		struct tile *t = &tile_cache[i];
+		if (t->used && same_tile(&t->key, key)) {
+			t->last_used = tile_clock;
+			return t;
+		}
+	}
+
+	return NULL;
 }
 
-static void ui_label_draw(int x0, int y0, int x1, int y1, const char *text) {
-	glColor4f(1, 1, 1, 1);
-	glRectf(x0, y0, x1, y1);
-	glColor4f(0, 0, 0, 1);
-	ui_draw_string(ctx, x0 + 2, y0 + 2 + ui.baseline, text);
+/* free slot, or the least recently used one */
+static struct tile *tile_victim(void) {
+	struct tile *victim = &tile_cache[0];
+	int i;
+
+	for (i = 0; i < TILE_CACHE_MAX; i++) {
+		struct tile *t = &tile_cache[i];
+		if (!t->used) return t;
+		if (t->last_used < victim->last_used) victim = t;
+	}
+
+	return victim;
 }
 
-static void ui_scrollbar(int x0, int y0, int x1, int y1, int *value, int page_size, int max) {
-	static float saved_top = 0;
-	static int saved_ui_y  = 0;
-	float top;
+/* tile device space area of a tile of a page with the given bounds */
+static fz_irect tile_area_in(const fz_irect *bounds, int col, int row) {
+	fz_irect area;
 
-	int total_h = y1 - y0;
-	int thumb_h = fz_maxi(x1 - x0, total_h * page_size / max);
-	int avail_h = total_h - thumb_h;
+	area.x0 = bounds->x0 + col * TILE_SIZE;
+	area.y0 = bounds->y0 + row * TILE_SIZE;
+	area.x1 = fz_mini(area.x0 + TILE_SIZE, bounds->x1);
+	area.y1 = fz_mini(area.y0 + TILE_SIZE, bounds->y1);
 
-	max -= page_size;
+	return area;
+}
 
-	if (max <= 0) {
-		*value = 0;
-		glColor4f(0.6f, 0.6f, 0.6f, 1.0f);
-		glRectf(x0, y0, x1, y1);
-		return;
-	}
+static fz_irect tile_area(int col, int row) {
+	return tile_area_in(&tile_bounds, col, row);
+}
 
-	top = (float)*value * avail_h / max;
+/*
+ * Rasterise one tile from a display list. Safe to call from any thread
+ * with its own context. Returns NULL if the cookie aborted the render.
+ *
+ */
+static fz_pixmap *new_tile_pixmap(fz_context *tctx, fz_display_list *list, const fz_matrix *ctm, const fz_irect *area, int gray, fz_cookie *cookie) {
+	fz_pixmap *pix;
+	fz_device *dev = NULL;
+	fz_rect r;
 
-	if (ui.down && !ui.active) {
-		if (ui.x >= x0 && ui.x < x1 && ui.y >= y0 && ui.y < y1) {
-			if (ui.y < top) {
-				ui.active = "pgdn";
-				*value -= page_size;
-			} else if (ui.y >= top + thumb_h) {
-				ui.active = "pgup";
-				*value += page_size;
-			} else {
-				ui.hot     = value;
-				ui.active  = value;
-				saved_top  = top;
-				saved_ui_y = ui.y;
-			}
-		}
+	fz_rect_from_irect(&r, area);
+
+	/* opaque RGBA: 4-byte pixels upload without repacking; gray is one byte anyway */
+	if (gray) pix = fz_new_pixmap_with_bbox(tctx, fz_device_gray(tctx), area, NULL, 0);
+	else pix = fz_new_pixmap_with_bbox(tctx, fz_device_rgb(tctx), area, NULL, 1);
+	fz_var(dev);
+	fz_try(tctx) {
+		fz_clear_pixmap_with_value(tctx, pix, 0xFF);
+		dev = fz_new_draw_device(tctx, &fz_identity, pix);
+		fz_run_display_list(tctx, list, dev, ctm, &r, cookie);
+		fz_close_device(tctx, dev);
+	}
+	fz_always(tctx) fz_drop_device(tctx, dev);
+	fz_catch(tctx) {
+		fz_drop_pixmap(tctx, pix);
+		fz_rethrow(tctx);
 	}
 
-	if (ui.active == value) {
-		*value = (saved_top + ui.y - saved_ui_y) * max / avail_h;
+	if (cookie && cookie->abort) {
+		fz_drop_pixmap(tctx, pix);
+		return NULL;
 	}
 
-	if (*value < 0)
-		*value = 0;
-	else if (*value > max)
-		*value = max;
+	return pix;
+}
 
-	top = (float)*value * avail_h / max;
+/* upload a rendered tile into the cache */
+static struct tile *store_tile(const struct tile_key *key, fz_pixmap *pix) {
+	struct tile *t = tile_lookup(key);
 
-	glColor4f(0.6f, 0.6f, 0.6f, 1.0f);
-	glRectf(x0, y0, x1, y1);
-	glColor4f(0.8f, 0.8f, 0.8f, 1.0f);
-	glRectf(x0, top, x1, top + thumb_h);
+	if (!t) t = tile_victim();
+	texture_from_pixmap(&t->tex, pix);
+	t->used = 1;
+	t->key = *key;
+	t->last_used = tile_clock;
+
+	return t;
 }
 
-static int measure_outline_height(fz_outline *node) {
-	int h = 0;
-	while (node) {
-		h += ui.lineheight;
-		if (node->down) h += measure_outline_height(node->down);
-		node = node->next;
+static struct tile *render_tile(int col, int row) {
+	struct tile_key key = current_tile_key(col, row);
+	fz_irect area = tile_area(col, row);
+	struct tile *t = NULL;
+	fz_pixmap *pix;
+
+	fz_try(ctx) {
+		pix = new_tile_pixmap(ctx, page_list, &tile_ctm, &area, key.gray, NULL);
+		t = store_tile(&key, pix);
+		fz_drop_pixmap(ctx, pix);
 	}
-	return h;
+	fz_catch(ctx) {
+		fz_warn(ctx, "cannot render page %d tile %d,%d: %s", currently_viewed_page + 1, col, row, fz_caught_message(ctx));
+	}
+
+	return t;
 }
 
-static int do_outline_imp(fz_outline *node, int end, int x0, int x1, int x, int y) {
-	int h = 0;
-	int p = currently_viewed_page;
-	int n = end;
+/*
+ * Tile worker
+ *
+ * A thread with a clone of the viewer's context that renders the tiles
+ * drawn in the meantime as scaled fallbacks. The UI thread hands it the
+ * full set of tiles it's still missing every frame (tile_worker_post),
+ * which replaces whatever was queued before; if the tile being rendered
+ * belongs to a view that's no longer wanted its cookie is aborted.
+ * Finished pixmaps wait in 'done' until the UI thread uploads them
+ * (tile_worker_collect), as only that thread can touch GL, so a tile's
+ * texture only ever changes between frames.
+ *
+ */
+struct tile_job {
+	struct tile_key key;
+	fz_irect area;
+	fz_display_list *list; // contents of key.page, and the ctm it's drawn with
+	fz_matrix ctm;
+};
 
-	while (node) {
-		p = node->page;
-		if (p >= 0) {
-			if (ui.x >= x0 && ui.x < x1 && ui.y >= y + h && ui.y < y + h + ui.lineheight) {
-				ui.hot = node;
-				if (!ui.active && ui.down) {
-					ui.active = node;
-					jump_to_page_xy(p, node->x, node->y);
-				}
-			}
+struct tile_done {
+	struct tile_key key;
+	fz_pixmap *pix;
+};
 
-			n = end;
-			if (node->next && node->next->page >= 0) {
-				n = node->next->page;
-			}
-			if (currently_viewed_page == p || (currently_viewed_page > p && currently_viewed_page < n)) {
-				glColor4f(0.9f, 0.9f, 0.9f, 1.0f);
-				glRectf(x0, y + h, x1, y + h + ui.lineheight);
-			}
+struct tile_worker {
+	fz_context *ctx;
+	struct tile_job jobs[TILE_JOBS_MAX]; // each holds a reference to its list
+	int njobs;
+	struct tile_key busy; // being rendered, if is_busy
+	int is_busy;
+	fz_cookie cookie;
+	struct tile_done done[TILE_JOBS_MAX];
+	int ndone;
+	int waiting; // the thread is (about to be) asleep on 'wake'
+	int quit;
+#ifndef DISABLE_MUTHREADS
+	mu_mutex lock;
+	mu_semaphore wake;
+	mu_thread thread;
+#endif
+};
+
+static struct tile_worker *tile_worker = NULL;
+
+#ifndef DISABLE_MUTHREADS
+static void tile_worker_run(void *arg) {
+	struct tile_worker *w = arg;
+	fz_context *wctx = w->ctx;
+	struct tile_job job;
+	fz_pixmap *pix;
+
+	for (;;) {
+		mu_lock_mutex(&w->lock);
+		while (!w->quit && w->njobs == 0) {
+			w->waiting = 1;
+			mu_unlock_mutex(&w->lock);
+			mu_wait_semaphore(&w->wake);
+			mu_lock_mutex(&w->lock);
+		}
+		if (w->quit) {
+			mu_unlock_mutex(&w->lock);
+			break;
 		}
 
-		glColor4f(0, 0, 0, 1);
-		ui_draw_string(ctx, x, y + h + ui.baseline, node->title);
-		h += ui.lineheight;
-		if (node->down) h += do_outline_imp(node->down, n, x0, x1, x + ui.lineheight, y + h);
+		job = w->jobs[0];
+		memmove(w->jobs, w->jobs + 1, --w->njobs * sizeof(*w->jobs));
+		memset(&w->cookie, 0, sizeof(w->cookie));
+		w->busy = job.key;
+		w->is_busy = 1;
+		mu_unlock_mutex(&w->lock);
+
+		fz_try(wctx) pix = new_tile_pixmap(wctx, job.list, &job.ctm, &job.area, job.key.gray, &w->cookie);
+		fz_catch(wctx) pix = NULL;
+		fz_drop_display_list(wctx, job.list);
+
+		mu_lock_mutex(&w->lock);
+		w->is_busy = 0;
+		if (pix && w->ndone < TILE_JOBS_MAX) {
+			w->done[w->ndone].key = job.key;
+			w->done[w->ndone].pix = pix;
+			w->ndone++;
+			pix = NULL;
+			wake_ui();
+		}
+		mu_unlock_mutex(&w->lock);
+		fz_drop_pixmap(wctx, pix);
+	}
+}
+#endif
 
-		node = node->next;
+static void tile_worker_start(void) {
+#ifndef DISABLE_MUTHREADS
+	struct tile_worker *w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) return;
+
+	w->ctx = fz_clone_context(ctx);
+	if (!w->ctx || mu_create_mutex(&w->lock)) {
+		fz_drop_context(w->ctx);
+		free(w);
+		return;
 	}
-	return h;
+	if (mu_create_semaphore(&w->wake)) {
+		mu_destroy_mutex(&w->lock);
+		fz_drop_context(w->ctx);
+		free(w);
+		return;
+	}
+	if (mu_create_thread(&w->thread, tile_worker_run, w)) {
+		mu_destroy_semaphore(&w->wake);
+		mu_destroy_mutex(&w->lock);
+		fz_drop_context(w->ctx);
+		free(w);
+		return;
+	}
+
+	tile_worker = w;
+	flog("%s:%d: Tile worker started\r\n", FL);
+#endif
 }
 
-static void do_outline(fz_outline *node, int outline_w) {
-	static char *id                   = "outline";
-	static int outline_scroll_y       = 0;
-	static int saved_outline_scroll_y = 0;
-	static int saved_ui_y             = 0;
+static void tile_worker_stop(void) {
+#ifndef DISABLE_MUTHREADS
+	struct tile_worker *w = tile_worker;
+	int i;
 
-	int outline_h;
-	int total_h;
+	if (!w) return;
 
-	outline_w -= ui.lineheight;
-	outline_h = window_h;
-	total_h   = measure_outline_height(outline);
+	mu_lock_mutex(&w->lock);
+	w->quit = 1;
+	w->cookie.abort = 1;
+	if (w->waiting) {
+		w->waiting = 0;
+		mu_trigger_semaphore(&w->wake);
+	}
+	mu_unlock_mutex(&w->lock);
+	mu_destroy_thread(&w->thread);
+
+	for (i = 0; i < w->ndone; i++) fz_drop_pixmap(ctx, w->done[i].pix);
+	for (i = 0; i < w->njobs; i++) fz_drop_display_list(ctx, w->jobs[i].list);
+	mu_destroy_semaphore(&w->wake);
+	mu_destroy_mutex(&w->lock);
+	fz_drop_context(w->ctx);
+	free(w);
+	tile_worker = NULL;
+#endif
+}
 
-	if (ui.x >= 0 && ui.x < outline_w && ui.y >= 0 && ui.y < outline_h) {
-		ui.hot = id;
-		if (!ui.active && ui.middle) {
-			ui.active              = id;
-			saved_ui_y             = ui.y;
-			saved_outline_scroll_y = outline_scroll_y;
-		}
+/* upload the tiles the worker has finished */
+static void tile_worker_collect(void) {
+#ifndef DISABLE_MUTHREADS
+	struct tile_worker *w = tile_worker;
+	struct tile_done done[TILE_JOBS_MAX];
+	int i, n;
+
+	if (!w) return;
+
+	mu_lock_mutex(&w->lock);
+	n = w->ndone;
+	memcpy(done, w->done, n * sizeof(*done));
+	w->ndone = 0;
+	mu_unlock_mutex(&w->lock);
+
+	for (i = 0; i < n; i++) {
+		store_tile(&done[i].key, done[i].pix);
+		fz_drop_pixmap(ctx, done[i].pix);
 	}
+#endif
+}
 
-	if (ui.active == id) outline_scroll_y = saved_outline_scroll_y + (saved_ui_y - ui.y) * 5;
+/* replace the worker's queue with the tiles the current view is missing, and any to prefetch */
+static void tile_worker_post(struct tile_job *jobs, int n) {
+#ifndef DISABLE_MUTHREADS
+	struct tile_worker *w = tile_worker;
+	int i, wanted = 0;
 
-	if (ui.hot == id) outline_scroll_y -= ui.scroll_y * ui.lineheight * 3;
+	mu_lock_mutex(&w->lock);
+	for (i = 0; i < w->njobs; i++) fz_drop_display_list(ctx, w->jobs[i].list);
 
-	ui_scrollbar(outline_w, 0, outline_w + ui.lineheight, outline_h, &outline_scroll_y, outline_h, total_h);
+	w->njobs = 0;
+	for (i = 0; i < n && w->njobs < TILE_JOBS_MAX; i++) {
+		int k, finished = 0;
+		if (w->is_busy && same_tile(&w->busy, &jobs[i].key)) {
+			wanted = 1;
+			continue;
+		}
+		for (k = 0; k < w->ndone; k++) finished |= same_tile(&w->done[k].key, &jobs[i].key);
+		if (finished) continue;
+		w->jobs[w->njobs] = jobs[i];
+		w->jobs[w->njobs].list = fz_keep_display_list(ctx, jobs[i].list);
+		w->njobs++;
+	}
+	if (w->is_busy && !wanted) w->cookie.abort = 1;
 
-	glScissor(0, 0, outline_w, outline_h);
-	glEnable(GL_SCISSOR_TEST);
+	if (w->njobs && w->waiting) {
+		w->waiting = 0;
+		mu_trigger_semaphore(&w->wake);
+	}
+	mu_unlock_mutex(&w->lock);
+#endif
+}
 
-	glColor4f(1, 1, 1, 1);
-	glRectf(0, 0, outline_w, outline_h);
+/*
+ * Band workers
+ *
+ * The tiles a new view needs straight away are shared out over a pool
+ * of threads, the way mudraw -T renders bands: each worker has its own
+ * clone of the context, is handed a tile through its start semaphore
+ * and reports back on its stop semaphore. The pool is made on first
+ * use, with one thread per core (up to BAND_THREADS_MAX) unless -T
+ * says otherwise.
+ *
+ */
+#define BAND_THREADS_MAX 16
+
+struct band_worker {
+	fz_context *ctx;
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_irect area;
+	int gray;
+	fz_pixmap *pix;
+	int quit;
+#ifndef DISABLE_MUTHREADS
+	mu_semaphore start;
+	mu_semaphore stop;
+	mu_thread thread;
+#endif
+};
 
-	do_outline_imp(outline, fz_count_pages(ctx, doc), 0, outline_w, 10, -outline_scroll_y);
+static struct band_worker band_workers[BAND_THREADS_MAX];
+static int band_count = 0;
+static int band_started = 0;
 
-	glDisable(GL_SCISSOR_TEST);
+#ifndef DISABLE_MUTHREADS
+static int count_cpus(void) {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
 }
 
-static void do_links(fz_link *link, int xofs, int yofs) {
-	fz_rect r;
-	float x, y;
-	float link_x, link_y;
+static void band_worker_run(void *arg) {
+	struct band_worker *w = arg;
 
-	x = ui.x;
-	y = ui.y;
+	for (;;) {
+		mu_wait_semaphore(&w->start);
+		if (w->quit) break;
 
-	xofs -= page_tex.x;
-	yofs -= page_tex.y;
+		fz_try(w->ctx) w->pix = new_tile_pixmap(w->ctx, w->list, &w->ctm, &w->area, w->gray, NULL);
+		fz_catch(w->ctx) w->pix = NULL;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-	glEnable(GL_BLEND);
+		mu_trigger_semaphore(&w->stop);
+	}
+}
+#endif
 
-	while (link) {
+static void band_workers_start(void) {
+#ifndef DISABLE_MUTHREADS
+	int i, n;
 
-		if (fz_is_external_link(ctx, link->uri)) {
-			link = link->next;
-			continue;
-		}
+	band_started = 1;
+	n = fz_clampi(band_threads < 0 ? count_cpus() : band_threads, 0, BAND_THREADS_MAX);
+	if (n < 2) return;
 
-		r = link->rect;
-		fz_transform_rect(&r, &page_ctm);
+	for (i = 0; i < n; i++) {
+		struct band_worker *w = &band_workers[i];
 
-		if (x >= xofs + r.x0 && x < xofs + r.x1 && y >= yofs + r.y0 && y < yofs + r.y1) {
-			ui.hot = link;
-			if (!ui.active && ui.down) ui.active = link;
+		memset(w, 0, sizeof(*w));
+		w->ctx = fz_clone_context(ctx);
+		if (!w->ctx) break;
+		if (mu_create_semaphore(&w->start) || mu_create_semaphore(&w->stop) || mu_create_thread(&w->thread, band_worker_run, w)) {
+			mu_destroy_semaphore(&w->start);
+			mu_destroy_semaphore(&w->stop);
+			fz_drop_context(w->ctx);
+			break;
 		}
+		band_count++;
+	}
 
-		if (ui.hot == link || showlinks) {
-			if (ui.active == link && ui.hot == link)
-				glColor4f(0, 0, 1, 0.4f);
-			else if (ui.hot == link)
-				glColor4f(0, 0, 1, 0.2f);
-			else
-				glColor4f(0, 0, 1, 0.1f);
-			glRectf(xofs + r.x0, yofs + r.y0, xofs + r.x1, yofs + r.y1);
-		}
+	flog("%s:%d: %d render thread(s)\r\n", FL, band_count);
+#endif
+}
 
-		if (ui.active == link && !ui.down) {
-			if (ui.hot == link) {
-				if (fz_is_external_link(ctx, link->uri))
-					open_browser(link->uri);
-				else {
-					int p = fz_resolve_link(ctx, doc, link->uri, &link_x, &link_y);
-					if (p >= 0)
-						jump_to_page_xy(p, link_x, link_y);
-					else
-						fz_warn(ctx, "cannot find link destination '%s'", link->uri);
-				}
-			}
-		}
+static void band_workers_stop(void) {
+#ifndef DISABLE_MUTHREADS
+	int i;
 
-		link = link->next;
+	for (i = 0; i < band_count; i++) {
+		struct band_worker *w = &band_workers[i];
+		w->quit = 1;
+		mu_trigger_semaphore(&w->start);
+		mu_destroy_thread(&w->thread);
+		mu_destroy_semaphore(&w->start);
+		mu_destroy_semaphore(&w->stop);
+		fz_drop_context(w->ctx);
 	}
-
-	glDisable(GL_BLEND);
+	band_count = 0;
+	band_started = 0;
+#endif
 }
 
-static void do_page_selection(int x0, int y0, int x1, int y1) {
-	static fz_point pt = {0, 0};
-	fz_rect hits[1000];
-	int i, n;
+/* render tiles of the current view, in parallel when there's a pool */
+static void render_tiles(struct tile_job *jobs, int n) {
+	int i;
 
-	if (ui.x >= x0 && ui.x < x1 && ui.y >= y0 && ui.y < y1) {
-		ui.hot = &pt;
-		if (!ui.active && ui.right) {
-			ui.active = &pt;
-			pt.x      = ui.x;
-			pt.y      = ui.y;
+	if (!band_started) band_workers_start();
+
+	if (band_count == 0 || n < 2) {
+		for (i = 0; i < n; i++) render_tile(jobs[i].key.col, jobs[i].key.row);
+		return;
+	}
+
+#ifndef DISABLE_MUTHREADS
+	for (i = 0; i < n; i += band_count) {
+		int k, band = fz_mini(band_count, n - i);
+
+		for (k = 0; k < band; k++) {
+			struct band_worker *w = &band_workers[k];
+			w->list = page_list;
+			w->ctm = tile_ctm;
+			w->area = jobs[i + k].area;
+			w->gray = jobs[i + k].key.gray;
+			w->pix = NULL;
+			mu_trigger_semaphore(&w->start);
+		}
+
+		for (k = 0; k < band; k++) {
+			struct band_worker *w = &band_workers[k];
+			mu_wait_semaphore(&w->stop);
+			if (w->pix) {
+				store_tile(&jobs[i + k].key, w->pix);
+				fz_drop_pixmap(ctx, w->pix);
+			} else {
+				fz_warn(ctx, "cannot render page %d tile %d,%d", currently_viewed_page + 1, jobs[i + k].key.col, jobs[i + k].key.row);
+			}
 		}
 	}
+#endif
+}
 
-	if (ui.active == &pt) {
-		int xofs = x0 - page_tex.x;
-		int yofs = y0 - page_tex.y;
+/* one pass over a tile's quad, m taking tile device space to the screen */
+static void emit_tile_quad(struct texture *tex, const fz_matrix *m) {
+	fz_point p[4];
+	float u[4] = { 0, 0, tex->s, tex->s };
+	float v[4] = { tex->t, 0, tex->t, 0 };
+	int i;
 
-		fz_point page_a = {pt.x - xofs, pt.y - yofs};
-		fz_point page_b = {ui.x - xofs, ui.y - yofs};
+	p[0].x = tex->x; p[0].y = tex->y + tex->h;
+	p[1].x = tex->x; p[1].y = tex->y;
+	p[2].x = tex->x + tex->w; p[2].y = tex->y + tex->h;
+	p[3].x = tex->x + tex->w; p[3].y = tex->y;
 
-		fz_transform_point(&page_a, &page_inv_ctm);
-		fz_transform_point(&page_b, &page_inv_ctm);
+	glBegin(GL_TRIANGLE_STRIP);
+	for (i = 0; i < 4; i++) {
+		fz_transform_point(&p[i], m);
+		glTexCoord2f(u[i], v[i]);
+		glVertex2f(p[i].x, p[i].y);
+	}
+	glEnd();
+}
 
-		n = fz_highlight_selection(ctx, text, page_a, page_b, hits, nelem(hits));
+/*
+ * Draw a tile through m, which takes its tile device space to the
+ * screen and so carries the view's rotation. When inverting, what was
+ * drawn is inverted by a blended white quad, then the dark tones are
+ * lifted the way the old 1/1.4 gamma pass did, d + d(1 - d) / 2, by
+ * blending half the tile back in against the destination.
+ *
+ */
+static void draw_tile(struct texture *tex, const fz_matrix *m) {
+	glBindTexture(GL_TEXTURE_2D, tex->id);
+	glEnable(GL_TEXTURE_2D);
+	glColor4f(1, 1, 1, 1);
+	emit_tile_quad(tex, m);
 
+	if (currentinvert) {
+		glDisable(GL_TEXTURE_2D);
 		glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO); /* invert destination color */
 		glEnable(GL_BLEND);
+		emit_tile_quad(tex, m);
 
+		glEnable(GL_TEXTURE_2D);
+		glBlendFunc(GL_DST_COLOR, GL_ONE); /* d + (1 - d) / 2 * d */
+		glColor4f(0.5f, 0.5f, 0.5f, 1);
+		emit_tile_quad(tex, m);
 		glColor4f(1, 1, 1, 1);
-		for (i = 0; i < n; ++i) {
-			fz_transform_rect(&hits[i], &page_ctm);
-			glRectf(hits[i].x0 + xofs, hits[i].y0 + yofs, hits[i].x1 + 1 + xofs, hits[i].y1 + 1 + yofs);
-		}
-
 		glDisable(GL_BLEND);
+	}
 
-		if (!ui.right) {
-			char *s;
-#ifdef _WIN32
-			s = fz_copy_selection(ctx, text, page_a, page_b, 1);
-#else
-			s = fz_copy_selection(ctx, text, page_a, page_b, 0);
-#endif
-			ui_set_clipboard(s);
+	glDisable(GL_TEXTURE_2D);
+}
 
-			if (ui.lctrl||ui.rctrl) {
-				flog("%s:%d: Searching internally for '%s'\r\n", FL, s);
-				snprintf(this_search.a, sizeof(this_search.a), "%s", s);
-				this_search.direction = 1;
-				this_search.page = 0;
-				this_search.has_hits = 0;
-				this_search.not_found = 0;
-				this_search.active = 1;
+/* matrix taking tile device space at the current zoom to the screen, page corner at x, y */
+static fz_matrix tile_to_screen(float x, float y) {
+	fz_matrix m, t;
 
-			} else {
-				flog("%s:%d: Dispatching request '%s'\n", FL, s);
-				if (!detached) DDI_dispatch(&ddi, s);
-			}
-			fz_free(ctx, s);
-		}
-	}
+	fz_translate(&t, x - page_tex.x, y - page_tex.y);
+	fz_concat(&m, &view_rotate, &t);
+
+	return m;
 }
 
+/* the tiles of a page with the given bounds that meet view, both in tile device space; zero if none */
+static int tile_range(const fz_rect *view, const fz_irect *bounds, int *col0, int *row0, int *col1, int *row1) {
+	float x0 = fz_max(view->x0, bounds->x0) - bounds->x0;
+	float y0 = fz_max(view->y0, bounds->y0) - bounds->y0;
+	float x1 = fz_min(view->x1, bounds->x1) - bounds->x0;
+	float y1 = fz_min(view->y1, bounds->y1) - bounds->y0;
+
+	if (x1 <= x0 || y1 <= y0) return 0;
+
+	*col0 = (int)x0 / TILE_SIZE;
+	*row0 = (int)y0 / TILE_SIZE;
+	*col1 = ((int)ceilf(x1) - 1) / TILE_SIZE;
+	*row1 = ((int)ceilf(y1) - 1) / TILE_SIZE;
+
+	return 1;
+}
 
 /*
- * This is where we colour the search hits on a page
+ * Queue the tiles a flip to page number would show first, if its
+ * display list has been prefetched: the top left of the page going
+ * forward, the bottom right going back (see smart_move_forward and
+ * smart_move_backward). Each added job holds a reference to the list.
  *
  */
-static void do_search_hits(int xofs, int yofs) {
-	fz_rect r;
-	int i;
+static int prefetch_tiles(struct tile_job *jobs, int n, int number, int at_end) {
+	fz_display_list *list;
+	fz_rect bounds, rect, view;
+	fz_irect tb;
+	fz_matrix unrotate;
+	int col0, row0, col1, row1, col, row;
 
-	xofs -= page_tex.x;
-	yofs -= page_tex.y;
+	if (!tile_worker || number < 0 || number >= fz_count_pages(ctx, doc)) return n;
 
+	list = fz_find_cached_display_list(ctx, doc, number);
+	if (!list) return n;
 
-	for (i = 0; i < this_search.hit_count_a; ++i) {
-		r = this_search.hit_bbox_a[i];
+	fz_bound_display_list(ctx, list, &bounds);
+	rect = bounds;
+	fz_transform_rect(&rect, &tile_ctm);
+	fz_round_rect(&tb, &rect);
 
-		fz_transform_rect(&r, &page_ctm);
+	/* where the flip lands, as page_ctm sees the page, then upright */
+	rect = bounds;
+	fz_transform_rect(&rect, &page_ctm);
+	view.x0 = at_end ? fz_max(rect.x1 - canvas_w, rect.x0) : rect.x0;
+	view.y0 = at_end ? fz_max(rect.y1 - canvas_h, rect.y0) : rect.y0;
+	view.x1 = view.x0 + canvas_w;
+	view.y1 = view.y0 + canvas_h;
+	fz_invert_matrix(&unrotate, &view_rotate);
+	fz_transform_rect(&view, &unrotate);
+
+	if (tile_range(&view, &tb, &col0, &row0, &col1, &row1)) {
+		for (row = row0; row <= row1; row++) {
+			for (col = col0; col <= col1; col++) {
+				struct tile_key key = current_tile_key(col, row);
+				struct tile_job *job = &jobs[n];
+
+				key.page = number;
+				key.gray = page_is_gray(number, list);
+				if (n == TILE_JOBS_MAX || tile_lookup(&key)) continue;
+
+				job->key = key;
+				job->area = tile_area_in(&tb, col, row);
+				job->list = fz_keep_display_list(ctx, list);
+				job->ctm = tile_ctm;
+				n++;
+			}
+		}
+	}
 
-		if (i == this_search.inpage_index) {
-			float offset = 5.0f;
-			float loffset = 6.0f;
-			/*
-			 * highlight the current hit
-			 *
-			 */
+	fz_drop_display_list(ctx, list);
+	return n;
+}
+
+/*
+ * Draw the page with its top left corner (in device space) at x, y,
+ * rendering whichever tiles near the canvas aren't cached yet.
+ *
+ */
+static void draw_page_tiles(float x, float y) {
+	struct tile_job jobs[TILE_JOBS_MAX];
+	struct tile_job now[TILE_CACHE_MAX / 2];
+	struct tile_key view = current_tile_key(0, 0);
+	fz_matrix m, inv_m;
+	fz_rect near, onscreen;
+	int col0, row0, col1, row1, col, row, i;
+	int njobs = 0, nvisible = 0, nnow = 0, missing = 0;
+	int fallback;
+
+	if (!page || page_tex.w <= 0 || page_tex.h <= 0) return;
+
+	if (!page_list) {
+		fz_try(ctx) page_list = fz_load_display_list(ctx, doc, currently_viewed_page);
+		fz_catch(ctx) {
+			fz_warn(ctx, "cannot load page %d contents: %s", currently_viewed_page + 1, fz_caught_message(ctx));
+			return;
+		}
+		page_gray = page_is_gray(currently_viewed_page, page_list);
+		view = current_tile_key(0, 0);
+	}
+
+	tile_clock++;
+	tile_worker_collect();
+
+	/* the canvas, and the margin around it, in tile device space */
+	m = tile_to_screen(x, y);
+	fz_invert_matrix(&inv_m, &m);
+	onscreen.x0 = canvas_x;
+	onscreen.y0 = canvas_y;
+	onscreen.x1 = canvas_x + canvas_w;
+	onscreen.y1 = canvas_y + canvas_h;
+	near = onscreen;
+	fz_expand_rect(&near, TILE_MARGIN);
+	fz_transform_rect(&onscreen, &inv_m);
+	fz_transform_rect(&near, &inv_m);
+	if (!tile_range(&near, &tile_bounds, &col0, &row0, &col1, &row1)) return;
+
+	/* zoomed on a page we've just shown: stretch its tiles while the new ones render */
+	fallback = tile_worker && shown_view.page == view.page && shown_view.zoom != view.zoom;
+	if (fallback) {
+		fz_matrix scaled;
+		fz_scale(&scaled, currentzoom / shown_view.zoom, currentzoom / shown_view.zoom);
+		fz_concat(&scaled, &scaled, &m);
+		for (i = 0; i < TILE_CACHE_MAX; i++) {
+			struct tile *t = &tile_cache[i];
+			if (t->used && same_view(&t->key, &shown_view)) {
+				t->last_used = tile_clock;
+				draw_tile(&t->tex, &scaled);
+			}
+		}
+	}
+
+	for (row = row0; row <= row1; row++) {
+		for (col = col0; col <= col1; col++) {
+			struct tile_key key = current_tile_key(col, row);
+			struct tile *t = tile_lookup(&key);
+
+			if (!t && !fallback && nnow < (int)nelem(now)) {
+				now[nnow].key = key;
+				now[nnow].area = tile_area(col, row);
+				nnow++;
+				continue;
+			}
+
+			if (!t && fallback) {
+				if (njobs < TILE_JOBS_MAX) {
+					struct tile_job job;
+					job.key = key;
+					job.area = tile_area(col, row);
+					job.list = page_list;
+					job.ctm = tile_ctm;
+
+					/* tiles on the canvas go ahead of the margin */
+					if (job.area.x0 < onscreen.x1 && job.area.x1 > onscreen.x0 && job.area.y0 < onscreen.y1 && job.area.y1 > onscreen.y0) {
+						memmove(jobs + nvisible + 1, jobs + nvisible, (njobs - nvisible) * sizeof(*jobs));
+						jobs[nvisible++] = job;
+					} else {
+						jobs[njobs] = job;
+					}
+					njobs++;
+				}
+				missing = 1;
+				continue;
+			}
+
+			if (t) draw_tile(&t->tex, &m);
+			else missing = 1;
+		}
+	}
+
+	/* tiles needed right away, rendered together and then drawn */
+	render_tiles(now, nnow);
+	for (i = 0; i < nnow; i++) {
+		struct tile *t = tile_lookup(&now[i].key);
+		if (t) draw_tile(&t->tex, &m);
+		else missing = 1;
+	}
+
+	if (!missing) {
+		shown_view = view;
+		njobs = prefetch_tiles(jobs, njobs, currently_viewed_page + 1, 0);
+		njobs = prefetch_tiles(jobs, njobs, currently_viewed_page - 1, 1);
+	}
+	if (tile_worker) tile_worker_post(jobs, njobs);
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].list != page_list) fz_drop_display_list(ctx, jobs[i].list);
+	}
+}
+
+static struct mark save_mark() {
+	struct mark mark;
+	mark.page     = currently_viewed_page;
+	mark.scroll.x = scroll_x;
+	mark.scroll.y = scroll_y;
+	fz_transform_point(&mark.scroll, &page_inv_ctm);
+	return mark;
+}
+
+static void restore_mark(struct mark mark) {
+	currently_viewed_page = mark.page;
+	fz_transform_point(&mark.scroll, &page_ctm);
+	scroll_x = mark.scroll.x;
+	scroll_y = mark.scroll.y;
+}
+
+static void push_history(void) {
+	if (history_count + 1 >= nelem(history)) {
+		memmove(history, history + 1, sizeof *history * (nelem(history) - 1));
+		history[history_count] = save_mark();
+	} else {
+		history[history_count++] = save_mark();
+	}
+}
+
+static void push_future(void) {
+	if (future_count + 1 >= nelem(future)) {
+		memmove(future, future + 1, sizeof *future * (nelem(future) - 1));
+		future[future_count] = save_mark();
+	} else {
+		future[future_count++] = save_mark();
+	}
+}
+
+static void clear_future(void) {
+	future_count = 0;
+}
+
+static void jump_to_page(int newpage) {
+	newpage = fz_clampi(newpage, 0, fz_count_pages(ctx, doc) - 1);
+	clear_future();
+	push_history();
+	this_search.page      = newpage;
+	currently_viewed_page = newpage;
+	push_history();
+}
+
+static void jump_to_page_xy(int newpage, float x, float y) {
+	flog("%s:%d: Jumping to %d[%f %f]\r\n", FL, newpage, x, y);
+	fz_point p = {x, y};
+	newpage    = fz_clampi(newpage, 0, fz_count_pages(ctx, doc) - 1);
+	fz_transform_point(&p, &page_ctm);
+	clear_future();
+	push_history();
+	currently_viewed_page = newpage;
+	scroll_x              = p.x;
+	scroll_y              = p.y;
+	push_history();
+}
+
+static void pop_history(void) {
+	int here = currently_viewed_page;
+	push_future();
+	while (history_count > 0 && currently_viewed_page == here) restore_mark(history[--history_count]);
+}
+
+static void pop_future(void) {
+	int here = currently_viewed_page;
+	push_history();
+	while (future_count > 0 && currently_viewed_page == here) restore_mark(future[--future_count]);
+	push_history();
+}
+
+static void ui_label_draw(int x0, int y0, int x1, int y1, const char *text) {
+	glColor4f(1, 1, 1, 1);
+	glRectf(x0, y0, x1, y1);
+	glColor4f(0, 0, 0, 1);
+	ui_draw_string(ctx, x0 + 2, y0 + 2 + ui.baseline, text);
+}
+
+static void ui_scrollbar(int x0, int y0, int x1, int y1, int *value, int page_size, int max) {
+	static float saved_top = 0;
+	static int saved_ui_y  = 0;
+	float top;
+
+	int total_h = y1 - y0;
+	int thumb_h = fz_maxi(x1 - x0, total_h * page_size / max);
+	int avail_h = total_h - thumb_h;
+
+	max -= page_size;
+
+	if (max <= 0) {
+		*value = 0;
+		glColor4f(0.6f, 0.6f, 0.6f, 1.0f);
+		glRectf(x0, y0, x1, y1);
+		return;
+	}
+
+	top = (float)*value * avail_h / max;
+
+	if (ui.down && !ui.active) {
+		if (ui.x >= x0 && ui.x < x1 && ui.y >= y0 && ui.y < y1) {
+			if (ui.y < top) {
+				ui.active = "pgdn";
+				*value -= page_size;
+			} else if (ui.y >= top + thumb_h) {
+				ui.active = "pgup";
+				*value += page_size;
+			} else {
+				ui.hot     = value;
+				ui.active  = value;
+				saved_top  = top;
+				saved_ui_y = ui.y;
+			}
+		}
+	}
+
+	if (ui.active == value) {
+		*value = (saved_top + ui.y - saved_ui_y) * max / avail_h;
+	}
+
+	if (*value < 0)
+		*value = 0;
+	else if (*value > max)
+		*value = max;
+
+	top = (float)*value * avail_h / max;
+
+	glColor4f(0.6f, 0.6f, 0.6f, 1.0f);
+	glRectf(x0, y0, x1, y1);
+	glColor4f(0.8f, 0.8f, 0.8f, 1.0f);
+	glRectf(x0, top, x1, top + thumb_h);
+}
+
+static int measure_outline_height(fz_outline *node) {
+	int h = 0;
+	while (node) {
+		h += ui.lineheight;
+		if (node->down) h += measure_outline_height(node->down);
+		node = node->next;
+	}
+	return h;
+}
+
+static int do_outline_imp(fz_outline *node, int end, int x0, int x1, int x, int y) {
+	int h = 0;
+	int p = currently_viewed_page;
+	int n = end;
+
+	while (node) {
+		p = node->page;
+		if (p >= 0) {
+			if (ui.x >= x0 && ui.x < x1 && ui.y >= y + h && ui.y < y + h + ui.lineheight) {
+				ui.hot = node;
+				if (!ui.active && ui.down) {
+					ui.active = node;
+					jump_to_page_xy(p, node->x, node->y);
+				}
+			}
+
+			n = end;
+			if (node->next && node->next->page >= 0) {
+				n = node->next->page;
+			}
+			if (currently_viewed_page == p || (currently_viewed_page > p && currently_viewed_page < n)) {
+				glColor4f(0.9f, 0.9f, 0.9f, 1.0f);
+				glRectf(x0, y + h, x1, y + h + ui.lineheight);
+			}
+		}
+
+		glColor4f(0, 0, 0, 1);
+		ui_draw_string(ctx, x, y + h + ui.baseline, node->title);
+		h += ui.lineheight;
+		if (node->down) h += do_outline_imp(node->down, n, x0, x1, x + ui.lineheight, y + h);
+
+		node = node->next;
+	}
+	return h;
+}
+
+static void do_outline(fz_outline *node, int outline_w) {
+	static char *id                   = "outline";
+	static int outline_scroll_y       = 0;
+	static int saved_outline_scroll_y = 0;
+	static int saved_ui_y             = 0;
+
+	int outline_h;
+	int total_h;
+
+	outline_w -= ui.lineheight;
+	outline_h = window_h;
+	total_h   = measure_outline_height(outline);
+
+	if (ui.x >= 0 && ui.x < outline_w && ui.y >= 0 && ui.y < outline_h) {
+		ui.hot = id;
+		if (!ui.active && ui.middle) {
+			ui.active              = id;
+			saved_ui_y             = ui.y;
+			saved_outline_scroll_y = outline_scroll_y;
+		}
+	}
+
+	if (ui.active == id) outline_scroll_y = saved_outline_scroll_y + (saved_ui_y - ui.y) * 5;
+
+	if (ui.hot == id) outline_scroll_y -= ui.scroll_y * ui.lineheight * 3;
+
+	ui_scrollbar(outline_w, 0, outline_w + ui.lineheight, outline_h, &outline_scroll_y, outline_h, total_h);
+
+	glScissor(0, 0, outline_w, outline_h);
+	glEnable(GL_SCISSOR_TEST);
+
+	glColor4f(1, 1, 1, 1);
+	glRectf(0, 0, outline_w, outline_h);
+
+	do_outline_imp(outline, fz_count_pages(ctx, doc), 0, outline_w, 10, -outline_scroll_y);
+
+	glDisable(GL_SCISSOR_TEST);
+}
+
+static unsigned int hash_rects(const fz_rect *rects, int n) {
+	const unsigned char *p = (const unsigned char *)rects;
+	size_t i, len = n * sizeof(*rects);
+	unsigned int h = 2166136261u;
+
+	for (i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+static int overlay_is_current(struct overlay *o, const void *source, unsigned int hash, int n) {
+	return o->page == currently_viewed_page && !memcmp(&o->ctm, &page_ctm, sizeof(page_ctm)) && o->source == source && o->hash == hash && o->count == n;
+}
+
+/* room for n rects; zero if there isn't */
+static int overlay_reserve(struct overlay *o, int n) {
+	fz_rect *rects;
+	float *verts;
+
+	if (n <= o->cap) return 1;
+
+	rects = realloc(o->rects, n * sizeof(*rects));
+	if (rects) o->rects = rects;
+	verts = realloc(o->verts, n * 8 * sizeof(*verts));
+	if (verts) o->verts = verts;
+	if (!rects || !verts) return 0;
+
+	o->cap = n;
+	return 1;
+}
+
+/* add a rect, given in page space, to the overlay being built */
+static void overlay_add(struct overlay *o, const fz_rect *page_rect, float grow) {
+	fz_rect r = *page_rect;
+	float *v;
+
+	if (o->count == o->cap && !overlay_reserve(o, fz_maxi(16, o->cap * 2))) return;
+
+	fz_transform_rect(&r, &page_ctm);
+	o->rects[o->count] = r;
+
+	v = o->verts + o->count * 8;
+	v[0] = r.x0; v[1] = r.y0;
+	v[2] = r.x1 + grow; v[3] = r.y0;
+	v[4] = r.x1 + grow; v[5] = r.y1 + grow;
+	v[6] = r.x0; v[7] = r.y1 + grow;
+	o->count++;
+}
+
+static void overlay_begin(struct overlay *o, const void *source, unsigned int hash) {
+	o->page = currently_viewed_page;
+	o->ctm = page_ctm;
+	o->source = source;
+	o->hash = hash;
+	o->count = 0;
+}
+
+/* draw rects [first, first + n) of the overlay with the page's device origin at xofs, yofs */
+static void overlay_draw(struct overlay *o, int xofs, int yofs, int first, int n) {
+	if (n <= 0) return;
+
+	glPushMatrix();
+	glTranslatef(xofs, yofs, 0);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, o->verts + first * 8);
+	glDrawArrays(GL_QUADS, 0, n * 4);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glPopMatrix();
+}
+
+/* draw every rect but the one at skip (-1 for none) */
+static void overlay_draw_except(struct overlay *o, int xofs, int yofs, int skip) {
+	if (skip < 0 || skip >= o->count) {
+		overlay_draw(o, xofs, yofs, 0, o->count);
+	} else {
+		overlay_draw(o, xofs, yofs, 0, skip);
+		overlay_draw(o, xofs, yofs, skip + 1, o->count - skip - 1);
+	}
+}
+
+static void do_links(fz_link *link, int xofs, int yofs) {
+	struct overlay *o = &link_overlay;
+	fz_link *hot = NULL, *l;
+	float x, y;
+	float link_x, link_y;
+	int i, n, hot_i = -1;
+
+	x = ui.x;
+	y = ui.y;
+
+	xofs -= page_tex.x;
+	yofs -= page_tex.y;
+
+	/* the internal links, in the order of the list */
+	for (l = link, n = 0; l; l = l->next) {
+		if (!fz_is_external_link(ctx, l->uri)) n++;
+	}
+	if (!overlay_is_current(o, link, 0, n)) {
+		overlay_begin(o, link, 0);
+		for (l = link; l; l = l->next) {
+			if (!fz_is_external_link(ctx, l->uri)) overlay_add(o, &l->rect, 0);
+		}
+	}
+
+	for (i = 0; link; link = link->next) {
+		fz_rect *r;
+
+		if (fz_is_external_link(ctx, link->uri)) continue;
+		if (i == o->count) break;
+		r = &o->rects[i];
+
+		if (x >= xofs + r->x0 && x < xofs + r->x1 && y >= yofs + r->y0 && y < yofs + r->y1) {
+			ui.hot = link;
+			if (!ui.active && ui.down) ui.active = link;
+		}
+		if (ui.hot == link) {
+			hot = link;
+			hot_i = i;
+		}
+
+		if (ui.active == link && !ui.down) {
+			if (ui.hot == link) {
+				if (fz_is_external_link(ctx, link->uri))
+					open_browser(link->uri);
+				else {
+					int p = fz_resolve_link(ctx, doc, link->uri, &link_x, &link_y);
+					if (p >= 0)
+						jump_to_page_xy(p, link_x, link_y);
+					else
+						fz_warn(ctx, "cannot find link destination '%s'", link->uri);
+				}
+			}
+		}
+
+		i++;
+	}
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glEnable(GL_BLEND);
+
+	if (showlinks) {
+		glColor4f(0, 0, 1, 0.1f);
+		overlay_draw_except(o, xofs, yofs, hot_i);
+	}
+
+	if (hot) {
+		if (ui.active == hot)
+			glColor4f(0, 0, 1, 0.4f);
+		else
+			glColor4f(0, 0, 1, 0.2f);
+		overlay_draw(o, xofs, yofs, hot_i, 1);
+	}
+
+	glDisable(GL_BLEND);
+}
+
+static void do_page_selection(int x0, int y0, int x1, int y1) {
+	static fz_point pt = {0, 0};
+	fz_rect hits[1000];
+	int i, n;
+
+	if (ui.x >= x0 && ui.x < x1 && ui.y >= y0 && ui.y < y1) {
+		ui.hot = &pt;
+		if (!ui.active && ui.right) {
+			ui.active = &pt;
+			pt.x      = ui.x;
+			pt.y      = ui.y;
+		}
+	}
+
+	if (ui.active == &pt) {
+		int xofs = x0 - page_tex.x;
+		int yofs = y0 - page_tex.y;
+
+		fz_point page_a = {pt.x - xofs, pt.y - yofs};
+		fz_point page_b = {ui.x - xofs, ui.y - yofs};
+
+		fz_transform_point(&page_a, &page_inv_ctm);
+		fz_transform_point(&page_b, &page_inv_ctm);
+
+		n = fz_highlight_selection(ctx, text, page_a, page_b, hits, nelem(hits));
+
+		/* the selection follows the mouse, so it's built afresh but still drawn in one go */
+		overlay_begin(&selection_overlay, hits, 0);
+		for (i = 0; i < n; ++i) overlay_add(&selection_overlay, &hits[i], 1);
+
+		glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO); /* invert destination color */
+		glEnable(GL_BLEND);
+
+		glColor4f(1, 1, 1, 1);
+		overlay_draw(&selection_overlay, xofs, yofs, 0, selection_overlay.count);
+
+		glDisable(GL_BLEND);
+
+		if (!ui.right) {
+			char *s;
+#ifdef _WIN32
+			s = fz_copy_selection(ctx, text, page_a, page_b, 1);
+#else
+			s = fz_copy_selection(ctx, text, page_a, page_b, 0);
+#endif
+			ui_set_clipboard(s);
+
+			if (ui.lctrl||ui.rctrl) {
+				flog("%s:%d: Searching internally for '%s'\r\n", FL, s);
+				snprintf(this_search.a, sizeof(this_search.a), "%s", s);
+				this_search.direction = 1;
+				this_search.page = 0;
+				this_search.has_hits = 0;
+				this_search.not_found = 0;
+				this_search.active = 1;
+
+			} else {
+				flog("%s:%d: Dispatching request '%s'\n", FL, s);
+				if (!detached) DDI_dispatch(&ddi, s);
+			}
+			fz_free(ctx, s);
+		}
+	}
+}
+
+
+/*
+ * This is where we colour the search hits on a page
+ *
+ */
+static void do_search_hits(int xofs, int yofs) {
+	struct overlay *o = &hit_overlay;
+	int n = this_search.hit_count_a;
+	unsigned int hash = hash_rects(this_search.hit_bbox_a, n);
+	int cur = this_search.inpage_index;
+	int i;
+
+	xofs -= page_tex.x;
+	yofs -= page_tex.y;
+
+	if (!overlay_is_current(o, this_search.hit_bbox_a, hash, n)) {
+		overlay_begin(o, this_search.hit_bbox_a, hash);
+		for (i = 0; i < n; ++i) overlay_add(o, &this_search.hit_bbox_a[i], 0);
+	}
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glEnable(GL_BLEND);
+
+	/*
+	 * standard faded for other hits
+	 *
+	 */
+	glColor4f(1, 0.2, 0.2, 0.3f);
+	overlay_draw_except(o, xofs, yofs, cur);
+
+	if (cur >= 0 && cur < o->count) {
+		fz_rect r = o->rects[cur];
+		float offset = 5.0f;
+		/*
+		 * highlight the current hit
+		 *
+		 */
+		glColor4f(1, 0.0, 0.2, 0.5f);
+		glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+		glRectf(xofs + r.x0 -offset, yofs + r.y0 -offset, xofs + r.x1 +offset, yofs + r.y1 +offset);
+	}
+
+	glDisable(GL_BLEND);
+}
+
+static void toggle_fullscreen(void) {
+	static int win_x = 0, win_y = 0;
+	static int win_w = 100, win_h = 100;
+	if (!isfullscreen) {
+		SDL_GetWindowSize(sdlWindow, &win_w, &win_h);
+		SDL_GetWindowPosition(sdlWindow, &win_x, &win_y);
+		SDL_SetWindowFullscreen(sdlWindow, 0);
+		isfullscreen = 1;
+	} else {
+		SDL_SetWindowPosition(sdlWindow, win_x, win_y);
+		SDL_SetWindowSize(sdlWindow, win_w, win_h);
+		isfullscreen = 0;
+	}
+}
+
+static void shrinkwrap(void) {
+	int x, y;
+	int screen_w, screen_h;
+	int w, h;
+
+	SDL_GetWindowSize(sdlWindow, &x, &y);
+	screen_w = x - SCREEN_FURNITURE_W;
+	screen_h = y - SCREEN_FURNITURE_H;
+	w        = page_tex.w + canvas_x;
+	h        = page_tex.h + canvas_y;
+
+	if (screen_w > 0 && w > screen_w) w = screen_w;
+	if (screen_h > 0 && h > screen_h) h = screen_h;
+	if (isfullscreen) toggle_fullscreen();
+	// glutReshapeWindow(w, h);
+	SDL_SetWindowSize(sdlWindow, w, h);
+}
+
+/*
+ * Fingerprint the document file for the text index sidecar: the MD5 of
+ * the whole file, so that any change to it, even one that keeps the
+ * size and the trailer, leaves the old index unused.
+ *
+ */
+static void fingerprint_document(unsigned char digest[16]) {
+	fz_stream *stm = fz_open_file(ctx, filename);
+	unsigned char buf[16384];
+	size_t n;
+	fz_md5 md5;
+
+	fz_md5_init(&md5);
+	fz_try(ctx) {
+		while ((n = fz_read(ctx, stm, buf, sizeof(buf))) > 0) fz_md5_update(&md5, buf, n);
+	}
+	fz_always(ctx) fz_drop_stream(ctx, stm);
+	fz_catch(ctx) fz_rethrow(ctx);
+
+	fz_md5_final(&md5, digest);
+}
+
+/*
+ * Find, creating it if need be, the directory the text index sidecars
+ * are kept in: fbvpdf in the user's cache directory, or failing that
+ * fbvpdf-<uid> in /tmp. Indexes loaded from it are trusted, so it has
+ * to be a real directory that belongs to the user and nobody else can
+ * get into.
+ *
+ */
+static int index_cache_dir(char *dir, size_t len) {
+#ifdef _WIN32
+	const char *base = getenv("LOCALAPPDATA");
+
+	if (!base) base = getenv("TEMP");
+	if (!base) return -1;
+	snprintf(dir, len, "%s\\fbvpdf", base);
+	if (_mkdir(dir) < 0 && errno != EEXIST) return -1;
+	return 0;
+#else
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home  = getenv("HOME");
+	struct stat st;
+
+	if (cache && cache[0] == '/') {
+		mkdir(cache, 0700);
+		snprintf(dir, len, "%s/fbvpdf", cache);
+	} else if (home && home[0] == '/') {
+		snprintf(dir, len, "%s/.cache", home);
+		mkdir(dir, 0700);
+		snprintf(dir, len, "%s/.cache/fbvpdf", home);
+	} else {
+		snprintf(dir, len, "/tmp/fbvpdf-%lu", (unsigned long)getuid());
+	}
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) return -1;
+	if (lstat(dir, &st) < 0) return -1;
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) return -1;
+	return 0;
+#endif
+}
+
+/*
+ * Text index sidecars live in the user's index cache directory, named
+ * after the document fingerprint, so the same schematic opened from
+ * anywhere picks up the same index, and a changed file never matches a
+ * stale one.
+ *
+ */
+static void open_doc_index(void) {
+	int pages = fz_count_pages(ctx, doc);
+
+	doc_index_path[0] = '\0';
+	fz_try(ctx) {
+		char dir[PATH_MAX];
+		char hex[33];
+		int i;
+
+		if (index_cache_dir(dir, sizeof(dir)) < 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "no private directory for text indexes");
+
+		fingerprint_document(doc_fingerprint);
+		for (i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", doc_fingerprint[i]);
+		snprintf(doc_index_path, sizeof(doc_index_path), "%s/fbvpdf-%s.idx", dir, hex);
+
+		if (fz_file_exists(ctx, doc_index_path)) {
+			doc_index = fz_load_text_index(ctx, doc_index_path, doc_fingerprint, pages);
+			flog("%s:%d: Loaded text index '%s' (%d of %d pages)\r\n", FL, doc_index_path, fz_count_text_index_pages(ctx, doc_index), pages);
+		} else {
+			doc_index = fz_new_text_index(ctx, pages);
+		}
+	}
+	fz_catch(ctx) {
+		flog("%s:%d: Starting a new text index (%s)\r\n", FL, fz_caught_message(ctx));
+		doc_index = fz_new_text_index(ctx, pages);
+	}
+	doc_index_saved = fz_count_text_index_pages(ctx, doc_index);
+}
+
+/*
+ * Write a text index back out to its sidecar if more pages have been
+ * indexed since it was loaded or last saved.
+ *
+ */
+static void save_index_sidecar(fz_text_index *index, const char *path, const unsigned char *fingerprint, int *saved) {
+	if (!index || !path[0]) return;
+	if (fz_count_text_index_pages(ctx, index) == *saved) return;
+
+	fz_try(ctx) {
+		fz_save_text_index(ctx, index, path, fingerprint);
+		*saved = fz_count_text_index_pages(ctx, index);
+		flog("%s:%d: Saved text index '%s' (%d pages)\r\n", FL, path, *saved);
+	}
+	fz_catch(ctx) {
+		flog("%s:%d: Could not save text index '%s' (%s)\r\n", FL, path, fz_caught_message(ctx));
+	}
+}
+
+static void save_doc_index(void) {
+	save_index_sidecar(doc_index, doc_index_path, doc_fingerprint, &doc_index_saved);
+}
+
+/*
+ * Locking
+ *
+ * The context is created with real locks so that it can be cloned
+ * for the text worker below. Without thread support the viewer runs
+ * with the default (no-op) locks and no worker.
+ *
+ */
+#ifndef DISABLE_MUTHREADS
+static mu_mutex fz_mutexes[FZ_LOCK_MAX];
+
+static void viewer_lock(void *user, int lock) {
+	mu_lock_mutex(&fz_mutexes[lock]);
+}
+
+static void viewer_unlock(void *user, int lock) {
+	mu_unlock_mutex(&fz_mutexes[lock]);
+}
+
+static fz_locks_context viewer_locks = { NULL, viewer_lock, viewer_unlock };
+
+static fz_locks_context *init_viewer_locks(void) {
+	int i, failed = 0;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++) failed |= mu_create_mutex(&fz_mutexes[i]);
+	if (failed) {
+		for (i = 0; i < FZ_LOCK_MAX; i++) mu_destroy_mutex(&fz_mutexes[i]);
+		return NULL;
+	}
+
+	return &viewer_locks;
+}
+#endif
+
+static fz_context *new_viewer_context(void) {
+#ifndef DISABLE_MUTHREADS
+	return fz_new_context(NULL, init_viewer_locks(), STORE_MAX);
+#else
+	return fz_new_context(NULL, NULL, STORE_MAX);
+#endif
+}
+
+/*
+ * Background text worker
+ *
+ * After a document is loaded a thread extracts the text of every page
+ * that isn't in the document index yet, starting with the page on
+ * screen and working outwards. It opens its own instance of the file
+ * with a clone of the viewer's context, as a document can't be used
+ * from two threads at once.
+ *
+ * Finished pages are queued for the UI thread, which picks them up in
+ * text_worker_collect(): they go into the store (where search_page()
+ * finds them) and into the text index. The index itself is only ever
+ * touched from the UI thread.
+ *
+ * A search that reaches a page the worker hasn't got to yet asks for
+ * that page next and lets the SDL loop carry on, rather than extracting
+ * the page itself, so the window stays live through the first search
+ * of a large document.
+ *
+ * The same thread prefetches: the UI names the pages a flip or the next
+ * search is likely to land on (text_worker_prefetch), and the worker
+ * records their display lists ahead of time, taking their text from the
+ * list. Once in the store they make load_page() a lookup and let the
+ * tile worker render their first tiles before they're shown. Recording
+ * stops for a page once PREFETCH_BUDGET bytes of lists have been made
+ * since the view last moved, and a page that drops out of the set has
+ * its recording aborted.
+ *
+ */
+#define TEXT_TODO 0
+#define TEXT_BUSY 1
+#define TEXT_DONE 2
+
+#define PREFETCH_MAX 3
+#define PREFETCH_BUDGET (64 << 20)
+#define PREFETCH_SCAN 256 // pages looked through for the next search hit
+
+struct text_result {
+	int number;
+	fz_stext_page *text; // NULL if the page couldn't be extracted
+	fz_display_list *list; // prefetched contents, or NULL
+	int is_color; // what the test device found in list
+};
+
+struct text_worker {
+	fz_context *ctx; // clone of the viewer's context
+	char *filename;
+	char *password;
+	float layout_w, layout_h, layout_em;
+	int page_count;
+	unsigned char *state; // TEXT_TODO/BUSY/DONE for each page
+	unsigned char *broken; // pages that couldn't be recorded, not to be tried again
+	int current; // page on screen
+	int wanted; // page a search is waiting for, or -1
+	int prefetch[PREFETCH_MAX]; // pages to record ahead, -1 for none
+	int prefetching; // page being recorded, or -1
+	int running;
+	int waiting; // the thread is (about to be) asleep on 'wake'
+	int quit;
+	fz_cookie cookie; // abort set to stop the worker mid-page
+	fz_cookie prefetch_cookie; // abort set when the page being recorded isn't wanted any more
+	struct text_result *ready;
+	int ready_len, ready_cap;
+#ifndef DISABLE_MUTHREADS
+	mu_mutex lock;
+	mu_semaphore wake;
+	mu_thread thread;
+#endif
+};
+
+static struct text_worker *text_worker = NULL;
+static size_t prefetch_bytes = 0; // size of the lists prefetched since the view last moved
+
+#ifndef DISABLE_MUTHREADS
+/* Next page to extract, the wanted one or the nearest to the current one. Called locked. */
+static int text_worker_next(struct text_worker *w) {
+	int d;
+
+	if (w->wanted >= 0 && w->state[w->wanted] == TEXT_TODO) return w->wanted;
+
+	for (d = 0; d < w->page_count; d++) {
+		if (w->current + d < w->page_count && w->state[w->current + d] == TEXT_TODO) return w->current + d;
+		if (w->current - d >= 0 && w->state[w->current - d] == TEXT_TODO) return w->current - d;
+	}
+
+	return -1;
+}
+
+static fz_stext_page *text_worker_extract(struct text_worker *w, fz_document *wdoc, int number) {
+	fz_context *wctx = w->ctx;
+	fz_stext_page *stext = NULL;
+	fz_page *wpage = NULL;
+	fz_device *dev = NULL;
+	fz_rect mediabox;
+
+	fz_var(stext);
+	fz_var(wpage);
+	fz_var(dev);
+	fz_try(wctx) {
+		wpage = fz_load_page(wctx, wdoc, number);
+		stext = fz_new_stext_page(wctx, fz_bound_page(wctx, wpage, &mediabox));
+		dev = fz_new_stext_device(wctx, stext, NULL);
+		fz_run_page_contents(wctx, wpage, dev, &fz_identity, &w->cookie);
+		fz_close_device(wctx, dev);
+		if (w->cookie.abort) fz_throw(wctx, FZ_ERROR_GENERIC, "text worker stopped");
+	}
+	fz_always(wctx) {
+		fz_drop_device(wctx, dev);
+		fz_drop_page(wctx, wpage);
+	}
+	fz_catch(wctx) {
+		fz_drop_stext_page(wctx, stext);
+		stext = NULL;
+	}
+
+	return stext;
+}
+
+/*
+ * Record a page's contents the way fz_load_display_list does, through
+ * a test device that finds out whether the page has colour on the way.
+ * NULL if aborted or broken.
+ *
+ */
+static fz_display_list *text_worker_record(struct text_worker *w, fz_document *wdoc, int number, int *is_color) {
+	fz_context *wctx = w->ctx;
+	fz_display_list *list = NULL;
+	fz_page *wpage = NULL;
+	fz_device *dev = NULL;
+	fz_device *test = NULL;
+	fz_rect mediabox;
+
+	fz_var(list);
+	fz_var(wpage);
+	fz_var(dev);
+	fz_var(test);
+	fz_try(wctx) {
+		wpage = fz_load_page(wctx, wdoc, number);
+		list = fz_new_display_list(wctx, fz_bound_page(wctx, wpage, &mediabox));
+		dev = fz_new_list_device(wctx, list);
+		test = fz_new_test_device(wctx, is_color, 0.02f, 0, dev);
+		fz_run_page_contents(wctx, wpage, test, &fz_identity, &w->prefetch_cookie);
+		fz_close_device(wctx, test);
+		fz_close_device(wctx, dev);
+		if (w->prefetch_cookie.abort) fz_throw(wctx, FZ_ERROR_GENERIC, "prefetch cancelled");
+	}
+	fz_always(wctx) {
+		fz_drop_device(wctx, test);
+		fz_drop_device(wctx, dev);
+		fz_drop_page(wctx, wpage);
+	}
+	fz_catch(wctx) {
+		fz_drop_display_list(wctx, list);
+		list = NULL;
+	}
+
+	return list;
+}
+
+/* Queue a finished page for the UI thread. Called locked. */
+static void text_worker_deliver(struct text_worker *w, int number, fz_stext_page *stext, fz_display_list *list, int is_color) {
+	if (w->ready_len == w->ready_cap) {
+		int cap = w->ready_cap ? w->ready_cap * 2 : 16;
+		struct text_result *r = realloc(w->ready, cap * sizeof(*r));
+		if (r) {
+			w->ready = r;
+			w->ready_cap = cap;
+		}
+	}
+	if (w->ready_len < w->ready_cap) {
+		w->ready[w->ready_len].number = number;
+		w->ready[w->ready_len].text = stext;
+		w->ready[w->ready_len].list = list;
+		w->ready[w->ready_len].is_color = is_color;
+		w->ready_len++;
+		wake_ui();
+	} else {
+		fz_drop_stext_page(w->ctx, stext);
+		fz_drop_display_list(w->ctx, list);
+	}
+}
+
+static void text_worker_run(void *arg) {
+	struct text_worker *w = arg;
+	fz_context *wctx = w->ctx;
+	fz_document *wdoc = NULL;
+	fz_stext_page *stext;
+	fz_display_list *list;
+	int number, prefetch, need_text, is_color, i;
+
+	fz_var(wdoc);
+	fz_try(wctx) {
+		wdoc = fz_open_document(wctx, w->filename);
+		if (fz_needs_password(wctx, wdoc) && !fz_authenticate_password(wctx, wdoc, w->password))
+			fz_throw(wctx, FZ_ERROR_GENERIC, "cannot authenticate");
+		fz_layout_document(wctx, wdoc, w->layout_w, w->layout_h, w->layout_em);
+	}
+	fz_catch(wctx) {
+		fz_drop_document(wctx, wdoc);
+		wdoc = NULL;
+	}
+
+	while (wdoc) {
+		/* a page a search waits on, then the prefetch set, then the rest of the text */
+		mu_lock_mutex(&w->lock);
+		for (;;) {
+			number = prefetch = -1;
+			if (w->quit) break;
+			if (w->wanted >= 0 && w->state[w->wanted] == TEXT_TODO) {
+				number = w->wanted;
+				break;
+			}
+			for (i = 0; i < PREFETCH_MAX && prefetch < 0; i++) {
+				if (w->prefetch[i] >= 0 && !w->broken[w->prefetch[i]]) prefetch = w->prefetch[i];
+				w->prefetch[i] = -1;
+			}
+			if (prefetch >= 0) break;
+			number = text_worker_next(w);
+			if (number >= 0) break;
+
+			w->waiting = 1;
+			mu_unlock_mutex(&w->lock);
+			mu_wait_semaphore(&w->wake);
+			mu_lock_mutex(&w->lock);
+		}
+		if (number < 0 && prefetch < 0) {
+			mu_unlock_mutex(&w->lock);
+			break;
+		}
+		if (prefetch >= 0) {
+			need_text = w->state[prefetch] == TEXT_TODO;
+			if (need_text) w->state[prefetch] = TEXT_BUSY;
+			w->prefetching = prefetch;
+			memset(&w->prefetch_cookie, 0, sizeof(w->prefetch_cookie));
+		} else {
+			w->state[number] = TEXT_BUSY;
+		}
+		mu_unlock_mutex(&w->lock);
+
+		if (prefetch >= 0) {
+			stext = NULL;
+			is_color = 0;
+			list = text_worker_record(w, wdoc, prefetch, &is_color);
+			if (list && need_text) {
+				fz_try(wctx) stext = fz_new_stext_page_from_display_list(wctx, list, NULL);
+				fz_catch(wctx) stext = NULL;
+			}
+
+			mu_lock_mutex(&w->lock);
+			w->prefetching = -1;
+			if (!list && !w->prefetch_cookie.abort) w->broken[prefetch] = 1;
+			if (list || stext) text_worker_deliver(w, prefetch, stext, list, is_color);
+			/* a cancelled page still needs its text in time */
+			if (need_text) w->state[prefetch] = stext ? TEXT_DONE : TEXT_TODO;
+			mu_unlock_mutex(&w->lock);
+			continue;
+		}
+
+		stext = text_worker_extract(w, wdoc, number);
+
+		mu_lock_mutex(&w->lock);
+		text_worker_deliver(w, number, stext, NULL, 0);
+		w->state[number] = TEXT_DONE;
+		mu_unlock_mutex(&w->lock);
+	}
+
+	fz_drop_document(wctx, wdoc);
+
+	mu_lock_mutex(&w->lock);
+	w->running = 0;
+	mu_unlock_mutex(&w->lock);
+}
+
+/* Wake the worker if it's asleep. Called locked. */
+static void text_worker_wake(struct text_worker *w) {
+	if (w->waiting) {
+		w->waiting = 0;
+		mu_trigger_semaphore(&w->wake);
+	}
+}
+
+/* Add page number to the prefetch list unless it's prepared already. */
+static int prefetch_add(int *pages, int n, int number) {
+	fz_display_list *list;
+	int i;
+
+	if (number < 0 || number >= fz_count_pages(ctx, doc) || number == currently_viewed_page) return n;
+	for (i = 0; i < n; i++) {
+		if (pages[i] == number) return n;
+	}
+
+	list = fz_find_cached_display_list(ctx, doc, number);
+	if (list) {
+		fz_drop_display_list(ctx, list);
+		return n;
+	}
+
+	pages[n++] = number;
+	return n;
+}
+
+/* The page after this_search.page the index says could hold the next hit, or -1. */
+static int next_search_page(void) {
+	int count = fz_count_pages(ctx, doc);
+	int i, number;
+
+	if (!strlen(this_search.a) || !doc_index || count <= 0) return -1;
+
+	number = this_search.page;
+	for (i = 0; i < fz_mini(PREFETCH_SCAN, count); i++) {
+		number = (number + (this_search.direction < 0 ? count - 1 : 1)) % count;
+		if (fz_text_index_may_contain(ctx, doc_index, number, this_search.a, 0)) return number;
+	}
+
+	return -1;
+}
+
+/* Tell the worker which pages to prepare next. Called from the UI thread. */
+static void text_worker_prefetch(struct text_worker *w) {
+	int pages[PREFETCH_MAX];
+	int i, k, n = 0, cancel;
+
+	if (prefetch_bytes < PREFETCH_BUDGET && runmode == RUNMODE_NORMAL) {
+		n = prefetch_add(pages, n, currently_viewed_page + 1);
+		n = prefetch_add(pages, n, currently_viewed_page - 1);
+		n = prefetch_add(pages, n, next_search_page());
+	}
+
+	mu_lock_mutex(&w->lock);
+	cancel = w->prefetching >= 0;
+	for (i = 0; i < PREFETCH_MAX; i++) {
+		w->prefetch[i] = -1;
+		if (i >= n) continue;
+		if (pages[i] == w->prefetching) {
+			cancel = 0;
+			continue;
+		}
+		for (k = 0; k < w->ready_len && w->ready[k].number != pages[i]; k++) continue;
+		if (k == w->ready_len) w->prefetch[i] = pages[i];
+	}
+	if (cancel) w->prefetch_cookie.abort = 1;
+	for (i = 0; i < PREFETCH_MAX; i++) {
+		if (w->prefetch[i] >= 0) text_worker_wake(w);
+	}
+	mu_unlock_mutex(&w->lock);
+}
+#endif
+
+/*
+ * Hand the pages the worker has finished to the store and the text
+ * index, and tell it which page is on screen and which to prefetch.
+ * Called from the UI thread.
+ *
+ */
+static void text_worker_collect(void) {
+#ifndef DISABLE_MUTHREADS
+	struct text_worker *w = text_worker;
+	struct text_result *ready;
+	int i, n, current;
+
+	if (!w) return;
+
+	current = fz_clampi(currently_viewed_page, 0, w->page_count - 1);
+	mu_lock_mutex(&w->lock);
+	if (w->current != current) prefetch_bytes = 0;
+	w->current = current;
+	ready = w->ready;
+	n = w->ready_len;
+	w->ready = NULL;
+	w->ready_len = w->ready_cap = 0;
+	mu_unlock_mutex(&w->lock);
+
+	for (i = 0; i < n; i++) {
+		if (ready[i].list) {
+			prefetch_bytes += fz_display_list_size(ctx, ready[i].list);
+			note_page_color(ready[i].number, ready[i].is_color);
+			fz_cache_display_list(ctx, doc, ready[i].number, ready[i].list);
+			fz_drop_display_list(ctx, ready[i].list);
+		}
+		if (!ready[i].text) continue;
+		fz_try(ctx) {
+			fz_cache_stext_page(ctx, doc, ready[i].number, NULL, ready[i].text);
+			note_page_text(ready[i].number, ready[i].text);
+		}
+		fz_always(ctx) fz_drop_stext_page(ctx, ready[i].text);
+		fz_catch(ctx) flog("%s:%d: Couldn't index page %d (%s)\r\n", FL, ready[i].number + 1, fz_caught_message(ctx));
+	}
+	free(ready);
+
+	text_worker_prefetch(w);
+#endif
+}
+
+/*
+ * Returns non-zero if the worker is still to deliver the text of page
+ * number, asking for it next. A search should come back to the page
+ * later instead of extracting it on the UI thread.
+ *
+ */
+static int text_worker_pending(int number) {
+	int pending = 0;
+#ifndef DISABLE_MUTHREADS
+	struct text_worker *w = text_worker;
+
+	text_worker_collect();
+	if (!w || fz_text_index_has_page(ctx, doc_index, number)) return 0;
+
+	mu_lock_mutex(&w->lock);
+	if (w->running && number >= 0 && number < w->page_count && w->state[number] != TEXT_DONE) {
+		w->wanted = number;
+		text_worker_wake(w);
+		pending = 1;
+	}
+	mu_unlock_mutex(&w->lock);
+#endif
+	return pending;
+}
+
+static void text_worker_stop(void) {
+#ifndef DISABLE_MUTHREADS
+	struct text_worker *w = text_worker;
+	int i;
+
+	if (!w) return;
+
+	mu_lock_mutex(&w->lock);
+	w->quit = 1;
+	w->cookie.abort = 1;
+	w->prefetch_cookie.abort = 1;
+	text_worker_wake(w);
+	mu_unlock_mutex(&w->lock);
+	mu_destroy_thread(&w->thread);
+
+	/* anything that finished is still worth keeping in the index */
+	text_worker_collect();
+
+	for (i = 0; i < w->ready_len; i++) {
+		fz_drop_stext_page(ctx, w->ready[i].text);
+		fz_drop_display_list(ctx, w->ready[i].list);
+	}
+	free(w->ready);
+	mu_destroy_semaphore(&w->wake);
+	mu_destroy_mutex(&w->lock);
+	fz_drop_context(w->ctx);
+	free(w->state);
+	free(w->broken);
+	free(w->filename);
+	free(w->password);
+	free(w);
+	text_worker = NULL;
+	prefetch_bytes = 0;
+#endif
+}
+
+static void text_worker_start(void) {
+#ifndef DISABLE_MUTHREADS
+	struct text_worker *w;
+	int i;
+
+	if (text_worker || !doc || !doc_index) return;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) return;
+
+	w->ctx = fz_clone_context(ctx);
+	w->page_count = fz_count_pages(ctx, doc);
+	w->state = calloc(fz_maxi(w->page_count, 1), 1);
+	w->broken = calloc(fz_maxi(w->page_count, 1), 1);
+	w->filename = strdup(filename);
+	w->password = strdup(password);
+	if (!w->ctx || !w->state || !w->broken || !w->filename || !w->password || mu_create_mutex(&w->lock)) {
+		flog("%s:%d: No background text worker\r\n", FL);
+		fz_drop_context(w->ctx);
+		free(w->state);
+		free(w->broken);
+		free(w->filename);
+		free(w->password);
+		free(w);
+		return;
+	}
+	if (mu_create_semaphore(&w->wake)) {
+		flog("%s:%d: No background text worker\r\n", FL);
+		mu_destroy_mutex(&w->lock);
+		fz_drop_context(w->ctx);
+		free(w->state);
+		free(w->broken);
+		free(w->filename);
+		free(w->password);
+		free(w);
+		return;
+	}
+
+	for (i = 0; i < w->page_count; i++) {
+		if (fz_text_index_has_page(ctx, doc_index, i)) w->state[i] = TEXT_DONE;
+	}
+	for (i = 0; i < PREFETCH_MAX; i++) w->prefetch[i] = -1;
+	w->layout_w = layout_w;
+	w->layout_h = layout_h;
+	w->layout_em = layout_em;
+	w->current = currently_viewed_page;
+	w->wanted = -1;
+	w->prefetching = -1;
+	w->running = 1;
+
+	text_worker = w;
+	if (mu_create_thread(&w->thread, text_worker_run, w)) {
+		w->running = 0;
+		text_worker_stop();
+		return;
+	}
+
+	flog("%s:%d: Background text worker started (%d pages)\r\n", FL, w->page_count);
+#endif
+}
+
+static void load_document(void) {
+	text_worker_stop();
+	tile_worker_stop();
+	tile_cache_clear();
+	fz_drop_outline(ctx, outline);
+	save_doc_index();
+	fz_drop_text_index(ctx, doc_index);
+	doc_index = NULL;
+	drop_page_texts(&doc_text);
+	link_overlay.page = -1;
+	fz_drop_document(ctx, doc);
+
+	doc = fz_open_document(ctx, filename);
+	if (fz_needs_password(ctx, doc)) {
+		if (!fz_authenticate_password(ctx, doc, password)) {
+			fprintf(stderr, "Invalid password.\n");
+			exit(1);
+		}
+	}
+
+	fz_layout_document(ctx, doc, layout_w, layout_h, layout_em);
+
+	fz_try(ctx) outline   = fz_load_outline(ctx, doc);
+	fz_catch(ctx) outline = NULL;
+
+	pdf = pdf_specifics(ctx, doc);
+	if (pdf) {
+		pdf_enable_js(ctx, pdf);
+		if (anchor) currently_viewed_page = pdf_lookup_anchor(ctx, pdf, anchor, NULL, NULL);
+	} else {
+		if (anchor) currently_viewed_page = fz_atoi(anchor) - 1;
+	}
+	anchor = NULL;
+
+	open_doc_index();
+	init_page_texts(&doc_text, fz_count_pages(ctx, doc));
+	reset_page_colors(fz_count_pages(ctx, doc));
+
+	currently_viewed_page = fz_clampi(currently_viewed_page, 0, fz_count_pages(ctx, doc) - 1);
+
+	if (runmode == RUNMODE_NORMAL) {
+		text_worker_start();
+		tile_worker_start();
+	}
+}
+
+/*
+ * Search a single page for needle.
+ *
+ * Pages whose words are already in the document index are skipped
+ * without touching their text when the index rules out a hit. Otherwise
+ * the page's compact text is searched; the first time round it comes
+ * from the store and gets indexed and kept on the way through, so
+ * repeated searches only ever extract a page once.
+ *
+ */
+static int search_page(int number, const char *needle, fz_rect *hit_bbox, int hit_max) {
+	fz_stext_page *stext;
+	int count = 0;
+
+	if (!fz_text_index_may_contain(ctx, doc_index, number, needle, ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH)) return 0;
+
+	if (number >= 0 && number < doc_text.count && doc_text.page[number])
+		return fz_search_compact_stext(ctx, doc_text.page[number], needle, hit_bbox, hit_max);
+
+	stext = fz_load_stext_page(ctx, doc, number, NULL);
+	fz_try(ctx) {
+		note_page_text(number, stext);
+		if (number >= 0 && number < doc_text.count && doc_text.page[number])
+			count = fz_search_compact_stext(ctx, doc_text.page[number], needle, hit_bbox, hit_max);
+		else
+			count = fz_search_stext_page(ctx, stext, needle, hit_bbox, hit_max);
+	}
+	fz_always(ctx) fz_drop_stext_page(ctx, stext);
+	fz_catch(ctx) fz_rethrow(ctx);
+
+	return count;
+}
+
+/*
+ * Search a page for every hit of needle, growing the list until
+ * the search no longer fills it. An empty needle clears the list.
+ */
+static int search_page_hits(int number, const char *needle, struct hit_list *hits) {
+	hits->len = 0;
+	if (needle[0] == '\0') return 0;
+
+	if (hits->cap == 0) {
+		hits->box = fz_malloc_array(ctx, nelem(this_search.hit_bbox_a), sizeof(fz_rect));
+		hits->cap = nelem(this_search.hit_bbox_a);
+	}
+
+	while ((hits->len = search_page(number, needle, hits->box, hits->cap)) == hits->cap) {
+		hits->box = fz_resize_array(ctx, hits->box, hits->cap * 2, sizeof(fz_rect));
+		hits->cap *= 2;
+	}
+
+	return hits->len;
+}
+
+/*
+ * Search a page for several needles in a single pass over its text, eg,
+ * the parts of a compound query or a needle and its alternative.
+ * hits[i] gets every hit of needles[i]; empty needles and those the
+ * document index rules out get none. Returns the total number of hits.
+ *
+ */
+#define SEARCH_NEEDLES_MAX 4
+
+static int search_page_needles(int number, int count, const char **needles, struct hit_list **hits) {
+	const char *live[SEARCH_NEEDLES_MAX];
+	struct hit_list *out[SEARCH_NEEDLES_MAX];
+	fz_rect *box[SEARCH_NEEDLES_MAX];
+	int max[SEARCH_NEEDLES_MAX], len[SEARCH_NEEDLES_MAX];
+	fz_stext_needles *set;
+	fz_stext_page *stext = NULL;
+	int strict = ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH;
+	int i, n = 0, full, total = 0;
+
+	for (i = 0; i < count && i < SEARCH_NEEDLES_MAX; i++) {
+		hits[i]->len = 0;
+		if (needles[i][0] == '\0') continue;
+		if (!fz_text_index_may_contain(ctx, doc_index, number, needles[i], strict)) continue;
+
+		if (hits[i]->cap == 0) {
+			hits[i]->box = fz_malloc_array(ctx, nelem(this_search.hit_bbox_a), sizeof(fz_rect));
+			hits[i]->cap = nelem(this_search.hit_bbox_a);
+		}
+		live[n] = needles[i];
+		out[n] = hits[i];
+		n++;
+	}
+	if (n == 0) return 0;
+
+	set = fz_new_stext_needles(ctx, n, live);
+
+	fz_var(stext);
+
+	fz_try(ctx) {
+		if (number < 0 || number >= doc_text.count || !doc_text.page[number]) {
+			stext = fz_load_stext_page(ctx, doc, number, NULL);
+			note_page_text(number, stext);
+		}
+
+		do {
+			for (i = 0; i < n; i++) {
+				box[i] = out[i]->box;
+				max[i] = out[i]->cap;
+			}
+			if (number >= 0 && number < doc_text.count && doc_text.page[number])
+				fz_search_compact_stext_needles(ctx, doc_text.page[number], set, box, max, len);
+			else
+				fz_search_stext_page_needles(ctx, stext, set, box, max, len);
+
+			full = 0;
+			for (i = 0; i < n; i++) {
+				out[i]->len = len[i];
+				if (len[i] == out[i]->cap) {
+					out[i]->box = fz_resize_array(ctx, out[i]->box, out[i]->cap * 2, sizeof(fz_rect));
+					out[i]->cap *= 2;
+					full = 1;
+				}
+			}
+		} while (full);
+	}
+	fz_always(ctx) {
+		fz_drop_stext_page(ctx, stext);
+		fz_drop_stext_needles(ctx, set);
+	}
+	fz_catch(ctx) fz_rethrow(ctx);
+
+	for (i = 0; i < n; i++) total += out[i]->len;
+	return total;
+}
+
+/*
+ * Search a page for all the parts of a compound query at once.
+ *
+ */
+static int search_page_parts(int number, const char *a, const char *b, const char *c) {
+	const char *needles[3] = { a, b, c };
+	struct hit_list *lists[3] = { &hits_a, &hits_b, &hits_c };
+
+	search_page_needles(number, 3, needles, lists);
+	return hits_a.len;
+}
+
+/*
+ * Get the text of the pages a whole document search is about to go
+ * through ready on every core at once: wanted[] marks those pages (NULL
+ * for all of them). Pages missing from the index are extracted in runs,
+ * indexed and handed to the store, where search_page will find them,
+ * so the search itself no longer has to interpret page after page.
+ *
+ */
+#define WARM_RUN_PER_CPU 4
+
+static void warm_page_text(const unsigned char *wanted) {
+#ifndef DISABLE_MUTHREADS
+	mu_stext_source src;
+	fz_stext_page **text;
+	int pages, cpus, run, start, end, k;
+
+	if (!doc || !doc_index) return;
+
+	pages = fz_count_pages(ctx, doc);
+	cpus = fz_clampi(count_cpus(), 1, BAND_THREADS_MAX);
+	if (cpus == 1) return;
+	run = cpus * WARM_RUN_PER_CPU;
+
+	/* the workers' documents stay open until this one is closed */
+	if (!doc_text.pool) {
+		src.filename = filename;
+		src.password = password;
+		src.layout_w = layout_w;
+		src.layout_h = layout_h;
+		src.layout_em = layout_em;
+		fz_try(ctx) doc_text.pool = mu_new_stext_pool(ctx, &src, cpus);
+		fz_catch(ctx) {
+			flog("%s:%d: Text warm-up skipped (%s)\r\n", FL, fz_caught_message(ctx));
+			return;
+		}
+	}
+
+	for (start = 0; start < pages; start = end) {
+		while (start < pages && ((wanted && !wanted[start]) || fz_text_index_has_page(ctx, doc_index, start))) start++;
+		for (end = start; end < pages && end - start < run; end++) {
+			if ((wanted && !wanted[end]) || fz_text_index_has_page(ctx, doc_index, end)) break;
+		}
+		if (start == end) break;
+
+		text = NULL;
+		fz_var(text);
+		fz_try(ctx) {
+			text = mu_new_stext_pages(ctx, doc_text.pool, doc, start, end, NULL, 0, NULL);
+			for (k = start; k < end; k++) {
+				if (!text[k - start]) continue;
+				note_page_text(k, text[k - start]);
+				fz_cache_stext_page(ctx, doc, k, NULL, text[k - start]);
+			}
+		}
+		fz_always(ctx) mu_drop_stext_pages(ctx, text, end - start);
+		fz_catch(ctx) {
+			flog("%s:%d: Text warm-up stopped at page %d (%s)\r\n", FL, start + 1, fz_caught_message(ctx));
+			return;
+		}
+	}
+#endif
+}
+
+/*
+ * Hits being collected for a '!hitlist:' reply, one line per hit,
+ *
+ *    !hit:<match> <page> <part> <x0> <y0> <x1> <y1>
+ *
+ * Page is 1-based and the box is in page coordinates. Part is the
+ * compound search term the box was found for (a, b or c); the boxes
+ * that make up one match share its match number.
+ *
+ */
+struct hit_stream {
+	fz_buffer *buf;
+	int matches;
+};
 
+static void stream_hit(struct hit_stream *hs, int number, char part, const fz_rect *r) {
+	fz_append_printf(ctx, hs->buf, "!hit:%d %d %c %g %g %g %g\r\n",
+			hs->matches, number + 1, part, r->x0, r->y0, r->x1, r->y1);
+}
 
-//			glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO); /* invert destination color */
-			glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-			glEnable(GL_BLEND);
-			glColor4f(1, 0.0, 0.2, 0.5f);
-			glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
-			glRectf(xofs + r.x0 -offset, yofs + r.y0 -offset, xofs + r.x1 +offset, yofs + r.y1 +offset);
-			glDisable(GL_BLEND);
-	/*
-			glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-			glEnable(GL_BLEND);
-			glLineWidth(3.0f);
-			glColor4f(0, 0, 0, 0.20f);
-			glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
-			glRectf(xofs + r.x0 -loffset, yofs + r.y0 -loffset, xofs + r.x1 +loffset, yofs + r.y1 +loffset);
-			glLineWidth(1.0f);
-			glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
-			glDisable(GL_BLEND);
-			*/
+/*
+ * Match up the compound search parts on the current page.
+ *
+ * Each 'a' hit is kept if there is a 'b' hit and a 'c' hit (when
+ * those parts were searched for) within compsearch_radius of it,
+ * measured corner to corner. The nearest ones are looked up through
+ * a spatial grid over the b/c hits rather than by comparing every
+ * pair.
+ *
+ * When record is set the kept hits replace this_search.hit_bbox_a,
+ * highlighted according to compsearch_highlight. When hs is given,
+ * each kept hit and the parts it matched are streamed to it as hits
+ * on page number.
+ *
+ * Returns the number of kept hits.
+ *
+ */
+static int compound_merge(int record, struct hit_stream *hs, int number) {
+	fz_stext_grid *grid_b = NULL;
+	fz_stext_grid *grid_c = NULL;
+	int new_hit_count = 0;
+	float radius;
+	int i;
 
-		} else {
-			/*
-			 * standard faded for other hits
-			 *
-			 */
-		//	glColor4f(1, 0, 0, 0.1f);
-			glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-			glEnable(GL_BLEND);
-			glColor4f(1, 0.2, 0.2, 0.3f);
-			glRectf(xofs + r.x0, yofs + r.y0, xofs + r.x1, yofs + r.y1);
-			glDisable(GL_BLEND);
-		}
-//		glRect(xofs + r.x0 -2, yofs + r.y0 -2, xofs + r.x1 +2, yofs + r.y1 +2);
-	}
+	if (strlen(this_search.b) && (hits_b.len == 0)) return 0;
+	if (strlen(this_search.c) && (hits_c.len == 0)) return 0;
 
-}
+	/* compsearch_radius has always been compared against the squared distance */
+	radius = sqrtf(compsearch_radius);
 
-static void toggle_fullscreen(void) {
-	static int win_x = 0, win_y = 0;
-	static int win_w = 100, win_h = 100;
-	if (!isfullscreen) {
-		SDL_GetWindowSize(sdlWindow, &win_w, &win_h);
-		SDL_GetWindowPosition(sdlWindow, &win_x, &win_y);
-		SDL_SetWindowFullscreen(sdlWindow, 0);
-		isfullscreen = 1;
-	} else {
-		SDL_SetWindowPosition(sdlWindow, win_x, win_y);
-		SDL_SetWindowSize(sdlWindow, win_w, win_h);
-		isfullscreen = 0;
-	}
-}
+	fz_var(grid_b);
+	fz_var(grid_c);
+	fz_try(ctx) {
+		if (hits_b.len) grid_b = fz_new_stext_grid(ctx, hits_b.box, hits_b.len);
+		if (hits_c.len) grid_c = fz_new_stext_grid(ctx, hits_c.box, hits_c.len);
 
-static void shrinkwrap(void) {
-	int x, y;
-	int screen_w, screen_h;
-	int w, h;
+		for (i = 0; i < hits_a.len; i++) {
+			fz_rect a = hits_a.box[i];
+			fz_point p;
+			int closest_b = -1;
+			int closest_c = -1;
 
-	SDL_GetWindowSize(sdlWindow, &x, &y);
-	screen_w = x - SCREEN_FURNITURE_W;
-	screen_h = y - SCREEN_FURNITURE_H;
-	w        = page_tex.w + canvas_x;
-	h        = page_tex.h + canvas_y;
+			p.x = a.x0;
+			p.y = a.y0;
+			if (grid_b && (closest_b = fz_nearest_stext_grid(ctx, grid_b, &p, radius)) < 0) continue;
+			if (grid_c && (closest_c = fz_nearest_stext_grid(ctx, grid_c, &p, radius)) < 0) continue;
 
-	if (screen_w > 0 && w > screen_w) w = screen_w;
-	if (screen_h > 0 && h > screen_h) h = screen_h;
-	if (isfullscreen) toggle_fullscreen();
-	// glutReshapeWindow(w, h);
-	SDL_SetWindowSize(sdlWindow, w, h);
-}
+			if (hs) {
+				hs->matches++;
+				stream_hit(hs, number, 'a', &hits_a.box[i]);
+				if (closest_b >= 0) stream_hit(hs, number, 'b', &hits_b.box[closest_b]);
+				if (closest_c >= 0) stream_hit(hs, number, 'c', &hits_c.box[closest_c]);
+			}
 
-static void load_document(void) {
-	fz_drop_outline(ctx, outline);
-	fz_drop_document(ctx, doc);
+			if (record && new_hit_count < (int)nelem(this_search.hit_bbox_a)) {
+				if (compsearch_highlight == 8) {
+					if (closest_b >= 0) fz_union_rect(&a, &hits_b.box[closest_b]);
+					if (closest_c >= 0) fz_union_rect(&a, &hits_c.box[closest_c]);
+				} else if (compsearch_highlight == 2) {
+					if (closest_b >= 0) a = hits_b.box[closest_b];
+				} else if (compsearch_highlight == 1) {
+					if (closest_c >= 0) a = hits_c.box[closest_c];
+				}
 
-	doc = fz_open_document(ctx, filename);
-	if (fz_needs_password(ctx, doc)) {
-		if (!fz_authenticate_password(ctx, doc, password)) {
-			fprintf(stderr, "Invalid password.\n");
-			exit(1);
-		}
+				this_search.hit_bbox_a[new_hit_count] = a;
+			}
+			new_hit_count++;
+		} // for each main search hit
 	}
+	fz_always(ctx) {
+		fz_drop_stext_grid(ctx, grid_b);
+		fz_drop_stext_grid(ctx, grid_c);
+	}
+	fz_catch(ctx) fz_rethrow(ctx);
 
-	fz_layout_document(ctx, doc, layout_w, layout_h, layout_em);
-
-	fz_try(ctx) outline   = fz_load_outline(ctx, doc);
-	fz_catch(ctx) outline = NULL;
+	flog("%s:%d: %d of %d hit(s) for '%s' within %f of '%s' and '%s'\r\n",
+			FL,
+			new_hit_count,
+			hits_a.len,
+			this_search.a,
+			compsearch_radius,
+			this_search.b,
+			this_search.c);
 
-	pdf = pdf_specifics(ctx, doc);
-	if (pdf) {
-		pdf_enable_js(ctx, pdf);
-		if (anchor) currently_viewed_page = pdf_lookup_anchor(ctx, pdf, anchor, NULL, NULL);
-	} else {
-		if (anchor) currently_viewed_page = fz_atoi(anchor) - 1;
-	}
-	anchor = NULL;
+	if (record) new_hit_count = fz_mini(new_hit_count, nelem(this_search.hit_bbox_a));
 
-	currently_viewed_page = fz_clampi(currently_viewed_page, 0, fz_count_pages(ctx, doc) - 1);
+	return new_hit_count;
 }
 
 static void reload(void) {
@@ -1525,7 +3733,9 @@ static void do_canvas(void) {
 	float x, y;
 
 	if (oldpage != currently_viewed_page || oldzoom != currentzoom || oldrotate != currentrotate || oldinvert != currentinvert) {
-		render_page();
+		/* rotation and inversion are applied as the tiles are drawn */
+		if (oldpage != currently_viewed_page || oldzoom != currentzoom) render_page();
+		else if (oldrotate != currentrotate) update_page_ctm();
 		update_title();
 		oldpage   = currently_viewed_page;
 		oldzoom   = currentzoom;
@@ -1537,7 +3747,7 @@ static void do_canvas(void) {
 	y = canvas_y - scroll_y;
 
 
-	ui_draw_image(&page_tex, x - page_tex.x, y - page_tex.y);
+	draw_page_tiles(x, y);
 
 	if (!this_search.active) {
 		do_links(links, x, y);
@@ -1547,173 +3757,221 @@ static void do_canvas(void) {
 
 }
 
-int ddi_process_keymap( char *ddi_data, char *keystr, int index ) {
-	//	flog("%s:%d: processing keymap, %s [ %d ]\n", FL, keystr, index);
-	if (strstr(ddi_data, keystr)) {
-		char *p = strstr(ddi_data, keystr);
-		if (p) {
-			p += strlen(keystr);
-			sscanf(p,"%d %x", &keyboard_map[index].key, &keyboard_map[index].mods);
-			//			flog("%s:%d: imported %d & %x\n", FL, keyboard_map[index].key, keyboard_map[index].mods);
-		}
+/*
+ * DDI command parsing
+ *
+ * A DDI message is one or more lines, each holding '!name:' commands
+ * (or '!name=' keymap settings). An argument runs from just after the
+ * name up to the '!' of the next known command or the end of its line,
+ * whichever comes first, so "!csradius:100!compsearch:a:b" is two
+ * commands and an argument can't itself hold '!' followed by a command
+ * name. Anything that isn't a known command is skipped.
+ *
+ * Commands run in the order they appear, repeats included, so one
+ * message can carry setup, navigation and a search. The one exception:
+ * once a message has set up a search ('!search:', '!pagesearch:' or
+ * '!compsearch:'), a later '!load:', '!gotopg:' or '!getstats:' in the
+ * same message no longer clears it.
+ *
+ * '!id:<token>' tags the message; replies sent while handling it
+ * (and the headless result that follows it) start with the same
+ * '!id:<token>' line, so a client can pipeline requests.
+ *
+ */
+static char *ddi_payload; // the whole message being processed
+static char ddi_request_id[64];
+static int ddi_search_set; // the message being processed has set up a search
+
+/*
+ * Clear the search for a load or page move, unless the message being
+ * processed set one up.
+ *
+ */
+static void ddi_clear_search(void) {
+	if (!ddi_search_set) clear_search();
+}
+
+/*
+ * Dispatch a reply to the current request, tagged with its ID if it had one.
+ *
+ */
+static void ddi_reply(const char *msg) {
+	char *tagged;
+	size_t sz;
+
+	if (ddi_request_id[0] == '\0') {
+		DDI_dispatch(&ddi, msg);
+		return;
 	}
-	return 0;
+	sz = strlen(ddi_request_id) + strlen(msg) + 8;
+	tagged = malloc(sz);
+	if (!tagged) {
+		DDI_dispatch(&ddi, msg);
+		return;
+	}
+	snprintf(tagged, sz, "!id:%s\r\n%s", ddi_request_id, msg);
+	DDI_dispatch(&ddi, tagged);
+	free(tagged);
 }
 
+static void ddi_cmd_id(char *arg) {
+	fz_strlcpy(ddi_request_id, arg, sizeof(ddi_request_id));
+}
 
-int ddi_process(char *ddi_data) {
-	char *cmd, *p, *q;
-	int result = 0;
+static void ddi_cmd_debug(char *arg) {
+	fprintf(stderr, "%s:%d: DEBUG mode ACTIVE\r\n", FL);
+	fprintf(stderr, "%s:%d: DDI Data---------\r\n%s\r\n-------------\r\n", FL, ddi_payload);
+	debug = 1;
+}
 
-	compsearch_radius    = 500.0f;
-	compsearch_highlight = 8; // 0b0111
+static void ddi_cmd_headless(char *arg) {
+	free(headless_data);
+	headless_data = strdup(ddi_payload);
+	runmode       = RUNMODE_HEADLESS;
+}
 
-	if (strstr(ddi_data, "!debug:")) {
-		fprintf(stderr, "%s:%d: DEBUG mode ACTIVE\r\n", FL);
-		fprintf(stderr, "%s:%d: DDI Data---------\r\n%s\r\n-------------\r\n", FL, ddi_data);
-		debug = 1;
-	}
+static void ddi_cmd_batchsearch(char *arg) {
+	free(batch_data);
+	batch_data = strdup(arg);
+}
 
-	if (strstr(ddi_data, "!headless:")) {
-		headless_data = strdup(ddi_data);
-		runmode       = RUNMODE_HEADLESS;
-	}
+static void ddi_cmd_hitlist(char *arg) {
+	hitlist_requested = 1;
+}
 
-	if ((cmd = strstr(ddi_data, "!csradius:"))) {
-		double t = atof(cmd + strlen("!csradius:"));
-		if ((t >= 1.0) || (t <= 50000.0)) compsearch_radius = t; // default fall back
-		flog("%s:%d: compsearch radius set to %f\r\n", FL, t);
+static void ddi_cmd_ddisocket(char *arg) {
+	if (ddi.transport == DDI_TRANSPORT_SOCKET) return;
+	if (DDI_set_transport(&ddi, DDI_TRANSPORT_SOCKET) == 0) {
+		flog("%s:%d: DDI listening on '%s'\r\n", FL, ddi.sock_name);
+	} else {
+		flog("%s:%d: DDI socket unavailable, staying with files\r\n", FL);
 	}
+}
 
-	if ((cmd = strstr(ddi_data, "!cshighlight:"))) {
-		int t = atoi(cmd + strlen("!cshighlight:"));
-		if (t > 0) compsearch_highlight = t; // default fall back
-		flog("%s:%d: compsearch highlight set to %d\r\n", FL, compsearch_highlight);
-	}
+static void ddi_cmd_serve(char *arg) {
+	int t = atoi(arg);
+	server_idle = (t > 0) ? t : SERVER_IDLE_DEFAULT;
+	flog("%s:%d: headless server idle timeout %d second(s)\r\n", FL, server_idle);
+}
 
-	if ((p = strstr(ddi_data, "!setwindowsize:"))) {
-		q = strchr(p, '\n');
-		if (q) *q = '\0';
-		sscanf(p + strlen("!setwindowsize:"), "%d %d", &window_w, &window_h);
-		flog("%s:%d: Set window size: %d %d\r\n", FL, window_w, window_h);
-		if (q) *q = '\n';
-	}
+static void ddi_cmd_csradius(char *arg) {
+	double t = atof(arg);
+	if ((t >= 1.0) || (t <= 50000.0)) compsearch_radius = t; // default fall back
+	flog("%s:%d: compsearch radius set to %f\r\n", FL, t);
+}
 
-	if ((p = strstr(ddi_data, "!setwindowsizepos:"))) {
-		q = strchr(p, '\n');
-		if (q) *q = '\0';
-		sscanf(p + strlen("!setwindowsizepos:"), "%d %d %d %d", &window_w, &window_h, &origin_x, &origin_y);
-		flog("%s:%d: Set window size pos: %d %d @ %d %d\r\n", FL, window_w, window_h, origin_x, origin_y);
-		if (q) *q = '\n';
-	}
+static void ddi_cmd_cshighlight(char *arg) {
+	int t = atoi(arg);
+	if (t > 0) compsearch_highlight = t; // default fall back
+	flog("%s:%d: compsearch highlight set to %d\r\n", FL, compsearch_highlight);
+}
 
-	if ((p = strstr(ddi_data, "!getwindowsizepos:"))) {
-		char tmp[1024];
-		int x, y, ox, oy;
-		SDL_GetWindowPosition(sdlWindow, &ox, &oy);
-		SDL_GetWindowSize(sdlWindow, &x, &y);
-		snprintf(tmp, sizeof(tmp), "!pdfwininfo=%d %d %d %d\r\n", ox, oy, x, y);
-		flog("%s:%d: Dispatching '%s'\r\n", FL, tmp);
-		DDI_dispatch(&ddi, tmp);
+static void ddi_cmd_setwindowsize(char *arg) {
+	sscanf(arg, "%d %d", &window_w, &window_h);
+	flog("%s:%d: Set window size: %d %d\r\n", FL, window_w, window_h);
+}
 
-	}
+static void ddi_cmd_setwindowsizepos(char *arg) {
+	sscanf(arg, "%d %d %d %d", &window_w, &window_h, &origin_x, &origin_y);
+	flog("%s:%d: Set window size pos: %d %d @ %d %d\r\n", FL, window_w, window_h, origin_x, origin_y);
+}
 
+static void ddi_cmd_getwindowsizepos(char *arg) {
+	char tmp[1024];
+	int x, y, ox, oy;
+	SDL_GetWindowPosition(sdlWindow, &ox, &oy);
+	SDL_GetWindowSize(sdlWindow, &x, &y);
+	snprintf(tmp, sizeof(tmp), "!pdfwininfo=%d %d %d %d\r\n", ox, oy, x, y);
+	flog("%s:%d: Dispatching '%s'\r\n", FL, tmp);
+	ddi_reply(tmp);
+}
 
-	if (strstr(ddi_data, "!search_next:")) {
-		flog("%s:%d: Search NEXT hit, simulate keypress in viewer.\n",FL);
-		ui_set_keypress(PDFK_SEARCH_NEXT);
-		do_keypress();
-		return result;
-	}
+static void ddi_cmd_search_next(char *arg) {
+	flog("%s:%d: Search NEXT hit, simulate keypress in viewer.\n",FL);
+	ui_set_keypress(PDFK_SEARCH_NEXT);
+	do_keypress();
+}
 
-	if (strstr(ddi_data, "!search_prev:")) {
-		flog("%s:%d: Search PREV hit, simulate keypress in viewer.\n",FL);
-		ui_set_keypress( PDFK_SEARCH_PREV );
-		do_keypress();
-		return result;
-	}
+static void ddi_cmd_search_prev(char *arg) {
+	flog("%s:%d: Search PREV hit, simulate keypress in viewer.\n",FL);
+	ui_set_keypress( PDFK_SEARCH_PREV );
+	do_keypress();
+}
 
-	if (strstr(ddi_data, "!search_page_next:")) {
-		ui_set_keypress(PDFK_SEARCH_NEXT_PAGE);
-		do_keypress();
-		return result;
-	}
+static void ddi_cmd_search_page_next(char *arg) {
+	ui_set_keypress(PDFK_SEARCH_NEXT_PAGE);
+	do_keypress();
+}
 
-	if (strstr(ddi_data, "!search_page_prev:")) {
-		ui_set_keypress(PDFK_SEARCH_PREV_PAGE);
-		do_keypress();
-		return result;
-	}
+static void ddi_cmd_search_page_prev(char *arg) {
+	ui_set_keypress(PDFK_SEARCH_PREV_PAGE);
+	do_keypress();
+}
 
-	if (strstr(ddi_data, "!gotopg:")) {
-		char *p = strstr(ddi_data, "!gotopg:");
-		if (p) {
-			clear_search();
-			flog("%s:%d: decoding %s\r\n", FL, p + strlen("!gotopg:"));
-			currently_viewed_page = strtol(p + strlen("!gotopg:"), NULL, 10);
-			flog("%s:%d: page set to %d\r\n", FL, currently_viewed_page);
-			if (currently_viewed_page > fz_count_pages(ctx, doc)) currently_viewed_page = fz_count_pages(ctx, doc);
-			currently_viewed_page--;
-			this_search.mode = SEARCH_MODE_NONE;
-		}
-	}
+static void ddi_cmd_gotopg(char *arg) {
+	ddi_clear_search();
+	flog("%s:%d: decoding %s\r\n", FL, arg);
+	currently_viewed_page = strtol(arg, NULL, 10);
+	flog("%s:%d: page set to %d\r\n", FL, currently_viewed_page);
+	if (currently_viewed_page > fz_count_pages(ctx, doc)) currently_viewed_page = fz_count_pages(ctx, doc);
+	currently_viewed_page--;
+}
 
-	if (strstr(ddi_data, "!getstats:")) {
-		char tmp[1024];
-		clear_search();
-		snprintf(tmp, sizeof(tmp), "!pdfstats:page=%d\r\n", currently_viewed_page + 1);
-		flog("%s:%d: Dispatching '%s'\r\n", FL, tmp);
-		DDI_dispatch(&ddi, tmp);
-	}
+static void ddi_cmd_getstats(char *arg) {
+	char tmp[1024];
+	ddi_clear_search();
+	snprintf(tmp, sizeof(tmp), "!pdfstats:page=%d\r\n", currently_viewed_page + 1);
+	flog("%s:%d: Dispatching '%s'\r\n", FL, tmp);
+	ddi_reply(tmp);
+}
 
-	if (strstr(ddi_data, "!quit:")) {
-		if (time(NULL) - process_start_time > 2) quit();
-	}
+static void ddi_cmd_quit(char *arg) {
+	if (time(NULL) - process_start_time > 2) quit();
+}
 
-	if (strstr(ddi_data, "!cinvert:")) {
-		currentinvert = !currentinvert;
-	}
+static void ddi_cmd_cinvert(char *arg) {
+	currentinvert = !currentinvert;
+}
 
-	if (strstr(ddi_data, "!ss:")) {
-		scroll_wheel_swap = 1;
-	}
+static void ddi_cmd_colormode(char *arg) {
+	set_color_mode(arg);
+}
 
-	if (strstr(ddi_data, "!raise:")) {
-		raise_on_search = 1;
-	}
+static void ddi_cmd_ss(char *arg) {
+	scroll_wheel_swap = 1;
+}
 
-	if (strstr(ddi_data, "!noraise:")) {
-		raise_on_search = 0;
-	}
+static void ddi_cmd_raise(char *arg) {
+	raise_on_search = 1;
+}
 
-	if (strstr(ddi_data, "!detached:")) {
-		detached = 1;
-	}
+static void ddi_cmd_noraise(char *arg) {
+	raise_on_search = 0;
+}
 
-	if (strstr(ddi_data, "!load:")) {
+static void ddi_cmd_detached(char *arg) {
+	detached = 1;
+}
 
-		char *fnp;
+static void ddi_cmd_load(char *arg) {
+	/*
+	 * load a file, not searching.
+	 */
 
-		/*
-		 * load a file, not searching.
-		 */
+	ddi_clear_search();
+	snprintf(filename, sizeof(filename), "%s", arg);
+	flog("%s:%d: filename = '%s'\r\n", FL, filename);
 
-		clear_search();
-		fnp = strstr(ddi_data, "!load:");
-		flog("%s:%d: fnp = '%s'\r\n", FL, fnp);
-		snprintf(filename, sizeof(filename), "%s", fnp + strlen("!load:"));
-		fnp = strpbrk(filename, "\n\r");
-		if (fnp) *fnp = '\0';
-		flog("%s:%d: filename = '%s'\r\n", FL, filename);
-
-		title = strrchr(filename, '/');
-		if (!title) title = strrchr(filename, '\\');
-		if (title)
-			++title;
-		else
-			title = filename;
+	title = strrchr(filename, '/');
+	if (!title) title = strrchr(filename, '\\');
+	if (title)
+		++title;
+	else
+		title = filename;
 
-		ctx = fz_new_context(NULL, NULL, 0);
+	/* a headless server gets a '!load:' with every query, keep the one context */
+	if (!ctx) {
+		ctx = new_viewer_context();
 		fz_register_document_handlers(ctx);
 
 		if (layout_css) {
@@ -1723,129 +3981,247 @@ int ddi_process(char *ddi_data) {
 		}
 
 		fz_set_use_document_css(ctx, layout_use_doc_css);
-
-		flog("%s:%d: about to reload (%s)\r\n", FL, filename);
-		reload_required = 1;
-		flog("%s:%d: reload done (%s)\r\n", FL, filename);
 	}
 
-	ddi_process_keymap(ddi_data, "!keysearch=", PDFK_SEARCH);
-	ddi_process_keymap(ddi_data, "!keynext=", PDFK_SEARCH_NEXT);
-	ddi_process_keymap(ddi_data, "!keyprev=", PDFK_SEARCH_PREV);
-
-	keyboard_map[PDFK_SEARCH_PREV_PAGE].key = keyboard_map[PDFK_SEARCH_PREV].key;
-	keyboard_map[PDFK_SEARCH_PREV_PAGE].mods = keyboard_map[PDFK_SEARCH_PREV].mods | KEYB_MOD_SHIFT;
-	keyboard_map[PDFK_SEARCH_NEXT_PAGE].key = keyboard_map[PDFK_SEARCH_NEXT].key;
-	keyboard_map[PDFK_SEARCH_NEXT_PAGE].mods = keyboard_map[PDFK_SEARCH_NEXT].mods | KEYB_MOD_SHIFT;
-
-	ddi_process_keymap(ddi_data, "!keypgup=", PDFK_PGUP);
-	ddi_process_keymap(ddi_data, "!keypgdn=", PDFK_PGDN);
-
-	keyboard_map[PDFK_PGUP_10].key = keyboard_map[PDFK_PGUP].key;
-	keyboard_map[PDFK_PGUP_10].mods = keyboard_map[PDFK_PGUP].mods | KEYB_MOD_SHIFT;
-	keyboard_map[PDFK_PGDN_10].key = keyboard_map[PDFK_PGDN].key;
-	keyboard_map[PDFK_PGDN_10].mods = keyboard_map[PDFK_PGDN].mods | KEYB_MOD_SHIFT;
+	flog("%s:%d: about to reload (%s)\r\n", FL, filename);
+	reload_required = 1;
+	flog("%s:%d: reload done (%s)\r\n", FL, filename);
+}
 
-	ddi_process_keymap(ddi_data, "!keyzoomin=", PDFK_ZOOMIN);
-	ddi_process_keymap(ddi_data, "!keyzoomout=", PDFK_ZOOMOUT);
-	ddi_process_keymap(ddi_data, "!keyrotatecw=", PDFK_ROTATE_CW);
-	ddi_process_keymap(ddi_data, "!keyrotateccw=", PDFK_ROTATE_CCW);
-	ddi_process_keymap(ddi_data, "!keyup=", PDFK_PAN_UP);
-	ddi_process_keymap(ddi_data, "!keydown=", PDFK_PAN_DOWN);
-	ddi_process_keymap(ddi_data, "!keyleft=", PDFK_PAN_LEFT);
-	ddi_process_keymap(ddi_data, "!keyright=", PDFK_PAN_RIGHT);
+static void ddi_cmd_noheuristics(char *arg) {
+	flog("%s:%d: No heuristics", FL);
+	search_heuristics = 0;
+}
 
-	ddi_process_keymap(ddi_data, "!keyfitwindow=", PDFK_FITWINDOW);
-	ddi_process_keymap(ddi_data, "!keyfitwidth=", PDFK_FITWIDTH);
-	ddi_process_keymap(ddi_data, "!keyfitheight=", PDFK_FITHEIGHT);
-	ddi_process_keymap(ddi_data, "!keygopage=", PDFK_GOPAGE);
-	ddi_process_keymap(ddi_data, "!keygoendpage=", PDFK_GOENDPAGE);
+static void ddi_cmd_heuristics(char *arg) {
+	search_heuristics = 1;
+	flog("%s:%d: Heuristics", FL);
+}
 
-	if (strstr(ddi_data, "!noheuristics:")) {
-		flog("%s:%d: No heuristics", FL);
-		search_heuristics = 0;
-	}
+static void ddi_cmd_strictmatch(char *arg) {
+	flog("%s:%d: Strict match\r\n", FL);
+	ctx->flags |= FZ_CTX_FLAGS_STRICT_MATCH;
+}
 
-	if (strstr(ddi_data, "!heuristics:")) {
-		search_heuristics = 1;
-		flog("%s:%d: Heuristics", FL);
-	}
+static void ddi_cmd_stdmatch(char *arg) {
+	flog("%s:%d: Standard match (default)\r\n", FL);
+	ctx->flags &= ~FZ_CTX_FLAGS_STRICT_MATCH;
+}
 
-	if ((cmd = strstr(ddi_data, "!strictmatch:"))) {
-		flog("%s:%d: Strict match\r\n", FL);
-		ctx->flags |= FZ_CTX_FLAGS_STRICT_MATCH;
-	}
+static void ddi_cmd_pagesearch(char *arg) {
+	ddi_search_set = 1;
+	this_search.active = 1;
+	this_search.mode = SEARCH_MODE_INPAGE;
+	this_search.direction = 1;
+	this_search.has_hits = 0;
+	snprintf(this_search.search_raw, sizeof(this_search.search_raw), "!pagesearch:%s", arg);
+	snprintf(this_search.a, sizeof(this_search.a), "%s", arg);
+}
 
-	if ((cmd = strstr(ddi_data, "!stdmatch:"))) {
-		flog("%s:%d: Standard match (default)\r\n", FL);
-		ctx->flags &= ~FZ_CTX_FLAGS_STRICT_MATCH;
-	}
+static void ddi_cmd_search(char *arg) {
+	char raw[sizeof(this_search.search_raw)];
 
-	if ((cmd = strstr(ddi_data, "!pagesearch:")) != NULL) {
+	ddi_search_set = 1;
+	this_search.mode = SEARCH_MODE_NORMAL;
+	snprintf(raw, sizeof(raw), "!search:%s", arg);
+	if (strcmp(this_search.search_raw, raw)==0) {
+		flog("%s:%d: Same DDI search as before, simulate 'next' keypress.\n",FL);
+		ui_set_keypress(PDFK_SEARCH_NEXT);
+		do_keypress();
+	} else {
+		snprintf(this_search.search_raw, sizeof(this_search.search_raw), "%s", raw);
+		snprintf(this_search.a, sizeof(this_search.a), "%s", arg);
 		this_search.active = 1;
-		this_search.mode = SEARCH_MODE_INPAGE;
 		this_search.direction = 1;
+		this_search.not_found = 0;
 		this_search.has_hits = 0;
-		snprintf(this_search.search_raw, sizeof(this_search.search_raw), "%s", cmd);
-		snprintf(this_search.a, sizeof(this_search.a), "%s", cmd + strlen("!pagesearch:"));
+		this_search.page = 0;
 	}
+}
 
-	if ((cmd = strstr(ddi_data, "!search:")) != NULL) {
-		this_search.mode = SEARCH_MODE_NORMAL;
-		if (strcmp(this_search.search_raw, cmd)==0) {
-			flog("%s:%d: Same DDI search as before, simulate 'next' keypress.\n",FL);
-			ui_set_keypress(PDFK_SEARCH_NEXT);
-			do_keypress();
-		} else {
-			snprintf(this_search.search_raw, sizeof(this_search.search_raw), "%s", cmd);
-			snprintf(this_search.a, sizeof(this_search.a), "%s", cmd + strlen("!search:"));
-			this_search.active = 1;
-			this_search.direction = 1;
-			this_search.not_found = 0;
-			this_search.has_hits = 0;
-			this_search.page = 0;
+static void ddi_cmd_compsearch(char *arg) {
+	/*
+	 * compound search requested.  First we find the page with the
+	 * first part, then we find the second part.
+	 *
+	 */
+	char *p;
+
+	ddi_search_set = 1;
+	this_search.a[0] = this_search.b[0] = this_search.c[0] = '\0';
+	this_search.mode                                       = SEARCH_MODE_COMPOUND;
+	this_search.page                                       = 0;
+	this_search.direction = 1;
+	this_search.active = 1;
+
+	//FIXME - should this be 1 or 0?		this_search.page                                       = 1;
+	snprintf(this_search.search_raw, sizeof(this_search.search_raw), "!compsearch:%s", arg);
+
+	snprintf(this_search.a, sizeof(this_search.a), "%s", arg);
+	this_search.not_found = 0;
+	this_search.has_hits = 0;
+
+	p = strchr(this_search.a, ':');
+	if (p) {
+		*p = '\0';
+		snprintf(this_search.b, sizeof(this_search.b), "%s", p + 1);
+		p = strchr(this_search.b, ':');
+		if (p) {
+			*p = '\0';
+			snprintf(this_search.c, sizeof(this_search.c), "%s", p + 1);
 		}
 	}
+	flog("%s:%d: elements to comp-search: %s %s %s\r\n", FL, this_search.a, this_search.b, this_search.c);
+}
 
-	if ((cmd = strstr(ddi_data, "!compsearch:"))) {
-		/*
-		 * compound search requested.  First we find the page with the
-		 * first part, then we find the second part.
-		 *
-		 */
-		char tmp[1024];
-		char *p;
+/*
+ * DDI commands, by name.
+ *
+ */
+struct ddi_command {
+	const char *name;  // including the ':' or '=' that ends it
+	void (*run)(char *arg);
+	int keymap;        // keyboard_map slot for '!key...=' settings, or -1
+};
 
-		this_search.a[0] = this_search.b[0] = this_search.c[0] = '\0';
-		this_search.mode                                       = SEARCH_MODE_COMPOUND;
-		this_search.page                                       = 0;
-		this_search.direction = 1;
-		this_search.active = 1;
+static const struct ddi_command ddi_commands[] = {
+	{ "id:", ddi_cmd_id, -1 },
+	{ "debug:", ddi_cmd_debug, -1 },
+	{ "headless:", ddi_cmd_headless, -1 },
+	{ "batchsearch:", ddi_cmd_batchsearch, -1 },
+	{ "hitlist:", ddi_cmd_hitlist, -1 },
+	{ "ddisocket:", ddi_cmd_ddisocket, -1 },
+	{ "serve:", ddi_cmd_serve, -1 },
+	{ "csradius:", ddi_cmd_csradius, -1 },
+	{ "cshighlight:", ddi_cmd_cshighlight, -1 },
+	{ "setwindowsize:", ddi_cmd_setwindowsize, -1 },
+	{ "setwindowsizepos:", ddi_cmd_setwindowsizepos, -1 },
+	{ "getwindowsizepos:", ddi_cmd_getwindowsizepos, -1 },
+	{ "search_next:", ddi_cmd_search_next, -1 },
+	{ "search_prev:", ddi_cmd_search_prev, -1 },
+	{ "search_page_next:", ddi_cmd_search_page_next, -1 },
+	{ "search_page_prev:", ddi_cmd_search_page_prev, -1 },
+	{ "gotopg:", ddi_cmd_gotopg, -1 },
+	{ "getstats:", ddi_cmd_getstats, -1 },
+	{ "quit:", ddi_cmd_quit, -1 },
+	{ "cinvert:", ddi_cmd_cinvert, -1 },
+	{ "colormode:", ddi_cmd_colormode, -1 },
+	{ "ss:", ddi_cmd_ss, -1 },
+	{ "raise:", ddi_cmd_raise, -1 },
+	{ "noraise:", ddi_cmd_noraise, -1 },
+	{ "detached:", ddi_cmd_detached, -1 },
+	{ "load:", ddi_cmd_load, -1 },
+	{ "noheuristics:", ddi_cmd_noheuristics, -1 },
+	{ "heuristics:", ddi_cmd_heuristics, -1 },
+	{ "strictmatch:", ddi_cmd_strictmatch, -1 },
+	{ "stdmatch:", ddi_cmd_stdmatch, -1 },
+	{ "pagesearch:", ddi_cmd_pagesearch, -1 },
+	{ "search:", ddi_cmd_search, -1 },
+	{ "compsearch:", ddi_cmd_compsearch, -1 },
+
+	{ "keysearch=", NULL, PDFK_SEARCH },
+	{ "keynext=", NULL, PDFK_SEARCH_NEXT },
+	{ "keyprev=", NULL, PDFK_SEARCH_PREV },
+	{ "keypgup=", NULL, PDFK_PGUP },
+	{ "keypgdn=", NULL, PDFK_PGDN },
+	{ "keyzoomin=", NULL, PDFK_ZOOMIN },
+	{ "keyzoomout=", NULL, PDFK_ZOOMOUT },
+	{ "keyrotatecw=", NULL, PDFK_ROTATE_CW },
+	{ "keyrotateccw=", NULL, PDFK_ROTATE_CCW },
+	{ "keyup=", NULL, PDFK_PAN_UP },
+	{ "keydown=", NULL, PDFK_PAN_DOWN },
+	{ "keyleft=", NULL, PDFK_PAN_LEFT },
+	{ "keyright=", NULL, PDFK_PAN_RIGHT },
+	{ "keyfitwindow=", NULL, PDFK_FITWINDOW },
+	{ "keyfitwidth=", NULL, PDFK_FITWIDTH },
+	{ "keyfitheight=", NULL, PDFK_FITHEIGHT },
+	{ "keygopage=", NULL, PDFK_GOPAGE },
+	{ "keygoendpage=", NULL, PDFK_GOENDPAGE },
+};
 
-		//FIXME - should this be 1 or 0?		this_search.page                                       = 1;
-		snprintf(this_search.search_raw, sizeof(this_search.search_raw), "%s", cmd);
-		snprintf(tmp, sizeof(tmp), "%s", cmd + strlen("!compsearch:"));
+/*
+ * Find the command named at s, just past its '!'.
+ *
+ */
+static const struct ddi_command *ddi_find_command(const char *s) {
+	size_t i;
 
-		snprintf(this_search.a, sizeof(this_search.a), "%s", tmp);
-		this_search.not_found = 0;
-		this_search.has_hits = 0;
-		p = strpbrk(this_search.a, "\r\n");
-		if (p) *p = '\0';
+	for (i = 0; i < nelem(ddi_commands); i++) {
+		if (strncmp(s, ddi_commands[i].name, strlen(ddi_commands[i].name)) == 0) return &ddi_commands[i];
+	}
+	return NULL;
+}
 
-		p = strchr(this_search.a, ':');
-		if (p) {
-			*p = '\0';
-			snprintf(this_search.b, sizeof(this_search.b), "%s", p + 1);
-			p = strchr(this_search.b, ':');
-			if (p) {
-				*p = '\0';
-				snprintf(this_search.c, sizeof(this_search.c), "%s", p + 1);
-			}
+struct ddi_call {
+	const struct ddi_command *c;
+	char *arg;
+};
+
+int ddi_process(char *ddi_data) {
+	struct ddi_call *calls;
+	char *buf, *p;
+	size_t i;
+	int count = 0, n = 0;
+	int result = 0;
+
+	compsearch_radius    = 500.0f;
+	compsearch_highlight = 8; // 0b0111
+	ddi_request_id[0]    = '\0';
+	ddi_payload          = ddi_data;
+	ddi_search_set       = 0;
+
+	/* the payload is copied so the caller's buffer is left as it was */
+	buf = strdup(ddi_data);
+	if (buf) for (p = buf; *p; p++) if (*p == '!') count++;
+	calls = malloc((count + 1) * sizeof(*calls));
+	if (!buf || !calls) {
+		free(buf);
+		free(calls);
+		return 1;
+	}
+
+	for (p = buf; *p; p++) {
+		if (*p != '!') continue;
+		calls[n].c = ddi_find_command(p + 1);
+		if (!calls[n].c) continue;
+		calls[n].arg = p;
+		n++;
+	}
+
+	/*
+	 * An argument runs up to the '!' of the next known command or the
+	 * end of its line, so '!csradius:100!compsearch:a:b' is two commands.
+	 *
+	 */
+	for (i = 0; i < (size_t)n; i++) *calls[i].arg = '\0';
+	for (i = 0; i < (size_t)n; i++) {
+		calls[i].arg += 1 + strlen(calls[i].c->name);
+		calls[i].arg[strcspn(calls[i].arg, "\r\n")] = '\0';
+	}
+
+	for (i = 0; i < (size_t)n; i++) {
+		const struct ddi_command *c = calls[i].c;
+		if (c->keymap >= 0) {
+			sscanf(calls[i].arg, "%d %x", &keyboard_map[c->keymap].key, &keyboard_map[c->keymap].mods);
+		} else {
+			c->run(calls[i].arg);
 		}
-		flog("%s:%d: elements to comp-search: %s %s %s\r\n", FL, this_search.a, this_search.b, this_search.c);
-	} // compsearch
+	}
 
-	return 0;
+	free(calls);
+	free(buf);
+
+	keyboard_map[PDFK_SEARCH_PREV_PAGE].key = keyboard_map[PDFK_SEARCH_PREV].key;
+	keyboard_map[PDFK_SEARCH_PREV_PAGE].mods = keyboard_map[PDFK_SEARCH_PREV].mods | KEYB_MOD_SHIFT;
+	keyboard_map[PDFK_SEARCH_NEXT_PAGE].key = keyboard_map[PDFK_SEARCH_NEXT].key;
+	keyboard_map[PDFK_SEARCH_NEXT_PAGE].mods = keyboard_map[PDFK_SEARCH_NEXT].mods | KEYB_MOD_SHIFT;
+
+	keyboard_map[PDFK_PGUP_10].key = keyboard_map[PDFK_PGUP].key;
+	keyboard_map[PDFK_PGUP_10].mods = keyboard_map[PDFK_PGUP].mods | KEYB_MOD_SHIFT;
+	keyboard_map[PDFK_PGDN_10].key = keyboard_map[PDFK_PGDN].key;
+	keyboard_map[PDFK_PGDN_10].mods = keyboard_map[PDFK_PGDN].mods | KEYB_MOD_SHIFT;
+
+	return result;
 } // ddi_process
 
 
@@ -1912,8 +4288,7 @@ int do_search_2( void ) {
 				 * within the PDF Viewer itself
 				 *
 				 */
-				this_search.hit_count_a = fz_search_page_number(
-						ctx, doc, this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+				this_search.hit_count_a = search_page(this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
 				flog("%s:%d: Searching for '%s', %d hits on page %d\n",
 						FL,
 						this_search.a,
@@ -1921,8 +4296,7 @@ int do_search_2( void ) {
 						this_search.page + 1);
 				if (this_search.hit_count_a) this_search.has_hits = 1;
 				if ((this_search.hit_count_a == 0) && (strlen(this_search.alt))) {
-					this_search.hit_count_a = fz_search_page_number(
-							ctx, doc, this_search.page, this_search.alt, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+					this_search.hit_count_a = search_page(this_search.page, this_search.alt, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
 					flog("%s:%d: Searching for '%s', %d hits on page %d\n",
 							FL,
 							this_search.alt,
@@ -1947,8 +4321,7 @@ int do_search_2( void ) {
 				 */
 
 				this_search.page = fz_clampi(this_search.page, 0, fz_count_pages(ctx, doc) - 1);
-				this_search.hit_count_a = fz_search_page_number(
-						ctx, doc, this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+				this_search.hit_count_a = search_page(this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
 				flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.a, this_search.hit_count_a);
 
 				if (this_search.hit_count_a) {
@@ -1958,14 +4331,12 @@ int do_search_2( void ) {
 					this_search.has_hits = 1;
 
 					if (strlen(this_search.b)) {
-						this_search.hit_count_b = fz_search_page_number(
-								ctx, doc, this_search.page, this_search.b, this_search.hit_bbox_b, nelem(this_search.hit_bbox_b));
+						this_search.hit_count_b = search_page(this_search.page, this_search.b, this_search.hit_bbox_b, nelem(this_search.hit_bbox_b));
 						flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.b, this_search.hit_count_b);
 					}
 
 					if (strlen(this_search.c)) {
-						this_search.hit_count_c = fz_search_page_number(
-								ctx, doc, this_search.page, this_search.c, this_search.hit_bbox_c, nelem(this_search.hit_bbox_c));
+						this_search.hit_count_c = search_page(this_search.page, this_search.c, this_search.hit_bbox_c, nelem(this_search.hit_bbox_c));
 						flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.c, this_search.hit_count_c);
 					}
 
@@ -2138,119 +4509,19 @@ int do_search_2( void ) {
 
 int do_search_compound( void ) {
 	this_search.page = fz_clampi(this_search.page, 0, fz_count_pages(ctx, doc) - 1);
-	this_search.hit_count_a = fz_search_page_number(
-			ctx, doc, this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+	this_search.hit_count_a = search_page_parts(this_search.page, this_search.a, this_search.b, this_search.c);
 	flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.a, this_search.hit_count_a);
 
 	if (this_search.hit_count_a) {
-		int new_hit_count = 0;
-		int i;
-
 		this_search.has_hits = 1;
-		if (strlen(this_search.b)) {
-			this_search.hit_count_b = fz_search_page_number(ctx,
-					doc,
-					this_search.page,
-					this_search.b,
-					this_search.hit_bbox_b,
-					nelem(this_search.hit_bbox_b));
-			flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.b, this_search.hit_count_b);
-		}
-
-		if (strlen(this_search.c)) {
-			this_search.hit_count_c = fz_search_page_number(ctx,
-					doc,
-					this_search.page,
-					this_search.c,
-					this_search.hit_bbox_c,
-					nelem(this_search.hit_bbox_c));
-			flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.c, this_search.hit_count_c);
-		}
-
-		/*
-		 * Now... let's try merge these boxes :-o
-		 *
-		 */
-		for (i = 0; i < this_search.hit_count_a; i++) {
-			int j;
-			double dist_b, dist_c;
-			int closest_b = -1;
-			int closest_c = -1;
-
-			if (this_search.hit_count_b) {
-				dist_b = 100000000.0f;
-				for (j = 0; j < this_search.hit_count_b; j++) {
-					double dx = this_search.hit_bbox_a[i].x0 - this_search.hit_bbox_b[j].x0;
-					double dy = this_search.hit_bbox_a[i].y0 - this_search.hit_bbox_b[j].y0;
-					double td = dx * dx + dy * dy;
-					if (td < dist_b) {
-						dist_b    = td;
-						closest_b = j;
-					}
-				}
-			} else
-				dist_b = 0;
-
-			if (this_search.hit_count_c) {
-				dist_c = 100000000.0f;
-				for (j = 0; j < this_search.hit_count_c; j++) {
-					double dx = this_search.hit_bbox_a[i].x0 - this_search.hit_bbox_c[j].x0;
-					double dy = this_search.hit_bbox_a[i].y0 - this_search.hit_bbox_c[j].y0;
-					double td = dx * dx + dy * dy;
-					if (td < dist_c) {
-						dist_c    = td;
-						closest_c = j;
-					}
-				}
-			} else
-				dist_c = 0;
 
-			if (strlen(this_search.b) && (this_search.hit_count_b == 0)) this_search.hit_count_a = 0;
-			if (strlen(this_search.c) && (this_search.hit_count_c == 0)) this_search.hit_count_a = 0;
+		this_search.hit_count_b = hits_b.len;
+		if (strlen(this_search.b)) flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.b, this_search.hit_count_b);
 
-			if ((this_search.hit_count_a) && (dist_b < compsearch_radius) && (dist_c < compsearch_radius)) {
-				static fz_rect a, b, c;
-				a = this_search.hit_bbox_a[i];
+		this_search.hit_count_c = hits_c.len;
+		if (strlen(this_search.c)) flog("%s:%d: '%s' matched %d time(s)\r\n", FL, this_search.c, this_search.hit_count_c);
 
-				flog("%s:%d: limit = %f highlight mode = %d  distb = %f distc = %f",
-						FL,
-						compsearch_radius,
-						compsearch_highlight,
-						dist_b,
-						dist_c);
-
-				if (compsearch_highlight == 8) {
-					a = this_search.hit_bbox_a[i];
-
-					if (this_search.hit_count_b) {
-						b = this_search.hit_bbox_b[closest_b];
-						if (b.x1 > a.x1) a.x1 = b.x1;
-						if (b.y1 > a.y1) a.y1 = b.y1;
-						if (b.x0 < a.x0) a.x0 = b.x0;
-						if (b.y0 < a.y0) a.y0 = b.y0;
-					}
-
-					if (this_search.hit_count_c) {
-						c = this_search.hit_bbox_c[closest_c];
-						if (c.x1 > a.x1) a.x1 = c.x1;
-						if (c.y1 > a.y1) a.y1 = c.y1;
-						if (c.x0 < a.x0) a.x0 = c.x0;
-						if (c.y0 < a.y0) a.y0 = c.y0;
-					}
-				} else if (compsearch_highlight == 4) {
-					a = this_search.hit_bbox_a[i];
-				} else if (compsearch_highlight == 2) {
-					if (this_search.hit_count_b) a = this_search.hit_bbox_b[closest_b];
-				} else if (compsearch_highlight == 1) {
-					if (this_search.hit_count_c) a = this_search.hit_bbox_c[closest_c];
-				}
-
-				this_search.hit_bbox_a[new_hit_count] = a;
-				new_hit_count++;
-			} // if distances are within 500
-
-		} // for each main search hit
-		this_search.hit_count_a = new_hit_count;
+		this_search.hit_count_a = compound_merge(1, NULL, 0);
 	} // if search hit count
 
 	return 0;
@@ -2328,30 +4599,42 @@ int do_search( void ) {
 			break;
 		}
 
+		/*
+		 * The background worker hasn't got the text for this page yet,
+		 * leave the search active and pick it up again next frame.
+		 *
+		 */
+		if (text_worker_pending(fz_clampi(this_search.page, 0, fz_count_pages(ctx, doc) - 1))) break;
+
 		/*
 		 * Because of the prevelance of space vs underscore strings in PDF schematics
 		 * we try search for both variants
 		 *
 		 */
 		if (this_search.mode != SEARCH_MODE_COMPOUND) {
+			const char *needles[2] = { this_search.a, this_search.alt };
+			struct hit_list *lists[2] = { &hits_a, &hits_alt };
+			struct hit_list *found = &hits_a;
+
 			this_search.page = fz_clampi(this_search.page, 0, fz_count_pages(ctx, doc) - 1);
-			this_search.hit_count_a = fz_search_page_number(
-					ctx, doc, this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+			search_page_needles(this_search.page, 2, needles, lists);
 			flog("%s:%d: Searching for '%s', %d hits on page %d\n",
 					FL,
 					this_search.a,
-					this_search.hit_count_a,
+					hits_a.len,
 					this_search.page + 1);
 
-			if ((this_search.hit_count_a == 0) && (strlen(this_search.alt))) {
-				this_search.hit_count_a = fz_search_page_number(
-						ctx, doc, this_search.page, this_search.alt, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+			if ((hits_a.len == 0) && (strlen(this_search.alt))) {
+				found = &hits_alt;
 				flog("%s:%d: Searching for alternative - '%s', %d hits on page %d\n",
 						FL,
 						this_search.alt,
-						this_search.hit_count_a,
+						hits_alt.len,
 						this_search.page + 1);
 			}
+
+			this_search.hit_count_a = fz_mini(found->len, nelem(this_search.hit_bbox_a));
+			if (this_search.hit_count_a) memcpy(this_search.hit_bbox_a, found->box, this_search.hit_count_a * sizeof(fz_rect));
 		}
 
 		if (this_search.hit_count_a) this_search.has_hits = 1;
@@ -2501,17 +4784,22 @@ int do_search( void ) {
 
 
 
-int ddi_get(char *buf, size_t size) {
-	int result = 0;
+/*
+ * Pick up the next DDI message, whatever its length. The caller frees
+ * what's returned; NULL if nothing has arrived.
+ *
+ */
+char *ddi_get(void) {
+	char *buf;
 
-	if (!ddiprefix) return 0;
+	if (!ddiprefix) return NULL;
 
-	if (DDI_pickup(&ddi, buf, size) == 0) {
+	buf = DDI_pickup_alloc(&ddi);
+	if (buf) {
 		flog("%s:%d: Received '%s'\r\n", FL, buf);
-		result = 1;
 	} // if file opened
 
-	return result;
+	return buf;
 }
 
 
@@ -2728,8 +5016,7 @@ static int ddi_check_headless(char *sn_a) {
 		 *
 		 */
 		this_search.page = fz_clampi(this_search.page, 0, fz_count_pages(ctx, doc) - 1);
-		this_search.hit_count_a =
-			fz_search_page_number(ctx, doc, this_search.page, this_search.a, this_search.hit_bbox_a, nelem(this_search.hit_bbox_a));
+		this_search.hit_count_a = search_page_parts(this_search.page, this_search.a, this_search.b, this_search.c);
 
 		/*
 		 * With compound searching, we're using using the initial part just to locate our page
@@ -2758,67 +5045,13 @@ static int ddi_check_headless(char *sn_a) {
 				return this_search.hit_count_a;
 			}
 
-			this_search.page = fz_clampi(this_search.page, 0, fz_count_pages(ctx, doc) - 1);
-			this_search.hit_count_b = fz_search_page_number(
-					ctx, doc, this_search.page, this_search.b, this_search.hit_bbox_b, nelem(this_search.hit_bbox_b));
+			this_search.hit_count_b = hits_b.len;
 			if (this_search.hit_count_b == 0) return 0;
 
-			if (this_search.hit_count_b > 0) {
-
-				if (strlen(this_search.c) > 0) {
-					this_search.hit_count_c = fz_search_page_number(
-							ctx, doc, this_search.page, this_search.c, this_search.hit_bbox_c, nelem(this_search.hit_bbox_c));
-					if (this_search.hit_count_c == 0) return 0;
-				} else
-					this_search.hit_count_c = 0;
-
-				{
-					int i;
-					/*
-					 * Now... let's try merge these boxes :-o
-					 *
-					 */
-
-					for (i = 0; i < this_search.hit_count_a; i++) {
-						int j;
-						double dist_b, dist_c;
-
-						if (this_search.hit_count_b) {
-							dist_b = 100000000.0f;
-							for (j = 0; j < this_search.hit_count_b; j++) {
-								double dx = this_search.hit_bbox_a[i].x0 - this_search.hit_bbox_b[j].x0;
-								double dy = this_search.hit_bbox_a[i].y0 - this_search.hit_bbox_b[j].y0;
-								double td = dx * dx + dy * dy;
-								if (td < dist_b) {
-									dist_b = td;
-								}
-							}
-						} else
-							dist_b = 0;
-
-						if (this_search.hit_count_c) {
-							dist_c = 100000000.0f;
-							for (j = 0; j < this_search.hit_count_c; j++) {
-								double dx = this_search.hit_bbox_a[i].x0 - this_search.hit_bbox_c[j].x0;
-								double dy = this_search.hit_bbox_a[i].y0 - this_search.hit_bbox_c[j].y0;
-								double td = dx * dx + dy * dy;
-								if (td < dist_c) {
-									dist_c = td;
-								}
-							}
-						} else
-							dist_c = 0;
+			this_search.hit_count_c = hits_c.len;
+			if (strlen(this_search.c) && (this_search.hit_count_c == 0)) return 0;
 
-						if ((dist_b < compsearch_radius) && (dist_c < compsearch_radius)) {
-							flog("%s:%d: triple hit ( %f %f )\r\n", FL, dist_b, dist_c);
-							new_hit_count++;
-						} // test to see if we have a triple hit in the same vacinity
-						else {
-							//								fprintf(stderr,"%s:%d: NO hit :( ( %f %f )\r\n", FL, dist_b, dist_c );
-						}
-					} // for each of our original parameter hits
-				}     // if this page has hits for the third parameter
-			}         // if this page has hits for the second parameter
+			new_hit_count = compound_merge(0, NULL, 0);
 		}             // if this page has hits for first parameter
 		if (new_hit_count) break;
 
@@ -2829,12 +5062,442 @@ static int ddi_check_headless(char *sn_a) {
 	return new_hit_count;
 }
 
+/*
+ * Batched headless search
+ *
+ * '!batchsearch:q1;q2;...' carries many queries at once, each in the
+ * '!compsearch:' a[:b[:c]] form, eg, a whole BOM of designators. The
+ * document is scanned once: each page's text is extracted at most once
+ * and checked for every query that the text index says could be on it.
+ *
+ * The reply is a single DDI dispatch,
+ *
+ *    !batchHits:<queries>
+ *    !batchHit:<n> <hits> <first page> <x0> <y0> <x1> <y1>
+ *    ...
+ *
+ * with one '!batchHit:' line per query in request order. Hits are
+ * totalled over the whole document; the page (1-based, 0 if there was
+ * no hit) and box are those of the first hit found.
+ *
+ */
+struct batch_query {
+	char *a, *b, *c;
+	int hits;
+	int first_page;
+	fz_rect first_bbox;
+	unsigned char *pages; // candidate pages from the text index
+};
+
+static int batch_query_page(struct batch_query *q, int number) {
+	int count;
+
+	if (search_page_parts(number, q->a, q->b, q->c) == 0) return 0;
+
+	if (q->b[0] == '\0' && q->c[0] == '\0') {
+		count = hits_a.len;
+		if (!q->hits) q->first_bbox = hits_a.box[0];
+	} else {
+		/* compound_merge works from this_search's parts */
+		fz_strlcpy(this_search.a, q->a, sizeof(this_search.a));
+		fz_strlcpy(this_search.b, q->b, sizeof(this_search.b));
+		fz_strlcpy(this_search.c, q->c, sizeof(this_search.c));
+		count = compound_merge(1, NULL, 0);
+		if (count && !q->hits) q->first_bbox = this_search.hit_bbox_a[0];
+	}
+
+	if (count && !q->hits) q->first_page = number + 1;
+	q->hits += count;
+	return count;
+}
+
+static void batch_search(const char *queries) {
+	struct batch_query *q = NULL;
+	unsigned char *any = NULL;
+	fz_buffer *reply = NULL;
+	char *list, *cursor;
+	int nq = 0, pages, strict, i, k;
+	char *p;
+
+	list = fz_strdup(ctx, queries);
+	pages = fz_count_pages(ctx, doc);
+	strict = ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH;
+
+	fz_var(q);
+	fz_var(nq);
+	fz_var(any);
+	fz_var(reply);
+
+	fz_try(ctx) {
+		for (p = list; *p; p++) if (*p == ';') nq++;
+		q = fz_calloc(ctx, nq + 1, sizeof(*q));
+
+		/* split 'a:b:c;a:b:c;...' in place */
+		nq = 0;
+		cursor = list;
+		for (p = fz_strsep(&cursor, ";"); p; p = fz_strsep(&cursor, ";")) {
+			struct batch_query *bq = &q[nq];
+			if (*p == '\0') continue;
+			bq->a = p;
+			bq->b = strchr(p, ':');
+			if (bq->b) *bq->b++ = '\0'; else bq->b = "";
+			bq->c = strchr(bq->b, ':');
+			if (bq->c) *bq->c++ = '\0'; else bq->c = "";
+			bq->pages = fz_malloc(ctx, fz_maxi(pages, 1));
+			nq++;
+
+			fz_text_index_candidates(ctx, doc_index, bq->a, strict, bq->pages);
+			if (bq->b[0] || bq->c[0]) {
+				unsigned char *tmp = fz_malloc(ctx, fz_maxi(pages, 1));
+				if (bq->b[0]) {
+					fz_text_index_candidates(ctx, doc_index, bq->b, strict, tmp);
+					for (k = 0; k < pages; k++) bq->pages[k] &= tmp[k];
+				}
+				if (bq->c[0]) {
+					fz_text_index_candidates(ctx, doc_index, bq->c, strict, tmp);
+					for (k = 0; k < pages; k++) bq->pages[k] &= tmp[k];
+				}
+				fz_free(ctx, tmp);
+			}
+		}
+
+		any = fz_calloc(ctx, fz_maxi(pages, 1), 1);
+		for (i = 0; i < nq; i++) {
+			for (k = 0; k < pages; k++) any[k] |= q[i].pages[k];
+		}
+		warm_page_text(any);
+
+		for (k = 0; k < pages; k++) {
+			for (i = 0; i < nq; i++) {
+				if (q[i].pages[k]) batch_query_page(&q[i], k);
+			}
+		}
+
+		reply = fz_new_buffer(ctx, 64 * (nq + 1));
+		fz_append_printf(ctx, reply, "!batchHits:%d\r\n", nq);
+		for (i = 0; i < nq; i++) {
+			fz_append_printf(ctx, reply, "!batchHit:%d %d %d %g %g %g %g\r\n",
+					i + 1,
+					q[i].hits,
+					q[i].first_page,
+					q[i].first_bbox.x0, q[i].first_bbox.y0, q[i].first_bbox.x1, q[i].first_bbox.y1);
+		}
+		ddi_reply(fz_string_from_buffer(ctx, reply));
+		flog("%s:%d: Answered %d batched queries over %d pages\r\n", FL, nq, pages);
+	}
+	fz_always(ctx) {
+		if (q) for (i = 0; i < nq; i++) fz_free(ctx, q[i].pages);
+		fz_free(ctx, q);
+		fz_free(ctx, any);
+		fz_free(ctx, list);
+		fz_drop_buffer(ctx, reply);
+	}
+	fz_catch(ctx) {
+		flog("%s:%d: Batch search failed (%s)\r\n", FL, fz_caught_message(ctx));
+		ddi_reply("!batchHits:0\r\n");
+	}
+}
+
+/*
+ * Hit list
+ *
+ * With '!hitlist:' in a request, every hit for the search it sets up
+ * is sent back in one DDI dispatch,
+ *
+ *    !hitList:<matches>
+ *    !hit:<match> <page> <part> <x0> <y0> <x1> <y1>
+ *    ...
+ *
+ * (see struct hit_stream), so the host can place its own markers and
+ * step through the hits without a '!search_next:' round trip for each.
+ * Compound parts are matched up the same way as for the on-screen
+ * search; a '!pagesearch:' only covers the page being viewed.
+ *
+ */
+static void hit_list_reply(void) {
+	struct hit_stream hs = { NULL, 0 };
+	unsigned char *wanted = NULL;
+	fz_buffer *reply = NULL;
+	int pages, first, last, k, i;
+
+	fz_var(hs.buf);
+	fz_var(wanted);
+	fz_var(reply);
+	fz_try(ctx) {
+		hs.buf = fz_new_buffer(ctx, 1024);
+
+		pages = fz_count_pages(ctx, doc);
+		first = 0;
+		last = pages - 1;
+		if (this_search.mode == SEARCH_MODE_INPAGE) first = last = fz_clampi(currently_viewed_page, 0, pages - 1);
+
+		if (this_search.a[0]) {
+			if (first != last) {
+				wanted = fz_malloc(ctx, fz_maxi(pages, 1));
+				fz_text_index_candidates(ctx, doc_index, this_search.a, ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH, wanted);
+				warm_page_text(wanted);
+			}
+			for (k = first; k <= last; k++) {
+				if (this_search.mode == SEARCH_MODE_COMPOUND) {
+					if (search_page_parts(k, this_search.a, this_search.b, this_search.c) == 0) continue;
+				} else {
+					if (search_page_hits(k, this_search.a, &hits_a) == 0) continue;
+				}
+
+				if (this_search.mode != SEARCH_MODE_COMPOUND || (this_search.b[0] == '\0' && this_search.c[0] == '\0')) {
+					for (i = 0; i < hits_a.len; i++) {
+						hs.matches++;
+						stream_hit(&hs, k, 'a', &hits_a.box[i]);
+					}
+				} else {
+					compound_merge(0, &hs, k);
+				}
+			}
+		}
+
+		reply = fz_new_buffer(ctx, fz_buffer_storage(ctx, hs.buf, NULL) + 32);
+		fz_append_printf(ctx, reply, "!hitList:%d\r\n", hs.matches);
+		fz_append_buffer(ctx, reply, hs.buf);
+		ddi_reply(fz_string_from_buffer(ctx, reply));
+		flog("%s:%d: Sent %d hit(s) for '%s'\r\n", FL, hs.matches, this_search.a);
+	}
+	fz_always(ctx) {
+		fz_free(ctx, wanted);
+		fz_drop_buffer(ctx, hs.buf);
+		fz_drop_buffer(ctx, reply);
+	}
+	fz_catch(ctx) {
+		flog("%s:%d: Hit list failed (%s)\r\n", FL, fz_caught_message(ctx));
+		ddi_reply("!hitList:0\r\n");
+	}
+}
+
+/*
+ * Answer the headless query that's been set up by ddi_process()
+ *
+ */
+static void headless_reply(void) {
+	char s[100];
+
+	if (batch_data) {
+		if (doc) batch_search(batch_data);
+		else ddi_reply("!batchHits:0\r\n");
+		free(batch_data);
+		batch_data = NULL;
+	} else {
+		snprintf(s, sizeof(s), "!headlessHits:%d", doc ? ddi_check_headless(headless_data) : 0);
+		ddi_reply(s);
+	}
+
+	if (hitlist_requested) {
+		if (doc) hit_list_reply();
+		else ddi_reply("!hitList:0\r\n");
+		hitlist_requested = 0;
+	}
+}
+
+/*
+ * Headless server
+ *
+ * With '!serve:<seconds>' in the headless request, fbvpdf answers the
+ * first query and then keeps polling DDI for more '!headless:' queries
+ * instead of exiting, until it gets '!quit:' or goes <seconds> without
+ * one. Each query is handled as if it were the first request of a new
+ * process, with the '!load:' document switched in from a table of open
+ * documents. Keeping the documents open keeps their compact page text and
+ * text index, so a repeated probe only costs the search.
+ *
+ */
+struct server_doc {
+	char filename[PATH_MAX];
+	time_t mtime;
+	time_t last_used;
+	fz_document *doc;
+	pdf_document *pdf;
+	fz_text_index *index;
+	char index_path[PATH_MAX];
+	unsigned char fingerprint[16];
+	int index_saved;
+	struct page_texts text;
+};
+
+static struct server_doc server_docs[SERVER_MAX_DOCS];
+static int server_active = -1;
+
+static time_t file_mtime(const char *fn) {
+	struct stat st;
+	if (stat(fn, &st)) return 0;
+	return st.st_mtime;
+}
+
+/*
+ * Hand the document in the globals back to its table slot.
+ *
+ */
+static void server_leave(void) {
+	struct server_doc *sd;
+
+	if (server_active < 0) return;
+	sd = &server_docs[server_active];
+	sd->index_saved = doc_index_saved;
+	sd->text = doc_text;
+
+	fz_drop_outline(ctx, outline);
+	outline   = NULL;
+	doc       = NULL;
+	pdf       = NULL;
+	doc_index = NULL;
+	memset(&doc_text, 0, sizeof(doc_text));
+	server_active = -1;
+}
+
+static void server_enter(int i) {
+	struct server_doc *sd = &server_docs[i];
+
+	doc       = sd->doc;
+	pdf       = sd->pdf;
+	doc_index = sd->index;
+	fz_strlcpy(doc_index_path, sd->index_path, sizeof(doc_index_path));
+	memcpy(doc_fingerprint, sd->fingerprint, sizeof(doc_fingerprint));
+	doc_index_saved = sd->index_saved;
+	doc_text = sd->text;
+	server_active = i;
+}
+
+/*
+ * Take ownership of the document that is in the globals.
+ *
+ */
+static void server_adopt(int i) {
+	struct server_doc *sd = &server_docs[i];
+
+	fz_strlcpy(sd->filename, filename, sizeof(sd->filename));
+	sd->mtime = file_mtime(filename);
+	sd->doc   = doc;
+	sd->pdf   = pdf;
+	sd->index = doc_index;
+	fz_strlcpy(sd->index_path, doc_index_path, sizeof(sd->index_path));
+	memcpy(sd->fingerprint, doc_fingerprint, sizeof(sd->fingerprint));
+	sd->index_saved = doc_index_saved;
+	sd->text = doc_text;
+	server_active = i;
+}
+
+static void server_drop(int i) {
+	struct server_doc *sd = &server_docs[i];
+
+	if (i == server_active) server_leave();
+	if (!sd->doc) return;
+
+	flog("%s:%d: Closing '%s' (%lu bytes of page text)\r\n", FL, sd->filename, (unsigned long)sd->text.bytes);
+	save_index_sidecar(sd->index, sd->index_path, sd->fingerprint, &sd->index_saved);
+	fz_drop_text_index(ctx, sd->index);
+	drop_page_texts(&sd->text);
+	fz_drop_document(ctx, sd->doc);
+	memset(sd, 0, sizeof(*sd));
+}
+
+/*
+ * Make 'filename' the current document, reusing the open one if the
+ * file hasn't changed since it was loaded.
+ *
+ */
+static void server_use_document(void) {
+	time_t mtime = file_mtime(filename);
+	int i, slot = -1;
+
+	for (i = 0; i < SERVER_MAX_DOCS; i++) {
+		if (server_docs[i].doc && !strcmp(server_docs[i].filename, filename)) {
+			if (server_docs[i].mtime == mtime) slot = i;
+			else server_drop(i);
+			break;
+		}
+	}
+
+	if (slot != server_active) server_leave();
+
+	if (slot < 0) {
+		for (i = 0; i < SERVER_MAX_DOCS; i++) {
+			if (!server_docs[i].doc) break;
+			if (slot < 0 || server_docs[i].last_used < server_docs[slot].last_used) slot = i;
+		}
+		if (i < SERVER_MAX_DOCS) slot = i;
+		else server_drop(slot);
+
+		flog("%s:%d: Opening '%s'\r\n", FL, filename);
+		fz_try(ctx) {
+			load_document();
+		}
+		fz_catch(ctx) {
+			flog("%s:%d: Could not open '%s' (%s)\r\n", FL, filename, fz_caught_message(ctx));
+			fz_drop_text_index(ctx, doc_index);
+			drop_page_texts(&doc_text);
+			fz_drop_document(ctx, doc);
+			doc_index = NULL;
+			doc       = NULL;
+			pdf       = NULL;
+			return;
+		}
+		server_adopt(slot);
+	} else if (slot != server_active) {
+		server_enter(slot);
+	}
+
+	server_docs[slot].last_used = time(NULL);
+}
+
+static void run_headless_server(void) {
+	char *s;
+	time_t last_query = time(NULL);
+	int i;
+
+	flog("%s:%d: Headless server running (idle timeout %d second(s))\r\n", FL, server_idle);
+
+	if (doc) {
+		server_adopt(0);
+		server_docs[0].last_used = last_query;
+	}
+
+	while (!doquit && (time(NULL) - last_query < server_idle)) {
+		if ((s = ddi_get()) == NULL) {
+#ifdef _WIN32
+			Sleep(10);
+#else
+			DDI_poll(&ddi, 10);
+#endif
+			continue;
+		}
+
+		last_query = time(NULL);
+		if (strlen(s) < 2) {
+			free(s);
+			continue;
+		}
+
+		clear_search();
+		if (ctx) ctx->flags &= ~FZ_CTX_FLAGS_STRICT_MATCH;
+		ddi_process(s);
+		free(s);
+		if (doquit) break;
+
+		if (reload_required) {
+			reload_required = 0;
+			server_use_document();
+		}
+
+		headless_reply();
+	}
+
+	flog("%s:%d: Headless server stopping\r\n", FL);
+	for (i = 0; i < SERVER_MAX_DOCS; i++) server_drop(i);
+}
+
 /*
  * Standard DDI check with normal GUI searching processing
  *
  */
-static void ddi_check(void) {
-	char ddi_data[10240];
+static int ddi_check(void) {
+	char *ddi_data = NULL;
 
 	/*
 	 *
@@ -2845,18 +5508,47 @@ static void ddi_check(void) {
 	 *
 	 */
 
-	if ((ddi_simulate_option) || (ddi_get(ddi_data, sizeof(ddi_data)))) {
+	if ((ddi_simulate_option) || ((ddi_data = ddi_get()) != NULL)) {
 
 		if (ddi_simulate_option == DDI_SIMULATE_OPTION_PREPROCESSED_SEARCH) {
 			ddi_simulate_option = DDI_SIMULATE_OPTION_NONE;
 
 		} else {
-			if (strlen(ddi_data) < 2) return;
+			if (!ddi_data || strlen(ddi_data) < 2) {
+				free(ddi_data);
+				return 0;
+			}
 			flog("%s:%d: DDI DATA: '%s'\r\n", FL, ddi_data);
 			ddi_process(ddi_data);
 			flog("%s:%d: After DDI Processing Searching: '%s'\r\n", FL, this_search.a);
+			if (hitlist_requested) {
+				if (doc && !detached) hit_list_reply();
+				hitlist_requested = 0;
+			}
+		}
+		free(ddi_data);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sleep until SDL has an event (input, or a worker's wake_event) or
+ * timeout ms pass. With a DDI peer on the socket its messages end the
+ * wait too; SDL can't wait on the socket, so the two take turns.
+ *
+ */
+static void wait_for_work(int timeout) {
+#ifndef _WIN32
+	if (ddi.transport == DDI_TRANSPORT_SOCKET && ddi.peer_fd >= 0) {
+		for (; timeout > 0; timeout -= 10) {
+			if (SDL_WaitEventTimeout(NULL, fz_mini(timeout, 10)) || DDI_poll(&ddi, 0)) return;
 		}
+		return;
 	}
+#endif
+	SDL_WaitEventTimeout(NULL, timeout);
 }
 
 void ui_set_clipboard(const char *buf) {
@@ -2874,6 +5566,8 @@ static void usage(const char *argv0) {
 	fprintf(stderr, "\t-r -\tresolution\n");
 	fprintf(stderr, "\t-I\tinvert colors\n");
 	fprintf(stderr, "\t-D\t<ddi prefix>\n");
+	fprintf(stderr, "\t-T -\trender threads (default one per core, 0 for none)\n");
+	fprintf(stderr, "\t-C -\tcolour mode: auto (gray for pages without colour), gray or rgb\n");
 	fprintf(stderr, "\t-W -\tpage width for EPUB layout\n");
 	fprintf(stderr, "\t-H -\tpage height for EPUB layout\n");
 	fprintf(stderr, "\t-S -\tfont size for EPUB layout\n");
@@ -3006,9 +5700,8 @@ int main(int argc, char **argv)
 	int c;
 	int check_again  = 0;
 	int wait_for_ddi = 10;
-	int sleepout     = 100;
 	char flogpath[4096];
-	char s[10240];
+	char *s;
 
 	//debug = 1;
 	getexepath(exepath, sizeof(exepath));
@@ -3072,7 +5765,7 @@ int main(int argc, char **argv)
 	process_start_time = time(NULL); // used to discriminate if we're picking up old !quit: calls.
 
 	flog("Parsing parameters\r\n");
-	while ((c = fz_getopt(argc, argv, "p:r:i:s:IsW:H:S:U:X:D:")) != -1) {
+	while ((c = fz_getopt(argc, argv, "p:r:i:s:IsW:H:S:U:X:D:T:C:")) != -1) {
 		switch (c) {
 			default: usage(argv[0]); break;
 			case 'i': snprintf(filename, sizeof(filename), "%s", fz_optarg); break;
@@ -3085,6 +5778,8 @@ int main(int argc, char **argv)
 			case 'U': layout_css = fz_optarg; break;
 			case 'X': layout_use_doc_css = 0; break;
 			case 'D': ddiprefix = fz_optarg; break;
+			case 'T': band_threads = fz_atoi(fz_optarg); break;
+			case 'C': set_color_mode(fz_optarg); break;
 			case 's': ddiloadstr = fz_optarg; break;
 			case 'd': debug = 1; break;
 		}
@@ -3108,8 +5803,9 @@ int main(int argc, char **argv)
 	if (ddiloadstr)
 		ddi_process(ddiloadstr);
 	else {
-		DDI_pickup(&ddi, s, sizeof(s));
-		ddi_process(s);
+		s = DDI_pickup_alloc(&ddi);
+		if (s) ddi_process(s);
+		free(s);
 	}
 
 	if (this_search.mode != SEARCH_MODE_NONE) ddi_simulate_option = DDI_SIMULATE_OPTION_PREPROCESSED_SEARCH;
@@ -3135,10 +5831,10 @@ int main(int argc, char **argv)
 	 *
 	 */
 	if (runmode == RUNMODE_HEADLESS) {
-		int r;
-		r = ddi_check_headless(headless_data);
-		snprintf(s, sizeof(s), "!headlessHits:%d", r);
-		DDI_dispatch(&ddi, s);
+		headless_reply();
+		if (server_idle) run_headless_server();
+		else save_doc_index();
+		DDI_close(&ddi);
 		exit(0);
 	}
 
@@ -3166,7 +5862,7 @@ int main(int argc, char **argv)
 
 	flog("Initialising FlexBV-PDF. Filename = '%s'\r\n", filename);
 
-	ctx = fz_new_context(NULL, NULL, 0);
+	ctx = new_viewer_context();
 	if (search_heuristics) ctx->flags |= FZ_CTX_FLAGS_SPACE_HEURISTIC;
 
 	fz_register_document_handlers(ctx);
@@ -3206,6 +5902,7 @@ int main(int argc, char **argv)
 	has_ARB_texture_non_power_of_two = 0;
 
 	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	init_texture_upload();
 
 	ui.fontsize   = DEFAULT_UI_FONTSIZE;
 	ui.baseline   = DEFAULT_UI_BASELINE;
@@ -3233,20 +5930,24 @@ int main(int argc, char **argv)
 		glClearColor(0.3f, 0.3f, 0.5f, 1.0f);
 
 		flog("%s:%d: SDL loop starting\r\n\r\n", FL);
-		while (!doquit) {
+		wake_event = SDL_RegisterEvents(1);
+		if (wake_event == (Uint32)-1) wake_event = 0;
 
-			//			if (!(SDL_getWindowFlags() & SDL_WINDOW_SHOWN)) continue;
+		while (!doquit) {
 
-			glClear(GL_COLOR_BUFFER_BIT);
-			glMatrixMode(GL_PROJECTION);
-			glLoadIdentity();
-			glOrtho(0, window_w, window_h, 0, 0.0f, 1.0f);
-			glMatrixMode(GL_MODELVIEW);
-			glLoadIdentity();
+			/*
+			 * Nothing changed: sleep until something does, or until
+			 * it's time to look at the DDI files again. A search in
+			 * progress draws a frame per slice, with a short breather.
+			 *
+			 */
+			if (!redraw || this_search.active) wait_for_work(redraw ? 5 : DDI_IDLE_MS);
 
 			while (SDL_PollEvent(&sdlEvent)) {
 
-				sleepout = 30;
+				redraw = 2; // the UI can take a second frame to settle after input
+
+				if (wake_event && sdlEvent.type == wake_event) SDL_AtomicSet(&wake_pending, 0);
 
 				switch (sdlEvent.type) {
 
@@ -3327,43 +6028,35 @@ int main(int argc, char **argv)
 
 			/*
 			 * so that we do not constantly thrash the filesystem
-			 * we only check the ddi after multiple frames
+			 * we only check the ddi after multiple frames, a
+			 * socket costs nothing to look at so it's every frame
 			 *
 			 */
-			if (check_again) {
+			if (redraw && check_again && ddi.transport != DDI_TRANSPORT_SOCKET) {
 				check_again--;
 			} else {
-				ddi_check();
+				if (ddi_check()) redraw = 2;
 				check_again = 5; // 10?  Bigger means longer wait
 			}
 
-			run_processing_loop();
+			text_worker_collect();
 
-			ui.key = ui.mod = ui.plain = 0;
-			SDL_GL_SwapWindow(sdlWindow);
+			if (redraw) {
+				glClear(GL_COLOR_BUFFER_BIT);
+				glMatrixMode(GL_PROJECTION);
+				glLoadIdentity();
+				glOrtho(0, window_w, window_h, 0, 0.0f, 1.0f);
+				glMatrixMode(GL_MODELVIEW);
+				glLoadIdentity();
 
-			if (!(sleepout--)) {
-#ifdef _WIN32
-				Sleep(50);
-#else
-				usleep(50000);
-#endif
-				sleepout = 0;
-				continue;
+				run_processing_loop();
 
-			} else {
-				// We've had to put this 1ms interframe sleep in because
-				// SDL2 or something is crashing out with deltaTime issues
-				// (might just be ImGUI)
-#ifdef _WIN32
-				Sleep(5);
-#else
-				usleep(5000);
-#endif
+				ui.key = ui.mod = ui.plain = 0;
+				SDL_GL_SwapWindow(sdlWindow);
+				redraw--;
 			}
 
-				// puts fbvpdf to sleep if nothing is happening.
-				//
+			if (this_search.active) redraw = fz_maxi(redraw, 1);
 
 		} // while !doquit
 
@@ -3389,10 +6082,18 @@ int main(int argc, char **argv)
 
 	fz_drop_stext_page(ctx, text);
 	fz_drop_link(ctx, links);
+	fz_drop_display_list(ctx, page_list);
 	fz_drop_page(ctx, page);
 	fz_drop_outline(ctx, outline);
+	text_worker_stop();
+	tile_worker_stop();
+	band_workers_stop();
+	save_doc_index();
+	fz_drop_text_index(ctx, doc_index);
+	drop_page_texts(&doc_text);
 	fz_drop_document(ctx, doc);
 	fz_drop_context(ctx);
+	DDI_close(&ddi);
 
 	flog("%s:%d: Finished. Good bye.\r\n", FL);
 
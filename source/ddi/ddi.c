@@ -6,8 +6,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#endif
+
 #include "ddi.h"
 
+#ifdef MSG_NOSIGNAL
+#define DDI_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define DDI_SEND_FLAGS 0
+#endif
+
 
 void DDI_set_debug( struct ddi_s *ddi, int debug ) {
 	ddi->debug = debug;
@@ -19,6 +33,7 @@ void DDI_set_prefix( struct ddi_s *ddi, char *prefix ) {
 	snprintf(ddi->pickup_name, sizeof(ddi->pickup_name), "%s.%s", prefix, DDI_IN_SUFFIX);
 	snprintf(ddi->dispatch_tname, sizeof(ddi->dispatch_tname), "%s.t%s", prefix, DDI_OUT_SUFFIX);
 	snprintf(ddi->pickup_tname, sizeof(ddi->pickup_tname), "%s.t%s", prefix, DDI_IN_SUFFIX);
+	snprintf(ddi->sock_name, sizeof(ddi->sock_name), "%s.%s", prefix, DDI_SOCK_SUFFIX);
 }
 
 void DDI_init( struct ddi_s *ddi ) {
@@ -28,11 +43,20 @@ void DDI_init( struct ddi_s *ddi ) {
 	ddi->mode = DDI_MODE_NONE;
 	ddi->last_dispatch[0] = '\0';
 	ddi->last_pickup[0] = '\0';
+	ddi->transport = DDI_TRANSPORT_FILE;
+	ddi->listen_fd = -1;
+	ddi->peer_fd = -1;
+	ddi->sock_name[0] = '\0';
+	ddi->inbuf = NULL;
+	ddi->inlen = ddi->incap = 0;
 }
 
 int DDI_wait( struct ddi_s *ddi, int cycles ) {
 	struct stat buffer;   
 
+	/* socket messages are queued in order, there's nothing to wait for */
+	if (ddi->peer_fd >= 0) return 0;
+
 	while(cycles--) {
 		if (stat(ddi->dispatch_name, &buffer)) return 0;
 		usleep(10000);
@@ -45,6 +69,234 @@ void DDI_set_mode( struct ddi_s *ddi, int mode ) {
 }
 
 
+/*
+ * Socket transport
+ *
+ */
+#ifndef _WIN32
+static int ddi_nonblock( int fd ) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int ddi_sock_open( struct ddi_s *ddi ) {
+	struct sockaddr_un sa;
+	int fd;
+
+	if (strlen(ddi->sock_name) >= sizeof(sa.sun_path)) return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, ddi->sock_name);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return 1;
+
+	if (ddi->mode == DDI_MODE_SLAVE) {
+		unlink(ddi->sock_name);
+		if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 4) || ddi_nonblock(fd)) {
+			if (ddi->debug) fprintf(stderr,"%s:%d: Unable to listen on '%s' (%s)\n", __FILE__, __LINE__, ddi->sock_name, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		ddi->listen_fd = fd;
+	} else {
+		if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) || ddi_nonblock(fd)) {
+			if (ddi->debug) fprintf(stderr,"%s:%d: Unable to connect to '%s' (%s)\n", __FILE__, __LINE__, ddi->sock_name, strerror(errno));
+			close(fd);
+			return 1;
+		}
+		ddi->peer_fd = fd;
+	}
+
+	return 0;
+}
+
+static void ddi_sock_drop_peer( struct ddi_s *ddi ) {
+	if (ddi->peer_fd >= 0) close(ddi->peer_fd);
+	ddi->peer_fd = -1;
+	ddi->inlen = 0;
+}
+
+static void ddi_sock_accept( struct ddi_s *ddi ) {
+	int fd;
+
+	if (ddi->listen_fd < 0) return;
+
+	/* one peer at a time, a new connection replaces the old one */
+	while ((fd = accept(ddi->listen_fd, NULL, NULL)) >= 0) {
+		ddi_sock_drop_peer(ddi);
+		ddi_nonblock(fd);
+		ddi->peer_fd = fd;
+	}
+}
+
+static int ddi_sock_dispatch( struct ddi_s *ddi, const char *request ) {
+	size_t len = strlen(request) + 1; // the NUL ends the message
+	size_t off = 0;
+
+	if (ddi->peer_fd < 0 && ddi->mode == DDI_MODE_MASTER) ddi_sock_open(ddi);
+	if (ddi->peer_fd < 0) return 1;
+
+	while (off < len) {
+		ssize_t n = send(ddi->peer_fd, request + off, len - off, DDI_SEND_FLAGS);
+		if (n > 0) {
+			off += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			fd_set wfds;
+			struct timeval tv = { 1, 0 };
+			FD_ZERO(&wfds);
+			FD_SET(ddi->peer_fd, &wfds);
+			if (select(ddi->peer_fd + 1, NULL, &wfds, NULL, &tv) <= 0) break;
+		} else {
+			break;
+		}
+	}
+
+	if (off < len) {
+		if (ddi->debug) fprintf(stderr,"%s:%d: Lost DDI peer (%s)\n", __FILE__, __LINE__, strerror(errno));
+		ddi_sock_drop_peer(ddi);
+		return 1;
+	}
+
+	return 0;
+}
+
+static char *ddi_sock_pickup( struct ddi_s *ddi ) {
+	char *end, *msg;
+	size_t len;
+
+	ddi_sock_accept(ddi);
+	if (ddi->peer_fd < 0) return NULL;
+
+	while (1) {
+		ssize_t n;
+
+		if (ddi->incap - ddi->inlen < 4096) {
+			size_t cap = ddi->incap ? ddi->incap * 2 : 16384;
+			char *p = realloc(ddi->inbuf, cap);
+			if (!p) break;
+			ddi->inbuf = p;
+			ddi->incap = cap;
+		}
+
+		n = recv(ddi->peer_fd, ddi->inbuf + ddi->inlen, ddi->incap - ddi->inlen, 0);
+		if (n > 0) {
+			ddi->inlen += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+		/* peer has gone, but hand over anything it finished sending first */
+		if (!ddi->inlen || !memchr(ddi->inbuf, '\0', ddi->inlen)) {
+			ddi_sock_drop_peer(ddi);
+			return NULL;
+		}
+		break;
+	}
+
+	end = ddi->inlen ? memchr(ddi->inbuf, '\0', ddi->inlen) : NULL;
+	if (!end) return NULL;
+
+	len = end - ddi->inbuf + 1;
+	msg = malloc(len);
+	if (!msg) return NULL;
+	memcpy(msg, ddi->inbuf, len);
+
+	memmove(ddi->inbuf, ddi->inbuf + len, ddi->inlen - len);
+	ddi->inlen -= len;
+
+	return msg;
+}
+#else
+static int ddi_sock_dispatch( struct ddi_s *ddi, const char *request ) { return 1; }
+static char *ddi_sock_pickup( struct ddi_s *ddi ) { return NULL; }
+#endif
+
+/*
+ * Switch to the socket transport (the file transport is always there
+ * as a fallback). Returns non-zero if the socket couldn't be set up,
+ * in which case we stay with files.
+ *
+ */
+int DDI_set_transport( struct ddi_s *ddi, int transport ) {
+	if (transport == ddi->transport) return 0;
+
+	DDI_close(ddi);
+	if (transport == DDI_TRANSPORT_FILE) return 0;
+
+#ifndef _WIN32
+	if (ddi->mode == DDI_MODE_NONE || ddi->sock_name[0] == '\0') return 1;
+
+	/* a master without a listening slave yet will connect on dispatch */
+	if (ddi_sock_open(ddi) && ddi->mode == DDI_MODE_SLAVE) return 1;
+
+	ddi->transport = transport;
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * Wait up to timeout_ms for something to pick up. Returns non-zero if
+ * there might be a message. With the socket transport this returns as
+ * soon as data arrives, with files all we can do is sleep and say yes.
+ *
+ */
+int DDI_poll( struct ddi_s *ddi, int timeout_ms ) {
+#ifndef _WIN32
+	if (ddi->transport == DDI_TRANSPORT_SOCKET) {
+		struct timeval tv;
+		fd_set rfds;
+		int maxfd = -1;
+
+		if (ddi->inlen && memchr(ddi->inbuf, '\0', ddi->inlen)) return 1;
+
+		FD_ZERO(&rfds);
+		if (ddi->listen_fd >= 0) {
+			FD_SET(ddi->listen_fd, &rfds);
+			maxfd = ddi->listen_fd;
+		}
+		if (ddi->peer_fd >= 0) {
+			FD_SET(ddi->peer_fd, &rfds);
+			if (ddi->peer_fd > maxfd) maxfd = ddi->peer_fd;
+		}
+
+		/* without a connected peer, messages can still come in as files */
+		if (maxfd >= 0 && ddi->peer_fd >= 0) {
+			tv.tv_sec = timeout_ms / 1000;
+			tv.tv_usec = (timeout_ms % 1000) * 1000;
+			return select(maxfd + 1, &rfds, NULL, NULL, &tv) > 0;
+		}
+	}
+#endif
+
+	usleep(timeout_ms * 1000);
+	return 1;
+}
+
+void DDI_close( struct ddi_s *ddi ) {
+#ifndef _WIN32
+	ddi_sock_drop_peer(ddi);
+	if (ddi->listen_fd >= 0) {
+		close(ddi->listen_fd);
+		unlink(ddi->sock_name);
+	}
+#endif
+	ddi->listen_fd = -1;
+	ddi->peer_fd = -1;
+	free(ddi->inbuf);
+	ddi->inbuf = NULL;
+	ddi->inlen = ddi->incap = 0;
+	ddi->transport = DDI_TRANSPORT_FILE;
+}
+
+
 int DDI_dispatch( struct ddi_s *ddi, const char *request ) {
 	FILE *fo;
 	char *fn, *fnt;
@@ -54,6 +306,12 @@ int DDI_dispatch( struct ddi_s *ddi, const char *request ) {
 
 	if (ddi->debug) fprintf(stderr,"DDI Request: '%s'\n", request );
 
+	if (ddi->transport == DDI_TRANSPORT_SOCKET && ddi_sock_dispatch(ddi, request) == 0) {
+		if (ddi->resend == 0) snprintf(ddi->last_dispatch, sizeof(ddi->last_dispatch),"%s", request);
+		else ddi->resend = 0;
+		return 0;
+	}
+
 	if (ddi->mode == DDI_MODE_MASTER) {
 		fn = ddi->dispatch_name;
 		fnt = ddi->dispatch_tname;
@@ -103,14 +361,30 @@ void DDI_clear( struct ddi_s *ddi ) {
 #define FL __FILE__,__LINE__
 #endif
 
-int DDI_pickup( struct ddi_s *ddi, char *buffer, int bsize ) {
+/*
+ * Pick up the next message whole, however long it is. Returns a
+ * malloc'd, NUL terminated copy for the caller to free, or NULL if
+ * there's nothing waiting.
+ *
+ */
+char *DDI_pickup_alloc( struct ddi_s *ddi ) {
 	struct stat st;
 	FILE *f;
 	char *fn;
+	char *buffer;
 
-	buffer[0] = '\0';
-	
-	if (ddi->mode == DDI_MODE_NONE) return 1;
+	if (ddi->mode == DDI_MODE_NONE) return NULL;
+
+	if (ddi->transport == DDI_TRANSPORT_SOCKET) {
+		buffer = ddi_sock_pickup(ddi);
+		if (buffer) {
+			snprintf(ddi->last_pickup, sizeof(ddi->last_pickup),"%s",buffer);
+			return buffer;
+		}
+
+		/* while a peer is connected don't keep hitting the filesystem */
+		if (ddi->peer_fd >= 0) return NULL;
+	}
 
 	if (ddi->mode == DDI_MODE_SLAVE) {
 		fn = ddi->dispatch_name;
@@ -118,17 +392,19 @@ int DDI_pickup( struct ddi_s *ddi, char *buffer, int bsize ) {
 		fn = ddi->pickup_name;
 	}
 
-	stat(fn, &st);
+	if (stat(fn, &st) != 0) st.st_size = 0;
 
 	f = fopen(fn, "r");
 	if (f) {
 		int rc = 10;
 		int rr = 1;
-		int bc = 0;
+		size_t bc = 0;
 		
-		//fgets(buffer, bsize, f);
-		bc = fread(buffer, 1, st.st_size, f);
-		buffer[bc] = '\0';
+		buffer = malloc(st.st_size + 1);
+		if (buffer) {
+			bc = fread(buffer, 1, st.st_size, f);
+			buffer[bc] = '\0';
+		}
 		fclose(f);
 
 		while (rc--) {
@@ -140,11 +416,30 @@ int DDI_pickup( struct ddi_s *ddi, char *buffer, int bsize ) {
 				break;
 			}
 		}
+		if (!buffer) return NULL;
 		snprintf(ddi->last_pickup, sizeof(ddi->last_pickup),"%s",buffer);
 	} else {
 		if (ddi->debug) fprintf(stderr,"%s:%d: Error trying to open '%s' (%s)\n", __FILE__, __LINE__, fn, strerror(errno));
-		return 1;
+		return NULL;
 	}
 
+	return buffer;
+}
+
+/*
+ * Pick up the next message into buffer, cutting it short at bsize - 1
+ * bytes. Returns 0 if there was a message.
+ *
+ */
+int DDI_pickup( struct ddi_s *ddi, char *buffer, int bsize ) {
+	char *msg;
+
+	buffer[0] = '\0';
+
+	msg = DDI_pickup_alloc(ddi);
+	if (!msg) return 1;
+	snprintf(buffer, bsize, "%s", msg);
+	free(msg);
+
 	return 0;
 }
@@ -11,6 +11,17 @@ extern "C" {
 
 #define DDI_OUT_SUFFIX "ddo"
 #define DDI_IN_SUFFIX "ddi"
+#define DDI_SOCK_SUFFIX "dds"
+
+/*
+ * DDI_TRANSPORT_FILE exchanges each message through a file named from
+ * the prefix. DDI_TRANSPORT_SOCKET uses a local stream socket named
+ * <prefix>.dds instead, with messages terminated by a NUL; the slave
+ * listens and the master connects. Until a peer connects over the
+ * socket, and after it goes away, the file transport still works.
+ */
+#define DDI_TRANSPORT_FILE 0
+#define DDI_TRANSPORT_SOCKET 1
 
 #define DDI_LONG_STR 1024
 
@@ -26,6 +37,13 @@ struct ddi_s {
 	char pickup_name[DDI_LONG_STR];
 	char dispatch_tname[DDI_LONG_STR];
 	char pickup_tname[DDI_LONG_STR];
+
+	int transport;
+	int listen_fd;
+	int peer_fd;
+	char sock_name[DDI_LONG_STR];
+	char *inbuf;
+	size_t inlen, incap;
 };
 
 void DDI_init( struct ddi_s *ddi );
@@ -37,6 +55,10 @@ void DDI_set_prefix( struct ddi_s *ddi, char *prefix );
 int DDI_dispatch( struct ddi_s *ddi, const char *request ); 
 int DDI_resend( struct ddi_s *ddi );
 int DDI_pickup( struct ddi_s *ddi, char *buffer, int bsize );
+char *DDI_pickup_alloc( struct ddi_s *ddi );
+int DDI_set_transport( struct ddi_s *ddi, int transport );
+int DDI_poll( struct ddi_s *ddi, int timeout_ms );
+void DDI_close( struct ddi_s *ddi );
 
 #endif
 
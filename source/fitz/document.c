@@ -199,6 +199,8 @@ fz_drop_document(fz_context *ctx, fz_document *doc)
 {
 	if (fz_drop_imp(ctx, doc, &doc->refs))
 	{
+		fz_empty_stext_cache(ctx, doc);
+		fz_empty_display_list_cache(ctx, doc);
 		if (doc->drop_document)
 			doc->drop_document(ctx, doc);
 		fz_free(ctx, doc);
@@ -284,6 +286,8 @@ fz_layout_document(fz_context *ctx, fz_document *doc, float w, float h, float em
 {
 	if (doc && doc->layout)
 	{
+		fz_empty_stext_cache(ctx, doc);
+		fz_empty_display_list_cache(ctx, doc);
 		doc->layout(ctx, doc, w, h, em);
 		doc->did_layout = 1;
 	}
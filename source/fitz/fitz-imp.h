@@ -95,6 +95,27 @@ fz_output_context *fz_keep_output_context(fz_context *ctx);
 
 fz_stream *fz_open_file_ptr_no_close(fz_context *ctx, FILE *file);
 
+/*
+	fz_search_canon: Fold a character for text searching.
+
+	Line breaks, tabs and the unicode spaces all become ' ', and ASCII
+	is folded to lower case. Shared by the page search and the text
+	index so that both agree on what matches.
+*/
+static inline int
+fz_search_canon(int c)
+{
+	/* TODO: proper unicode case folding */
+	/* TODO: character equivalence (a matches ä, etc) */
+	if (c == 0xA0 || c == 0x2028 || c == 0x2029)
+		return ' ';
+	if (c == '\r' || c == '\n' || c == '\t')
+		return ' ';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
+
 #if defined(MEMENTO) || !defined(NDEBUG)
 #define FITZ_DEBUG_LOCKING
 #endif
@@ -0,0 +1,190 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+/*
+	Recording a page into a display list costs a full interpretation of
+	its contents, replaying it costs next to nothing, so the lists for
+	pages that have been drawn are kept in the resource store. They are
+	keyed on the document and page number and are evicted along with
+	everything else when the store runs short of space.
+*/
+
+typedef struct fz_list_cache_key_s fz_list_cache_key;
+typedef struct fz_list_cache_item_s fz_list_cache_item;
+
+struct fz_list_cache_key_s
+{
+	int refs;
+	fz_document *doc;
+	int number;
+};
+
+struct fz_list_cache_item_s
+{
+	fz_storable storable;
+	fz_display_list *list;
+};
+
+static int
+fz_make_hash_list_cache_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_list_cache_key *key = (fz_list_cache_key *)key_;
+	hash->u.pi.ptr = key->doc;
+	hash->u.pi.i = key->number;
+	return 1;
+}
+
+static void *
+fz_keep_list_cache_key(fz_context *ctx, void *key_)
+{
+	fz_list_cache_key *key = (fz_list_cache_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_list_cache_key(fz_context *ctx, void *key_)
+{
+	fz_list_cache_key *key = (fz_list_cache_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+		fz_free(ctx, key);
+}
+
+static int
+fz_cmp_list_cache_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_list_cache_key *k0 = (fz_list_cache_key *)k0_;
+	fz_list_cache_key *k1 = (fz_list_cache_key *)k1_;
+	return !(k0->doc == k1->doc && k0->number == k1->number);
+}
+
+static void
+fz_format_list_cache_key(fz_context *ctx, char *s, int n, void *key_)
+{
+	fz_list_cache_key *key = (fz_list_cache_key *)key_;
+	fz_snprintf(s, n, "(display list page=%d)", key->number);
+}
+
+static const fz_store_type fz_list_cache_store_type =
+{
+	fz_make_hash_list_cache_key,
+	fz_keep_list_cache_key,
+	fz_drop_list_cache_key,
+	fz_cmp_list_cache_key,
+	fz_format_list_cache_key,
+	NULL
+};
+
+static void
+fz_drop_list_cache_item_imp(fz_context *ctx, fz_storable *storable)
+{
+	fz_list_cache_item *item = (fz_list_cache_item *)storable;
+	fz_drop_display_list(ctx, item->list);
+	fz_free(ctx, item);
+}
+
+fz_display_list *
+fz_find_cached_display_list(fz_context *ctx, fz_document *doc, int number)
+{
+	fz_list_cache_key key;
+	fz_list_cache_item *item;
+	fz_display_list *list;
+
+	key.refs = 1;
+	key.doc = doc;
+	key.number = number;
+
+	item = fz_find_item(ctx, fz_drop_list_cache_item_imp, &key, &fz_list_cache_store_type);
+	if (!item)
+		return NULL;
+
+	list = fz_keep_display_list(ctx, item->list);
+	fz_drop_storable(ctx, &item->storable);
+	return list;
+}
+
+/* Put list in the store. Returns the list to use: either list itself,
+ * or (having dropped list) one that got there first. */
+static fz_display_list *
+store_display_list(fz_context *ctx, fz_document *doc, int number, fz_display_list *list)
+{
+	fz_list_cache_key *keyp = NULL;
+	fz_list_cache_item *item = NULL;
+	fz_list_cache_item *existing;
+
+	/* Any failure here will just result in us not caching. */
+	fz_var(item);
+	fz_var(keyp);
+	fz_try(ctx)
+	{
+		item = fz_malloc_struct(ctx, fz_list_cache_item);
+		FZ_INIT_STORABLE(item, 1, fz_drop_list_cache_item_imp);
+		item->list = fz_keep_display_list(ctx, list);
+
+		keyp = fz_malloc_struct(ctx, fz_list_cache_key);
+		keyp->refs = 1;
+		keyp->doc = doc;
+		keyp->number = number;
+
+		existing = fz_store_item(ctx, keyp, item, sizeof(*item) + fz_display_list_size(ctx, list), &fz_list_cache_store_type);
+		if (existing)
+		{
+			/* Another thread got there first; use theirs. */
+			fz_drop_display_list(ctx, list);
+			list = fz_keep_display_list(ctx, existing->list);
+			fz_drop_storable(ctx, &existing->storable);
+		}
+	}
+	fz_always(ctx)
+	{
+		if (item)
+			fz_drop_storable(ctx, &item->storable);
+		if (keyp)
+			fz_drop_list_cache_key(ctx, keyp);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+
+	return list;
+}
+
+fz_display_list *
+fz_load_display_list(fz_context *ctx, fz_document *doc, int number)
+{
+	fz_display_list *list;
+	fz_page *page;
+
+	list = fz_find_cached_display_list(ctx, doc, number);
+	if (list)
+		return list;
+
+	page = fz_load_page(ctx, doc, number);
+	fz_try(ctx)
+		list = fz_new_display_list_from_page_contents(ctx, page);
+	fz_always(ctx)
+		fz_drop_page(ctx, page);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return store_display_list(ctx, doc, number, list);
+}
+
+void
+fz_cache_display_list(fz_context *ctx, fz_document *doc, int number, fz_display_list *list)
+{
+	fz_drop_display_list(ctx, store_display_list(ctx, doc, number, fz_keep_display_list(ctx, list)));
+}
+
+static int
+fz_filter_list_cache(fz_context *ctx, void *doc, void *key_)
+{
+	fz_list_cache_key *key = (fz_list_cache_key *)key_;
+	return key->doc == doc;
+}
+
+void
+fz_empty_display_list_cache(fz_context *ctx, fz_document *doc)
+{
+	fz_filter_store(ctx, fz_filter_list_cache, doc, &fz_list_cache_store_type);
+}
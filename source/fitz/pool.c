@@ -10,6 +10,7 @@ typedef struct fz_pool_node_s fz_pool_node;
 
 struct fz_pool_s
 {
+	size_t size;
 	fz_pool_node *head, *tail;
 	char *pos, *end;
 };
@@ -27,6 +28,7 @@ fz_pool *fz_new_pool(fz_context *ctx)
 	pool->head = pool->tail = node;
 	pool->pos = node->mem;
 	pool->end = node->mem + POOL_SIZE;
+	pool->size = POOL_SIZE;
 	return pool;
 }
 
@@ -38,6 +40,7 @@ static void *fz_pool_alloc_oversize(fz_context *ctx, fz_pool *pool, size_t size)
 	node = fz_calloc(ctx, offsetof(fz_pool_node, mem) + size, 1);
 	node->next = pool->head;
 	pool->head = node;
+	pool->size += size;
 
 	return node->mem;
 }
@@ -58,6 +61,7 @@ void *fz_pool_alloc(fz_context *ctx, fz_pool *pool, size_t size)
 		pool->tail = pool->tail->next = node;
 		pool->pos = node->mem;
 		pool->end = node->mem + POOL_SIZE;
+		pool->size += POOL_SIZE;
 	}
 	ptr = pool->pos;
 	pool->pos += size;
@@ -72,6 +76,11 @@ char *fz_pool_strdup(fz_context *ctx, fz_pool *pool, const char *s)
 	return p;
 }
 
+size_t fz_pool_size(fz_context *ctx, fz_pool *pool)
+{
+	return pool ? pool->size : 0;
+}
+
 void fz_drop_pool(fz_context *ctx, fz_pool *pool)
 {
 	fz_pool_node *node;
@@ -0,0 +1,196 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+/*
+	Structured text pages are expensive to produce (the whole content
+	stream has to be interpreted) but cheap to keep, so we hold on to
+	them in the resource store. They are keyed on the document, the page
+	number and the stext options used to extract them, and are evicted
+	along with everything else when the store runs short of space.
+*/
+
+typedef struct fz_stext_cache_key_s fz_stext_cache_key;
+typedef struct fz_stext_cache_item_s fz_stext_cache_item;
+
+struct fz_stext_cache_key_s
+{
+	int refs;
+	fz_document *doc;
+	int number;
+	int flags;
+};
+
+struct fz_stext_cache_item_s
+{
+	fz_storable storable;
+	fz_stext_page *text;
+};
+
+static int
+fz_make_hash_stext_cache_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_stext_cache_key *key = (fz_stext_cache_key *)key_;
+	hash->u.pir.ptr = key->doc;
+	hash->u.pir.i = key->number;
+	hash->u.pir.r.x0 = key->flags;
+	return 1;
+}
+
+static void *
+fz_keep_stext_cache_key(fz_context *ctx, void *key_)
+{
+	fz_stext_cache_key *key = (fz_stext_cache_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_stext_cache_key(fz_context *ctx, void *key_)
+{
+	fz_stext_cache_key *key = (fz_stext_cache_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+		fz_free(ctx, key);
+}
+
+static int
+fz_cmp_stext_cache_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_stext_cache_key *k0 = (fz_stext_cache_key *)k0_;
+	fz_stext_cache_key *k1 = (fz_stext_cache_key *)k1_;
+	return !(k0->doc == k1->doc && k0->number == k1->number && k0->flags == k1->flags);
+}
+
+static void
+fz_format_stext_cache_key(fz_context *ctx, char *s, int n, void *key_)
+{
+	fz_stext_cache_key *key = (fz_stext_cache_key *)key_;
+	fz_snprintf(s, n, "(stext page=%d flags=%x)", key->number, key->flags);
+}
+
+static const fz_store_type fz_stext_cache_store_type =
+{
+	fz_make_hash_stext_cache_key,
+	fz_keep_stext_cache_key,
+	fz_drop_stext_cache_key,
+	fz_cmp_stext_cache_key,
+	fz_format_stext_cache_key,
+	NULL
+};
+
+static void
+fz_drop_stext_cache_item_imp(fz_context *ctx, fz_storable *storable)
+{
+	fz_stext_cache_item *item = (fz_stext_cache_item *)storable;
+	fz_drop_stext_page(ctx, item->text);
+	fz_free(ctx, item);
+}
+
+/* Put text in the store under key. Returns the text to use: either
+ * text itself, or (having dropped text) one that got there first. */
+static fz_stext_page *
+store_stext_page(fz_context *ctx, fz_stext_cache_key *key, fz_stext_page *text)
+{
+	fz_stext_cache_key *keyp = NULL;
+	fz_stext_cache_item *item = NULL;
+	fz_stext_cache_item *existing;
+
+	/* Any failure here will just result in us not caching. */
+	fz_var(item);
+	fz_var(keyp);
+	fz_try(ctx)
+	{
+		item = fz_malloc_struct(ctx, fz_stext_cache_item);
+		FZ_INIT_STORABLE(item, 1, fz_drop_stext_cache_item_imp);
+		item->text = fz_keep_stext_page(ctx, text);
+
+		keyp = fz_malloc_struct(ctx, fz_stext_cache_key);
+		*keyp = *key;
+
+		existing = fz_store_item(ctx, keyp, item, sizeof(*item) + fz_stext_page_size(ctx, text), &fz_stext_cache_store_type);
+		if (existing)
+		{
+			/* We already have one. This must have been produced by a
+			 * racing thread. We'll throw away ours and use that one. */
+			fz_drop_stext_page(ctx, text);
+			text = fz_keep_stext_page(ctx, existing->text);
+			fz_drop_storable(ctx, &existing->storable);
+		}
+	}
+	fz_always(ctx)
+	{
+		if (item)
+			fz_drop_storable(ctx, &item->storable);
+		if (keyp)
+			fz_drop_stext_cache_key(ctx, keyp);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+
+	return text;
+}
+
+fz_stext_page *
+fz_load_stext_page(fz_context *ctx, fz_document *doc, int number, const fz_stext_options *options)
+{
+	fz_stext_cache_key key;
+	fz_stext_cache_item *item;
+	fz_display_list *list;
+	fz_stext_page *text;
+
+	key.refs = 1;
+	key.doc = doc;
+	key.number = number;
+	key.flags = options ? options->flags : 0;
+
+	item = fz_find_item(ctx, fz_drop_stext_cache_item_imp, &key, &fz_stext_cache_store_type);
+	if (item)
+	{
+		text = fz_keep_stext_page(ctx, item->text);
+		fz_drop_storable(ctx, &item->storable);
+		return text;
+	}
+
+	/* Replaying a display list we already have is much cheaper than
+	 * interpreting the page again. */
+	list = fz_find_cached_display_list(ctx, doc, number);
+	if (list)
+	{
+		fz_try(ctx)
+			text = fz_new_stext_page_from_display_list(ctx, list, options);
+		fz_always(ctx)
+			fz_drop_display_list(ctx, list);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+	else
+		text = fz_new_stext_page_from_page_number(ctx, doc, number, options);
+
+	return store_stext_page(ctx, &key, text);
+}
+
+void
+fz_cache_stext_page(fz_context *ctx, fz_document *doc, int number, const fz_stext_options *options, fz_stext_page *text)
+{
+	fz_stext_cache_key key;
+
+	key.refs = 1;
+	key.doc = doc;
+	key.number = number;
+	key.flags = options ? options->flags : 0;
+
+	fz_drop_stext_page(ctx, store_stext_page(ctx, &key, fz_keep_stext_page(ctx, text)));
+}
+
+static int
+fz_filter_stext_cache(fz_context *ctx, void *doc, void *key_)
+{
+	fz_stext_cache_key *key = (fz_stext_cache_key *)key_;
+	return key->doc == doc;
+}
+
+void
+fz_empty_stext_cache(fz_context *ctx, fz_document *doc)
+{
+	fz_filter_store(ctx, fz_filter_stext_cache, doc, &fz_stext_cache_store_type);
+}
@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/ucdn.h"
+#include "fitz-imp.h"
 
 #include <math.h>
 #include <float.h>
@@ -24,6 +25,13 @@ struct fz_stext_device_s
 	int curdir;
 	int lastchar;
 	int flags;
+
+	/* Motion direction and size for the last matrix seen; the characters
+	 * of a span all share one, so they are only worked out once. */
+	float dir_a, dir_b, dir_c, dir_d;
+	int dir_wmode;
+	fz_point dir, ndir;
+	float size;
 };
 
 const char *fz_stext_options_usage =
@@ -41,6 +49,7 @@ fz_new_stext_page(fz_context *ctx, const fz_rect *mediabox)
 	fz_try(ctx)
 	{
 		page = fz_pool_alloc(ctx, pool, sizeof(*page));
+		page->refs = 1;
 		page->pool = pool;
 		page->mediabox = *mediabox;
 		page->first_block = NULL;
@@ -54,10 +63,16 @@ fz_new_stext_page(fz_context *ctx, const fz_rect *mediabox)
 	return page;
 }
 
+fz_stext_page *
+fz_keep_stext_page(fz_context *ctx, fz_stext_page *page)
+{
+	return fz_keep_imp(ctx, page, &page->refs);
+}
+
 void
 fz_drop_stext_page(fz_context *ctx, fz_stext_page *page)
 {
-	if (page)
+	if (fz_drop_imp(ctx, page, &page->refs))
 	{
 		fz_stext_block *block;
 		for (block = page->first_block; block; block = block->next)
@@ -67,6 +82,12 @@ fz_drop_stext_page(fz_context *ctx, fz_stext_page *page)
 	}
 }
 
+size_t
+fz_stext_page_size(fz_context *ctx, fz_stext_page *page)
+{
+	return page ? fz_pool_size(ctx, page->pool) : 0;
+}
+
 static fz_stext_block *
 add_block_to_page(fz_context *ctx, fz_stext_page *page)
 {
@@ -238,21 +259,33 @@ fz_add_stext_char_imp(fz_context *ctx, fz_stext_device *dev, fz_font *font, int
 	dev->curdir = direction_from_bidi_class(ucdn_get_bidi_class(c), dev->curdir);
 
 	/* dir = direction vector for motion. ndir = normalised(dir) */
-	if (wmode == 0)
-	{
-		dir.x = 1;
-		dir.y = 0;
-	}
-	else
+	if (wmode != dev->dir_wmode || trm->a != dev->dir_a || trm->b != dev->dir_b || trm->c != dev->dir_c || trm->d != dev->dir_d)
 	{
-		dir.x = 0;
-		dir.y = -1;
-	}
-	fz_transform_vector(&dir, trm);
-	ndir = dir;
-	fz_normalize_vector(&ndir);
+		if (wmode == 0)
+		{
+			dev->dir.x = 1;
+			dev->dir.y = 0;
+		}
+		else
+		{
+			dev->dir.x = 0;
+			dev->dir.y = -1;
+		}
+		fz_transform_vector(&dev->dir, trm);
+		dev->ndir = dev->dir;
+		fz_normalize_vector(&dev->ndir);
 
-	size = fz_matrix_expansion(trm);
+		dev->size = fz_matrix_expansion(trm);
+
+		dev->dir_a = trm->a;
+		dev->dir_b = trm->b;
+		dev->dir_c = trm->c;
+		dev->dir_d = trm->d;
+		dev->dir_wmode = wmode;
+	}
+	dir = dev->dir;
+	ndir = dev->ndir;
+	size = dev->size;
 
 	/* We need to identify where glyphs 'start' (p) and 'stop' (q).
 	 * Each glyph holds its 'start' position, and the next glyph in the
@@ -700,6 +733,8 @@ fz_new_stext_device(fz_context *ctx, fz_stext_page *page, const fz_stext_options
 		dev->super.fill_image = fz_stext_fill_image;
 		dev->super.fill_image_mask = fz_stext_fill_image_mask;
 	}
+	else
+		dev->super.hints |= FZ_TEXT_ONLY;
 
 	dev->page = page;
 	dev->pen.x = 0;
@@ -707,6 +742,7 @@ fz_new_stext_device(fz_context *ctx, fz_stext_page *page, const fz_stext_options
 	dev->trm = fz_identity;
 	dev->lastchar = ' ';
 	dev->curdir = 1;
+	dev->dir_wmode = -1;
 
 	return (fz_device*)dev;
 }
@@ -0,0 +1,183 @@
+#include "mupdf/fitz.h"
+
+#include <string.h>
+#include <math.h>
+
+/*
+	A uniform grid over the bounds of the boxes. Each box is listed in
+	every cell it overlaps; the cell lists are packed one after the
+	other in 'entries', with cell i running from start[i] to start[i+1].
+*/
+
+#define MAX_GRID_SIDE 128
+
+struct fz_stext_grid_s
+{
+	int n;
+	fz_rect *boxes;
+	fz_rect bounds;
+	int w, h;
+	float cw, ch;
+	int *start;
+	int *entries;
+	int *stamp;
+	int query;
+};
+
+static void
+cell_range(fz_stext_grid *grid, const fz_rect *r, int *x0, int *y0, int *x1, int *y1)
+{
+	*x0 = fz_clampi((int)floorf((r->x0 - grid->bounds.x0) / grid->cw), 0, grid->w - 1);
+	*y0 = fz_clampi((int)floorf((r->y0 - grid->bounds.y0) / grid->ch), 0, grid->h - 1);
+	*x1 = fz_clampi((int)floorf((r->x1 - grid->bounds.x0) / grid->cw), 0, grid->w - 1);
+	*y1 = fz_clampi((int)floorf((r->y1 - grid->bounds.y0) / grid->ch), 0, grid->h - 1);
+}
+
+fz_stext_grid *
+fz_new_stext_grid(fz_context *ctx, const fz_rect *boxes, int n)
+{
+	fz_stext_grid *grid = fz_malloc_struct(ctx, fz_stext_grid);
+	int i, x, y, x0, y0, x1, y1, side, total;
+
+	fz_try(ctx)
+	{
+		grid->n = n;
+		grid->boxes = fz_malloc_array(ctx, fz_maxi(n, 1), sizeof(fz_rect));
+		grid->stamp = fz_calloc(ctx, fz_maxi(n, 1), sizeof(int));
+		memcpy(grid->boxes, boxes, n * sizeof(fz_rect));
+
+		grid->bounds = n > 0 ? boxes[0] : fz_empty_rect;
+		for (i = 1; i < n; ++i)
+			fz_union_rect(&grid->bounds, &boxes[i]);
+
+		/* Aim for around one box per cell. */
+		side = fz_clampi((int)sqrtf(n), 1, MAX_GRID_SIDE);
+		grid->w = grid->h = side;
+		grid->cw = fz_max((grid->bounds.x1 - grid->bounds.x0) / side, 1);
+		grid->ch = fz_max((grid->bounds.y1 - grid->bounds.y0) / side, 1);
+
+		grid->start = fz_calloc(ctx, side * side + 1, sizeof(int));
+
+		/* count, then turn counts into start offsets, then fill */
+		for (i = 0; i < n; ++i)
+		{
+			cell_range(grid, &boxes[i], &x0, &y0, &x1, &y1);
+			for (y = y0; y <= y1; ++y)
+				for (x = x0; x <= x1; ++x)
+					grid->start[y * side + x + 1]++;
+		}
+		for (i = 0; i < side * side; ++i)
+			grid->start[i + 1] += grid->start[i];
+		total = grid->start[side * side];
+
+		grid->entries = fz_malloc_array(ctx, fz_maxi(total, 1), sizeof(int));
+		for (i = 0; i < n; ++i)
+		{
+			cell_range(grid, &boxes[i], &x0, &y0, &x1, &y1);
+			for (y = y0; y <= y1; ++y)
+				for (x = x0; x <= x1; ++x)
+					grid->entries[grid->start[y * side + x]++] = i;
+		}
+
+		/* filling advanced every start to the next cell's, shift back */
+		for (i = side * side; i > 0; --i)
+			grid->start[i] = grid->start[i - 1];
+		grid->start[0] = 0;
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_stext_grid(ctx, grid);
+		fz_rethrow(ctx);
+	}
+
+	return grid;
+}
+
+void
+fz_drop_stext_grid(fz_context *ctx, fz_stext_grid *grid)
+{
+	if (!grid)
+		return;
+	fz_free(ctx, grid->boxes);
+	fz_free(ctx, grid->stamp);
+	fz_free(ctx, grid->start);
+	fz_free(ctx, grid->entries);
+	fz_free(ctx, grid);
+}
+
+int
+fz_query_stext_grid(fz_context *ctx, fz_stext_grid *grid, const fz_rect *area, int *found, int max)
+{
+	int x, y, x0, y0, x1, y1, k, count = 0;
+
+	if (grid->n == 0 || area->x1 < area->x0 || area->y1 < area->y0)
+		return 0;
+
+	/* Boxes span several cells; the stamp stops us reporting them twice. */
+	grid->query++;
+
+	cell_range(grid, area, &x0, &y0, &x1, &y1);
+	for (y = y0; y <= y1; ++y)
+	{
+		for (x = x0; x <= x1; ++x)
+		{
+			int cell = y * grid->w + x;
+			for (k = grid->start[cell]; k < grid->start[cell + 1]; ++k)
+			{
+				int i = grid->entries[k];
+				fz_rect *r = &grid->boxes[i];
+				if (grid->stamp[i] == grid->query)
+					continue;
+				grid->stamp[i] = grid->query;
+				if (r->x1 < area->x0 || r->x0 > area->x1 || r->y1 < area->y0 || r->y0 > area->y1)
+					continue;
+				if (count < max)
+					found[count] = i;
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+int
+fz_nearest_stext_grid(fz_context *ctx, fz_stext_grid *grid, const fz_point *p, float radius)
+{
+	int x, y, x0, y0, x1, y1, k;
+	int best = -1;
+	double best_d = (double)radius * radius;
+	fz_rect area;
+
+	if (grid->n == 0)
+		return -1;
+
+	area.x0 = p->x - radius;
+	area.y0 = p->y - radius;
+	area.x1 = p->x + radius;
+	area.y1 = p->y + radius;
+
+	/* Every corner within radius is in a cell covered by the square around p. */
+	cell_range(grid, &area, &x0, &y0, &x1, &y1);
+	for (y = y0; y <= y1; ++y)
+	{
+		for (x = x0; x <= x1; ++x)
+		{
+			int cell = y * grid->w + x;
+			for (k = grid->start[cell]; k < grid->start[cell + 1]; ++k)
+			{
+				int i = grid->entries[k];
+				double dx = grid->boxes[i].x0 - p->x;
+				double dy = grid->boxes[i].y0 - p->y;
+				double d = dx * dx + dy * dy;
+				if (d < best_d || (d == best_d && best >= 0 && i < best))
+				{
+					best_d = d;
+					best = i;
+				}
+			}
+		}
+	}
+
+	return best;
+}
@@ -466,33 +466,39 @@ text_begin_page(fz_context *ctx, fz_document_writer *wri_, const fz_rect *mediab
 }
 
 static void
-text_end_page(fz_context *ctx, fz_document_writer *wri_, fz_device *dev)
+text_print_page(fz_context *ctx, fz_text_writer *wri, fz_stext_page *page)
 {
-	fz_text_writer *wri = (fz_text_writer*)wri_;
-
-	fz_try(ctx)
-		fz_close_device(ctx, dev);
-	fz_always(ctx)
-		fz_drop_device(ctx, dev);
-	fz_catch(ctx)
-		fz_rethrow(ctx);
-
 	switch (wri->format)
 	{
 	default:
 	case FZ_FORMAT_TEXT:
-		fz_print_stext_page_as_text(ctx, wri->out, wri->page);
+		fz_print_stext_page_as_text(ctx, wri->out, page);
 		break;
 	case FZ_FORMAT_HTML:
-		fz_print_stext_page_as_html(ctx, wri->out, wri->page);
+		fz_print_stext_page_as_html(ctx, wri->out, page);
 		break;
 	case FZ_FORMAT_XHTML:
-		fz_print_stext_page_as_xhtml(ctx, wri->out, wri->page);
+		fz_print_stext_page_as_xhtml(ctx, wri->out, page);
 		break;
 	case FZ_FORMAT_STEXT:
-		fz_print_stext_page_as_xml(ctx, wri->out, wri->page);
+		fz_print_stext_page_as_xml(ctx, wri->out, page);
 		break;
 	}
+}
+
+static void
+text_end_page(fz_context *ctx, fz_document_writer *wri_, fz_device *dev)
+{
+	fz_text_writer *wri = (fz_text_writer*)wri_;
+
+	fz_try(ctx)
+		fz_close_device(ctx, dev);
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	text_print_page(ctx, wri, wri->page);
 
 	fz_drop_stext_page(ctx, wri->page);
 	wri->page = NULL;
@@ -525,6 +531,23 @@ text_drop_writer(fz_context *ctx, fz_document_writer *wri_)
 	fz_drop_output(ctx, wri->out);
 }
 
+int
+fz_is_text_writer(fz_context *ctx, fz_document_writer *wri)
+{
+	return wri && wri->begin_page == text_begin_page;
+}
+
+void
+fz_write_stext_page(fz_context *ctx, fz_document_writer *wri_, fz_stext_page *page)
+{
+	fz_text_writer *wri = (fz_text_writer*)wri_;
+
+	if (!fz_is_text_writer(ctx, wri_))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write text pages to this document writer");
+
+	text_print_page(ctx, wri, page);
+}
+
 fz_document_writer *
 fz_new_text_writer(fz_context *ctx, const char *format, const char *path, const char *args)
 {
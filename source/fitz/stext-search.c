@@ -1,5 +1,7 @@
 #include "mupdf/fitz.h"
+#include "fitz-imp.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
@@ -303,26 +305,27 @@ struct highlight
 	float hfuzz, vfuzz;
 };
 
-static void on_highlight_char(fz_context *ctx, void *arg, fz_stext_line *line, fz_stext_char *ch)
+/* Add a character's box to the highlight, merging it with the last
+ * box when they're next to each other on the same line. */
+static void highlight_char_box(struct highlight *hits, const fz_rect *line_bbox, int horizontal, const fz_rect *ch_bbox, float size)
 {
-	struct highlight *hits = arg;
-	float vfuzz = ch->size * hits->vfuzz;
-	float hfuzz = ch->size * hits->hfuzz;
+	float vfuzz = size * hits->vfuzz;
+	float hfuzz = size * hits->hfuzz;
 	fz_rect bbox;
 
-	if (line->dir.x > line->dir.y)
+	if (horizontal)
 	{
-		bbox.x0 = ch->bbox.x0;
-		bbox.x1 = ch->bbox.x1;
-		bbox.y0 = line->bbox.y0;
-		bbox.y1 = line->bbox.y1;
+		bbox.x0 = ch_bbox->x0;
+		bbox.x1 = ch_bbox->x1;
+		bbox.y0 = line_bbox->y0;
+		bbox.y1 = line_bbox->y1;
 	}
 	else
 	{
-		bbox.x0 = line->bbox.x0;
-		bbox.x1 = line->bbox.x1;
-		bbox.y0 = ch->bbox.y0;
-		bbox.y1 = ch->bbox.y1;
+		bbox.x0 = line_bbox->x0;
+		bbox.x1 = line_bbox->x1;
+		bbox.y0 = ch_bbox->y0;
+		bbox.y1 = ch_bbox->y1;
 	}
 
 	if (hits->len > 0)
@@ -384,6 +387,11 @@ static void on_highlight_char(fz_context *ctx, void *arg, fz_stext_line *line, f
 		hits->box[hits->len++] = bbox;
 }
 
+static void on_highlight_char(fz_context *ctx, void *arg, fz_stext_line *line, fz_stext_char *ch)
+{
+	highlight_char_box(arg, &line->bbox, line->dir.x > line->dir.y, &ch->bbox, ch->size);
+}
+
 static void on_highlight_line(fz_context *ctx, void *arg, fz_stext_line *line)
 {
 }
@@ -454,62 +462,175 @@ fz_copy_selection(fz_context *ctx, fz_stext_page *page, fz_point a, fz_point b,
 	return (char*)s;
 }
 
-/* String search */
+/* String search
+ *
+ * The page text is folded with fz_search_canon once, up front: one rune
+ * for each character, and a space after every line and every block.
+ * The needle is folded the same way with its runs of spaces collapsed,
+ * so matching is a plain byte comparison in which a space in the needle
+ * matches a run of spaces in the text.
+ */
+
+#define SEARCH_SKIP_MIN 4
+
+typedef struct search_needle_s search_needle;
+
+struct search_needle_s
+{
+	char *s;
+	int len;
+	int head; /* bytes before the first space */
+	int skip[256]; /* Horspool shifts for the head */
+};
+
+/* Bytes the folded character c takes in the haystack. */
+static inline int search_rune_len(int c)
+{
+	c = fz_search_canon(c);
+	if (c >= 0 && c < 0x80)
+		return 1;
+	return fz_runelen(c);
+}
+
+static inline int put_search_rune(char *h, int c)
+{
+	c = fz_search_canon(c);
+	if (c >= 0 && c < 0x80)
+	{
+		*h = c;
+		return 1;
+	}
+	return fz_runetochar(h, c);
+}
 
-static inline int canon(int c)
+static inline int next_search_rune(const char *s)
 {
-	/* TODO: proper unicode case folding */
-	/* TODO: character equivalence (a matches ä, etc) */
-	if (c == 0xA0 || c == 0x2028 || c == 0x2029)
-		return ' ';
-	if (c == '\r' || c == '\n' || c == '\t')
-		return ' ';
-	if (c >= 'A' && c <= 'Z')
-		return c - 'A' + 'a';
-	return c;
+	int c;
+	if (*s & 0x80)
+		return fz_chartorune(&c, s);
+	return 1;
 }
 
-static inline int chartocanon(int *c, const char *s)
+static char *new_search_haystack(fz_context *ctx, fz_stext_page *page)
 {
-	int n = fz_chartorune(c, s);
-	*c = canon(*c);
-	return n;
+	fz_stext_block *block;
+	fz_stext_line *line;
+	fz_stext_char *ch;
+	size_t len = 0;
+	char *text, *h;
+
+	for (block = page->first_block; block; block = block->next)
+	{
+		if (block->type != FZ_STEXT_BLOCK_TEXT)
+			continue;
+		for (line = block->u.t.first_line; line; line = line->next)
+		{
+			for (ch = line->first_char; ch; ch = ch->next)
+				len += search_rune_len(ch->c);
+			++len;
+		}
+		++len;
+	}
+
+	h = text = fz_malloc(ctx, len + 1);
+	for (block = page->first_block; block; block = block->next)
+	{
+		if (block->type != FZ_STEXT_BLOCK_TEXT)
+			continue;
+		for (line = block->u.t.first_line; line; line = line->next)
+		{
+			for (ch = line->first_char; ch; ch = ch->next)
+				h += put_search_rune(h, ch->c);
+			*h++ = ' ';
+		}
+		*h++ = ' ';
+	}
+	*h = 0;
+
+	return text;
+}
+
+static void init_needle(fz_context *ctx, search_needle *nd, const char *needle)
+{
+	char *p;
+	int c, i;
+
+	/* an undecodable byte becomes the three byte error rune */
+	p = nd->s = fz_malloc(ctx, strlen(needle) * 3 + 1);
+	while (*needle)
+	{
+		needle += fz_chartorune(&c, needle);
+		c = fz_search_canon(c);
+		if (c == ' ' && p > nd->s && p[-1] == ' ')
+			continue;
+		p += fz_runetochar(p, c);
+	}
+	*p = 0;
+	nd->len = p - nd->s;
+
+	for (i = 0; i < nd->len && nd->s[i] != ' '; i++)
+		;
+	nd->head = i;
+
+	if (nd->head >= SEARCH_SKIP_MIN)
+	{
+		for (i = 0; i < 256; i++)
+			nd->skip[i] = nd->head;
+		for (i = 0; i < nd->head - 1; i++)
+			nd->skip[(unsigned char)nd->s[i]] = nd->head - 1 - i;
+	}
+}
+
+static void drop_needle(fz_context *ctx, search_needle *nd)
+{
+	fz_free(ctx, nd->s);
 }
 
-static const char *match_string(const char *h, const char *n)
+/* Match the needle at h, returning the end of the match. */
+static const char *match_needle(const search_needle *nd, const char *h, const char *hend)
 {
-	int hc, nc;
+	const char *n = nd->s, *nend = nd->s + nd->len;
 	const char *e = h;
-	h += chartocanon(&hc, h);
-	n += chartocanon(&nc, n);
-	while (hc == nc)
+
+	while (n < nend)
 	{
-		e = h;
-		if (hc == ' ')
-			do
-				h += chartocanon(&hc, h);
-			while (hc == ' ');
-		else
-			h += chartocanon(&hc, h);
-		if (nc == ' ')
-			do
-				n += chartocanon(&nc, n);
-			while (nc == ' ');
-		else
-			n += chartocanon(&nc, n);
+		if (h == hend || *h != *n)
+			return NULL;
+		e = ++h;
+		if (*n++ == ' ')
+			while (h < hend && *h == ' ')
+				++h;
 	}
-	return nc == 0 ? e : NULL;
+	return e;
 }
 
-static const char *find_string(const char *s, const char *needle, const char **endp)
+/* Find the first match of the needle in s up to hend. Long heads are
+ * found with Horspool skips, the rest by scanning for the first byte. */
+static const char *find_needle(const search_needle *nd, const char *s, const char *hend, const char **endp)
 {
 	const char *end;
-	while (*s)
+
+	if (s < hend && nd->head >= SEARCH_SKIP_MIN)
 	{
-		end = match_string(s, needle);
-		if (end)
-			return *endp = end, s;
-		++s;
+		int m = nd->head;
+		unsigned char last = nd->s[m - 1];
+		while (hend - s >= m)
+		{
+			unsigned char c = s[m - 1];
+			if (c == last && !memcmp(s, nd->s, m - 1) && (end = match_needle(nd, s, hend)) != NULL)
+				return *endp = end, s;
+			s += nd->skip[c];
+		}
+	}
+	else if (s < hend)
+	{
+		while ((s = memchr(s, nd->s[0], hend - s)) != NULL)
+		{
+			if ((end = match_needle(nd, s, hend)) != NULL)
+				return *endp = end, s;
+			if (++s >= hend)
+				break;
+		}
 	}
 	return *endp = NULL, NULL;
 }
@@ -518,12 +639,13 @@ int
 fz_search_stext_page(fz_context *ctx, fz_stext_page *page, const char *needle, fz_rect *hit_bbox, int hit_max)
 {
 	struct highlight hits;
+	search_needle nd;
 	fz_stext_block *block;
 	fz_stext_line *line;
 	fz_stext_char *ch;
-	fz_buffer *buffer;
-	const char *haystack, *begin, *end;
-	int c, inside;
+	char *text = NULL;
+	const char *haystack, *hend, *begin, *end;
+	int inside;
 	int word_match = 0;
 	int nl = strlen(needle), nc;
 	char *np;
@@ -537,11 +659,16 @@ fz_search_stext_page(fz_context *ctx, fz_stext_page *page, const char *needle, f
 	hits.hfuzz = 0.1f;
 	hits.vfuzz = 0.1f;
 
-	buffer = fz_new_buffer_from_stext_page(ctx, page);
+	init_needle(ctx, &nd, needle);
+
+	fz_var(text);
+
 	fz_try(ctx)
 	{
-		haystack = fz_string_from_buffer(ctx, buffer);
-		begin = find_string(haystack, needle, &end);
+		text = new_search_haystack(ctx, page);
+		haystack = text;
+		hend = haystack + strlen(haystack);
+		begin = find_needle(&nd, haystack, hend, &end);
 		if (!begin)
 			goto no_more_matches;
 
@@ -589,32 +716,742 @@ fz_search_stext_page(fz_context *ctx, fz_stext_page *page, const char *needle, f
 							if (haystack < end) on_highlight_char(ctx, &hits, line, ch);
 							else {
 								inside = 0;
-								begin = find_string(haystack, needle, &end);
+								begin = find_needle(&nd, haystack, hend, &end);
 								if (!begin) goto no_more_matches;
 								else goto try_new_match;
 							}
 						}
-						haystack += fz_chartorune(&c, haystack);
+						haystack += next_search_rune(haystack);
 					} // for each char in the line
 				} // relaxed search
 
 				if (!(ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH)) {
-					assert(*haystack == '\n');
+					assert(*haystack == ' ');
 					++haystack;
 				}
 
 			} // for each line in the block
 			if (!(ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH)) {
-				assert(*haystack == '\n');
+				assert(*haystack == ' ');
 				++haystack;
 			}
 		} // for each block in the page
 no_more_matches:;
 	}
 	fz_always(ctx)
-		fz_drop_buffer(ctx, buffer);
+	{
+		fz_free(ctx, text);
+		drop_needle(ctx, &nd);
+	}
 	fz_catch(ctx)
 		fz_rethrow(ctx);
 
 	return hits.len;
 }
+
+/* Compact text */
+
+#define COMPACT_QMAX 65535
+#define COMPACT_SIZE_SCALE 32
+
+typedef struct fz_compact_stext_line_s fz_compact_stext_line;
+
+struct fz_compact_stext_line_s
+{
+	int first; /* first character of the line */
+	uint16_t bbox[4];
+	int horizontal;
+};
+
+struct fz_compact_stext_s
+{
+	int refs;
+
+	/* Boxes are quantized within bounds, in steps of sx by sy. */
+	fz_rect bounds;
+	float sx, sy;
+
+	int char_count, line_count, block_count;
+	int *runes;
+	uint16_t *boxes; /* x0, y0, x1, y1 for each character */
+	uint16_t *sizes; /* in 1/COMPACT_SIZE_SCALE units */
+	fz_compact_stext_line *lines; /* line_count + 1, the last marks the end */
+	int *blocks; /* first line of each block, block_count + 1 */
+
+	/* The page text as fz_search_stext_page sees it, already folded:
+	 * one rune for each character, and a space after every line and
+	 * every block where it puts a newline. */
+	char *haystack;
+	int haystack_len;
+};
+
+static void
+quantize_rect(fz_compact_stext *text, const fz_rect *r, uint16_t *q)
+{
+	/* round outwards, so the boxes never shrink */
+	q[0] = (uint16_t)fz_clamp(floorf((r->x0 - text->bounds.x0) / text->sx), 0, COMPACT_QMAX);
+	q[1] = (uint16_t)fz_clamp(floorf((r->y0 - text->bounds.y0) / text->sy), 0, COMPACT_QMAX);
+	q[2] = (uint16_t)fz_clamp(ceilf((r->x1 - text->bounds.x0) / text->sx), 0, COMPACT_QMAX);
+	q[3] = (uint16_t)fz_clamp(ceilf((r->y1 - text->bounds.y0) / text->sy), 0, COMPACT_QMAX);
+}
+
+static void
+unquantize_rect(fz_compact_stext *text, const uint16_t *q, fz_rect *r)
+{
+	r->x0 = text->bounds.x0 + q[0] * text->sx;
+	r->y0 = text->bounds.y0 + q[1] * text->sy;
+	r->x1 = text->bounds.x0 + q[2] * text->sx;
+	r->y1 = text->bounds.y0 + q[3] * text->sy;
+}
+
+fz_compact_stext *
+fz_new_compact_stext(fz_context *ctx, fz_stext_page *page)
+{
+	fz_compact_stext *text;
+	fz_stext_block *block;
+	fz_stext_line *line;
+	fz_stext_char *ch;
+	int nc = 0, nl = 0, nb = 0, len = 0;
+	char *h;
+
+	/* Size everything up first, so the arrays are allocated once. */
+	text = fz_malloc_struct(ctx, fz_compact_stext);
+	text->refs = 1;
+	text->bounds = fz_empty_rect;
+	for (block = page->first_block; block; block = block->next)
+	{
+		if (block->type != FZ_STEXT_BLOCK_TEXT)
+			continue;
+		for (line = block->u.t.first_line; line; line = line->next)
+		{
+			for (ch = line->first_char; ch; ch = ch->next)
+			{
+				fz_union_rect(&text->bounds, &ch->bbox);
+				len += search_rune_len(ch->c);
+				nc++;
+			}
+			fz_union_rect(&text->bounds, &line->bbox);
+			nl++;
+		}
+		nb++;
+	}
+	len += nl + nb;
+
+	if (fz_is_empty_rect(&text->bounds))
+		text->bounds = fz_unit_rect;
+	text->sx = (text->bounds.x1 - text->bounds.x0) / COMPACT_QMAX;
+	text->sy = (text->bounds.y1 - text->bounds.y0) / COMPACT_QMAX;
+	if (!(text->sx > 0))
+		text->sx = 1;
+	if (!(text->sy > 0))
+		text->sy = 1;
+
+	fz_try(ctx)
+	{
+		text->runes = fz_malloc_array(ctx, fz_maxi(nc, 1), sizeof(int));
+		text->boxes = fz_malloc_array(ctx, fz_maxi(nc, 1), 4 * sizeof(uint16_t));
+		text->sizes = fz_malloc_array(ctx, fz_maxi(nc, 1), sizeof(uint16_t));
+		text->lines = fz_malloc_array(ctx, nl + 1, sizeof(fz_compact_stext_line));
+		text->blocks = fz_malloc_array(ctx, nb + 1, sizeof(int));
+		text->haystack = fz_malloc(ctx, len + 1);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_compact_stext(ctx, text);
+		fz_rethrow(ctx);
+	}
+
+	h = text->haystack;
+	for (block = page->first_block; block; block = block->next)
+	{
+		if (block->type != FZ_STEXT_BLOCK_TEXT)
+			continue;
+		text->blocks[text->block_count++] = text->line_count;
+		for (line = block->u.t.first_line; line; line = line->next)
+		{
+			fz_compact_stext_line *cl = &text->lines[text->line_count++];
+			cl->first = text->char_count;
+			cl->horizontal = line->dir.x > line->dir.y;
+			quantize_rect(text, &line->bbox, cl->bbox);
+			for (ch = line->first_char; ch; ch = ch->next)
+			{
+				int i = text->char_count++;
+				text->runes[i] = ch->c;
+				quantize_rect(text, &ch->bbox, &text->boxes[4 * i]);
+				text->sizes[i] = (uint16_t)fz_clamp(ch->size * COMPACT_SIZE_SCALE + 0.5f, 0, COMPACT_QMAX);
+				h += put_search_rune(h, ch->c);
+			}
+			*h++ = ' ';
+		}
+		*h++ = ' ';
+	}
+	*h = 0;
+	text->haystack_len = len;
+	text->lines[text->line_count].first = text->char_count;
+	text->blocks[text->block_count] = text->line_count;
+
+	return text;
+}
+
+fz_compact_stext *
+fz_keep_compact_stext(fz_context *ctx, fz_compact_stext *text)
+{
+	return fz_keep_imp(ctx, text, &text->refs);
+}
+
+void
+fz_drop_compact_stext(fz_context *ctx, fz_compact_stext *text)
+{
+	if (fz_drop_imp(ctx, text, &text->refs))
+	{
+		fz_free(ctx, text->runes);
+		fz_free(ctx, text->boxes);
+		fz_free(ctx, text->sizes);
+		fz_free(ctx, text->lines);
+		fz_free(ctx, text->blocks);
+		fz_free(ctx, text->haystack);
+		fz_free(ctx, text);
+	}
+}
+
+size_t
+fz_compact_stext_size(fz_context *ctx, fz_compact_stext *text)
+{
+	if (!text)
+		return 0;
+	return sizeof(*text)
+		+ (size_t)text->char_count * (sizeof(int) + 5 * sizeof(uint16_t))
+		+ (size_t)(text->line_count + 1) * sizeof(fz_compact_stext_line)
+		+ (size_t)(text->block_count + 1) * sizeof(int)
+		+ text->haystack_len + 1;
+}
+
+const char *
+fz_compact_stext_haystack(fz_context *ctx, fz_compact_stext *text, int *len)
+{
+	if (len)
+		*len = text->haystack_len;
+	return text->haystack;
+}
+
+static void
+highlight_compact_char(fz_compact_stext *text, struct highlight *hits, int l, int i)
+{
+	fz_rect line_bbox, ch_bbox;
+
+	unquantize_rect(text, text->lines[l].bbox, &line_bbox);
+	unquantize_rect(text, &text->boxes[4 * i], &ch_bbox);
+	highlight_char_box(hits, &line_bbox, text->lines[l].horizontal, &ch_bbox, (float)text->sizes[i] / COMPACT_SIZE_SCALE);
+}
+
+/* The FZ_CTX_FLAGS_STRICT_MATCH test of fz_search_stext_page: the line
+ * is as many characters long as needle is bytes, and each character
+ * starts with the matching byte. */
+static int
+compact_line_is_word(fz_compact_stext *text, int l, const char *needle, int nl)
+{
+	char buf[FZ_UTFMAX];
+	int i, first = text->lines[l].first, last = text->lines[l + 1].first;
+
+	if (last - first != nl)
+		return 0;
+	for (i = first; i < last; i++)
+	{
+		fz_runetochar(buf, text->runes[i]);
+		if (buf[0] != needle[i - first])
+			return 0;
+	}
+	return 1;
+}
+
+static int
+search_compact_stext(fz_context *ctx, fz_compact_stext *text, const search_needle *nd, const char *needle, struct highlight *hits)
+{
+	const char *haystack, *hend, *begin, *end;
+	int nl = strlen(needle);
+	int b, l, i, inside;
+
+	haystack = text->haystack;
+	hend = haystack + strlen(haystack);
+	begin = find_needle(nd, haystack, hend, &end);
+	if (!begin)
+		return 0;
+
+	if (ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH)
+	{
+		for (l = 0; l < text->line_count; l++)
+			if (compact_line_is_word(text, l, needle, nl))
+				for (i = text->lines[l].first; i < text->lines[l + 1].first; i++)
+					highlight_compact_char(text, hits, l, i);
+		return hits->len;
+	}
+
+	inside = 0;
+	for (b = 0; b < text->block_count; b++)
+	{
+		for (l = text->blocks[b]; l < text->blocks[b + 1]; l++)
+		{
+			for (i = text->lines[l].first; i < text->lines[l + 1].first; i++)
+			{
+				if (!inside && haystack >= begin)
+					inside = 1;
+				while (inside && haystack >= end)
+				{
+					inside = 0;
+					begin = find_needle(nd, haystack, hend, &end);
+					if (!begin)
+						return hits->len;
+					if (haystack >= begin)
+						inside = 1;
+				}
+				if (inside)
+					highlight_compact_char(text, hits, l, i);
+				haystack += next_search_rune(haystack);
+			}
+			++haystack; /* end of line */
+		}
+		++haystack; /* end of block */
+	}
+
+	return hits->len;
+}
+
+int
+fz_search_compact_stext(fz_context *ctx, fz_compact_stext *text, const char *needle, fz_rect *hit_bbox, int hit_max)
+{
+	struct highlight hits;
+	search_needle nd;
+	int count;
+
+	if (strlen(needle) == 0)
+		return 0;
+
+	hits.len = 0;
+	hits.cap = hit_max;
+	hits.box = hit_bbox;
+	hits.hfuzz = 0.1f;
+	hits.vfuzz = 0.1f;
+
+	init_needle(ctx, &nd, needle);
+	count = search_compact_stext(ctx, text, &nd, needle, &hits);
+	drop_needle(ctx, &nd);
+
+	return count;
+}
+
+/* Searching for several needles at once
+ *
+ * The needles are compiled into an Aho-Corasick automaton over the part
+ * of each folded needle that has to match byte for byte: up to and
+ * including its first space, after which a run of spaces in the text
+ * may stand for it. One pass over the page text finds where every
+ * needle could start, then each candidate is checked with match_needle
+ * and the hits picked out just as a search for that needle alone would.
+ */
+
+struct fz_stext_needles_s
+{
+	int count;
+	char **raw; /* as given, for strict matching */
+	int *raw_len;
+	search_needle *nd;
+	int *key_len; /* bytes of the automaton key for each needle */
+	int *next_same; /* next needle with the same key, or -1 */
+
+	/* The automaton. State 0 is the root; 0 also ends the child and
+	 * sibling lists, since the root is nobody's child. */
+	int state_count;
+	unsigned char *label;
+	int *child, *sibling;
+	int *fail;
+	int *dict; /* next state down the failure chain that ends a key */
+	int *match; /* first needle whose key ends at the state, or -1 */
+	int root[256];
+};
+
+static int
+find_child(const fz_stext_needles *set, int s, unsigned char c)
+{
+	int t;
+	for (t = set->child[s]; t; t = set->sibling[t])
+		if (set->label[t] == c)
+			return t;
+	return 0;
+}
+
+static int
+next_state(const fz_stext_needles *set, int s, unsigned char c)
+{
+	int t;
+	while (s)
+	{
+		if ((t = find_child(set, s, c)) != 0)
+			return t;
+		s = set->fail[s];
+	}
+	return set->root[c];
+}
+
+static void
+build_needle_automaton(fz_context *ctx, fz_stext_needles *set, int max_states)
+{
+	int *queue;
+	int i, j, s, t, head, tail;
+
+	set->label = fz_malloc(ctx, max_states);
+	set->child = fz_calloc(ctx, max_states, sizeof(int));
+	set->sibling = fz_calloc(ctx, max_states, sizeof(int));
+	set->fail = fz_calloc(ctx, max_states, sizeof(int));
+	set->dict = fz_calloc(ctx, max_states, sizeof(int));
+	set->match = fz_malloc_array(ctx, max_states, sizeof(int));
+	for (s = 0; s < max_states; s++)
+		set->match[s] = -1;
+	set->state_count = 1;
+
+	for (i = 0; i < set->count; i++)
+	{
+		const char *key = set->nd[i].s;
+		if (set->key_len[i] == 0)
+			continue;
+		for (s = 0, j = 0; j < set->key_len[i]; j++, s = t)
+		{
+			unsigned char c = key[j];
+			if ((t = find_child(set, s, c)) == 0)
+			{
+				t = set->state_count++;
+				set->label[t] = c;
+				set->sibling[t] = set->child[s];
+				set->child[s] = t;
+			}
+		}
+		set->next_same[i] = set->match[s];
+		set->match[s] = i;
+	}
+
+	memset(set->root, 0, sizeof(set->root));
+	for (t = set->child[0]; t; t = set->sibling[t])
+		set->root[set->label[t]] = t;
+
+	/* Breadth first, so the failure links point at states done already. */
+	queue = fz_malloc_array(ctx, set->state_count, sizeof(int));
+	head = tail = 0;
+	for (t = set->child[0]; t; t = set->sibling[t])
+		queue[tail++] = t;
+	while (head < tail)
+	{
+		s = queue[head++];
+		for (t = set->child[s]; t; t = set->sibling[t])
+		{
+			int f = next_state(set, set->fail[s], set->label[t]);
+			set->fail[t] = f;
+			set->dict[t] = set->match[f] >= 0 ? f : set->dict[f];
+			queue[tail++] = t;
+		}
+	}
+	fz_free(ctx, queue);
+}
+
+fz_stext_needles *
+fz_new_stext_needles(fz_context *ctx, int count, const char **needles)
+{
+	fz_stext_needles *set;
+	int i, max_states = 1;
+
+	set = fz_malloc_struct(ctx, fz_stext_needles);
+	fz_try(ctx)
+	{
+		set->raw = fz_calloc(ctx, fz_maxi(count, 1), sizeof(char *));
+		set->raw_len = fz_calloc(ctx, fz_maxi(count, 1), sizeof(int));
+		set->nd = fz_calloc(ctx, fz_maxi(count, 1), sizeof(search_needle));
+		set->key_len = fz_calloc(ctx, fz_maxi(count, 1), sizeof(int));
+		set->next_same = fz_calloc(ctx, fz_maxi(count, 1), sizeof(int));
+		set->count = count;
+		for (i = 0; i < count; i++)
+		{
+			search_needle *nd = &set->nd[i];
+			set->raw[i] = fz_strdup(ctx, needles[i]);
+			set->raw_len[i] = strlen(needles[i]);
+			init_needle(ctx, nd, needles[i]);
+			set->key_len[i] = nd->head < nd->len ? nd->head + 1 : nd->len;
+			set->next_same[i] = -1;
+			max_states += set->key_len[i];
+		}
+		build_needle_automaton(ctx, set, max_states);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_stext_needles(ctx, set);
+		fz_rethrow(ctx);
+	}
+
+	return set;
+}
+
+void
+fz_drop_stext_needles(fz_context *ctx, fz_stext_needles *set)
+{
+	int i;
+
+	if (!set)
+		return;
+	for (i = 0; i < set->count; i++)
+	{
+		fz_free(ctx, set->raw[i]);
+		drop_needle(ctx, &set->nd[i]);
+	}
+	fz_free(ctx, set->raw);
+	fz_free(ctx, set->raw_len);
+	fz_free(ctx, set->nd);
+	fz_free(ctx, set->key_len);
+	fz_free(ctx, set->next_same);
+	fz_free(ctx, set->label);
+	fz_free(ctx, set->child);
+	fz_free(ctx, set->sibling);
+	fz_free(ctx, set->fail);
+	fz_free(ctx, set->dict);
+	fz_free(ctx, set->match);
+	fz_free(ctx, set);
+}
+
+/* Where one needle could start, and where its search has got to. */
+struct needle_scan
+{
+	int *cand; /* offsets into the haystack, in order */
+	int len, cap, next;
+	const char *begin, *end;
+	int inside;
+	struct highlight hits;
+};
+
+struct needles_search
+{
+	fz_stext_needles *set;
+	const char *haystack, *hend;
+	struct needle_scan *scan;
+	int live; /* needles with matches still ahead */
+};
+
+static void
+add_candidate(fz_context *ctx, struct needle_scan *ns, int ofs)
+{
+	if (ns->len == ns->cap)
+	{
+		int cap = ns->cap ? ns->cap * 2 : 16;
+		ns->cand = fz_resize_array(ctx, ns->cand, cap, sizeof(int));
+		ns->cap = cap;
+	}
+	ns->cand[ns->len++] = ofs;
+}
+
+/* The first match of needle k starting at or after pos. */
+static const char *
+next_needle_match(struct needles_search *s, int k, const char *pos, const char **endp)
+{
+	struct needle_scan *ns = &s->scan[k];
+	const char *end;
+
+	while (ns->next < ns->len && s->haystack + ns->cand[ns->next] < pos)
+		ns->next++;
+	for (; ns->next < ns->len; ns->next++)
+	{
+		const char *start = s->haystack + ns->cand[ns->next];
+		if ((end = match_needle(&s->set->nd[k], start, s->hend)) != NULL)
+			return *endp = end, start;
+	}
+	return *endp = NULL, NULL;
+}
+
+static void
+begin_needles_search(fz_context *ctx, struct needles_search *s, fz_stext_needles *set, const char *haystack, fz_rect **hit_bbox, const int *hit_max)
+{
+	const char *p;
+	int state = 0, o, k;
+
+	s->set = set;
+	s->haystack = haystack;
+	s->hend = haystack + strlen(haystack);
+	s->scan = fz_calloc(ctx, fz_maxi(set->count, 1), sizeof(struct needle_scan));
+	s->live = 0;
+
+	for (p = haystack; p < s->hend; p++)
+	{
+		state = next_state(set, state, *p);
+		for (o = set->match[state] >= 0 ? state : set->dict[state]; o; o = set->dict[o])
+			for (k = set->match[o]; k >= 0; k = set->next_same[k])
+				add_candidate(ctx, &s->scan[k], (int)(p + 1 - haystack) - set->key_len[k]);
+	}
+
+	for (k = 0; k < set->count; k++)
+	{
+		struct needle_scan *ns = &s->scan[k];
+		ns->hits.len = 0;
+		ns->hits.cap = hit_max[k];
+		ns->hits.box = hit_bbox[k];
+		ns->hits.hfuzz = 0.1f;
+		ns->hits.vfuzz = 0.1f;
+		ns->begin = next_needle_match(s, k, haystack, &ns->end);
+		if (ns->begin)
+			s->live++;
+	}
+}
+
+static int
+end_needles_search(fz_context *ctx, struct needles_search *s, int *hit_count)
+{
+	int k, total = 0;
+
+	if (!s->scan)
+		return 0;
+	for (k = 0; k < s->set->count; k++)
+	{
+		if (hit_count)
+			hit_count[k] = s->scan[k].hits.len;
+		total += s->scan[k].hits.len;
+		fz_free(ctx, s->scan[k].cand);
+	}
+	fz_free(ctx, s->scan);
+	s->scan = NULL;
+	return total;
+}
+
+/* Whether the character at pos is part of a hit for needle k, as the
+ * relaxed loop of fz_search_stext_page decides it. */
+static int
+needle_covers(struct needles_search *s, int k, const char *pos)
+{
+	struct needle_scan *ns = &s->scan[k];
+
+	if (!ns->begin)
+		return 0;
+	if (!ns->inside && pos >= ns->begin)
+		ns->inside = 1;
+	while (ns->inside && pos >= ns->end)
+	{
+		ns->inside = 0;
+		ns->begin = next_needle_match(s, k, pos, &ns->end);
+		if (!ns->begin)
+		{
+			s->live--;
+			return 0;
+		}
+		if (pos >= ns->begin)
+			ns->inside = 1;
+	}
+	return ns->inside;
+}
+
+/* The FZ_CTX_FLAGS_STRICT_MATCH test of fz_search_stext_page. */
+static int
+stext_line_is_word(fz_stext_line *line, const char *needle, int nl)
+{
+	char buf[FZ_UTFMAX];
+	fz_stext_char *ch;
+	int n = 0;
+
+	for (ch = line->first_char; ch; ch = ch->next, n++)
+	{
+		if (n == nl)
+			return 0;
+		fz_runetochar(buf, ch->c);
+		if (buf[0] != needle[n])
+			return 0;
+	}
+	return n == nl;
+}
+
+int
+fz_search_stext_page_needles(fz_context *ctx, fz_stext_page *page, fz_stext_needles *set, fz_rect **hit_bbox, const int *hit_max, int *hit_count)
+{
+	struct needles_search s = { 0 };
+	fz_stext_block *block;
+	fz_stext_line *line;
+	fz_stext_char *ch;
+	const char *pos;
+	char *text;
+	int k, total = 0;
+
+	text = new_search_haystack(ctx, page);
+
+	fz_try(ctx)
+	{
+		begin_needles_search(ctx, &s, set, text, hit_bbox, hit_max);
+		pos = text;
+		for (block = page->first_block; block && s.live; block = block->next)
+		{
+			if (block->type != FZ_STEXT_BLOCK_TEXT)
+				continue;
+			for (line = block->u.t.first_line; line && s.live; line = line->next)
+			{
+				if (ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH)
+				{
+					for (k = 0; k < set->count; k++)
+						if (s.scan[k].begin && stext_line_is_word(line, set->raw[k], set->raw_len[k]))
+							for (ch = line->first_char; ch; ch = ch->next)
+								on_highlight_char(ctx, &s.scan[k].hits, line, ch);
+					continue;
+				}
+				for (ch = line->first_char; ch; ch = ch->next)
+				{
+					for (k = 0; k < set->count; k++)
+						if (needle_covers(&s, k, pos))
+							on_highlight_char(ctx, &s.scan[k].hits, line, ch);
+					pos += next_search_rune(pos);
+				}
+				++pos; /* end of line */
+			}
+			++pos; /* end of block */
+		}
+	}
+	fz_always(ctx)
+	{
+		total = end_needles_search(ctx, &s, hit_count);
+		fz_free(ctx, text);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return total;
+}
+
+int
+fz_search_compact_stext_needles(fz_context *ctx, fz_compact_stext *text, fz_stext_needles *set, fz_rect **hit_bbox, const int *hit_max, int *hit_count)
+{
+	struct needles_search s = { 0 };
+	const char *pos;
+	int b, l, i, k, total = 0;
+
+	fz_try(ctx)
+	{
+		begin_needles_search(ctx, &s, set, text->haystack, hit_bbox, hit_max);
+		pos = text->haystack;
+		for (b = 0; b < text->block_count && s.live; b++)
+		{
+			for (l = text->blocks[b]; l < text->blocks[b + 1] && s.live; l++)
+			{
+				if (ctx->flags & FZ_CTX_FLAGS_STRICT_MATCH)
+				{
+					for (k = 0; k < set->count; k++)
+						if (s.scan[k].begin && compact_line_is_word(text, l, set->raw[k], set->raw_len[k]))
+							for (i = text->lines[l].first; i < text->lines[l + 1].first; i++)
+								highlight_compact_char(text, &s.scan[k].hits, l, i);
+					continue;
+				}
+				for (i = text->lines[l].first; i < text->lines[l + 1].first; i++)
+				{
+					for (k = 0; k < set->count; k++)
+						if (needle_covers(&s, k, pos))
+							highlight_compact_char(text, &s.scan[k].hits, l, i);
+					pos += next_search_rune(pos);
+				}
+				++pos; /* end of line */
+			}
+			++pos; /* end of block */
+		}
+	}
+	fz_always(ctx)
+		total = end_needles_search(ctx, &s, hit_count);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return total;
+}
@@ -0,0 +1,771 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+#define getpid _getpid
+#define fdopen _fdopen
+#define close _close
+#else
+#include <unistd.h>
+#endif
+
+/*
+	Words are interned into an open addressed hash table (linear probe,
+	never deleted from). Each word heads a chain of postings threaded
+	through one shared array, so adding a page only ever appends.
+*/
+
+typedef struct fz_text_word_s fz_text_word;
+typedef struct fz_text_index_posting_s fz_text_index_posting;
+
+struct fz_text_word_s
+{
+	char *text; /* folded UTF-8, allocated from the index pool */
+	int len;
+	unsigned int hash;
+	int count;
+	int first, last; /* posting chain, -1 if empty */
+};
+
+struct fz_text_index_posting_s
+{
+	fz_text_posting p;
+	int next;
+};
+
+struct fz_text_index_s
+{
+	int refs;
+	int page_count;
+	int pages_indexed;
+	unsigned char *indexed;
+	fz_pool *pool;
+
+	int word_len, word_cap;
+	fz_text_word *words;
+
+	int post_len, post_cap;
+	fz_text_index_posting *postings;
+
+	int slot_count; /* always a power of two */
+	int *slots; /* word number + 1, or 0 for empty */
+
+	/* The page set for the last needle passed to fz_text_index_may_contain. */
+	char *memo_needle;
+	int memo_strict;
+	int memo_pages_indexed;
+	unsigned char *memo_pages;
+};
+
+static unsigned int
+hash_word(const char *s, int len)
+{
+	unsigned int h = 2166136261u;
+	while (len--)
+	{
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+fz_text_index *
+fz_new_text_index(fz_context *ctx, int page_count)
+{
+	fz_text_index *index = fz_malloc_struct(ctx, fz_text_index);
+	index->refs = 1;
+	index->page_count = page_count;
+	fz_try(ctx)
+	{
+		index->indexed = fz_calloc(ctx, fz_maxi(page_count, 1), 1);
+		index->memo_pages = fz_calloc(ctx, fz_maxi(page_count, 1), 1);
+		index->pool = fz_new_pool(ctx);
+		index->slot_count = 1024;
+		index->slots = fz_calloc(ctx, index->slot_count, sizeof(int));
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text_index(ctx, index);
+		fz_rethrow(ctx);
+	}
+	return index;
+}
+
+fz_text_index *
+fz_keep_text_index(fz_context *ctx, fz_text_index *index)
+{
+	return fz_keep_imp(ctx, index, &index->refs);
+}
+
+void
+fz_drop_text_index(fz_context *ctx, fz_text_index *index)
+{
+	if (fz_drop_imp(ctx, index, &index->refs))
+	{
+		fz_free(ctx, index->indexed);
+		fz_free(ctx, index->memo_pages);
+		fz_free(ctx, index->memo_needle);
+		fz_free(ctx, index->slots);
+		fz_free(ctx, index->words);
+		fz_free(ctx, index->postings);
+		fz_drop_pool(ctx, index->pool);
+		fz_free(ctx, index);
+	}
+}
+
+static int
+find_word(fz_text_index *index, const char *s, int len, unsigned int h)
+{
+	unsigned int mask = index->slot_count - 1;
+	unsigned int pos = h & mask;
+	int slot;
+
+	while ((slot = index->slots[pos]) != 0)
+	{
+		fz_text_word *word = &index->words[slot - 1];
+		if (word->hash == h && word->len == len && !memcmp(word->text, s, len))
+			return slot - 1;
+		pos = (pos + 1) & mask;
+	}
+	return -1;
+}
+
+static void
+grow_slots(fz_context *ctx, fz_text_index *index)
+{
+	int new_count = index->slot_count * 2;
+	unsigned int mask = new_count - 1;
+	int *slots = fz_calloc(ctx, new_count, sizeof(int));
+	int i;
+
+	for (i = 0; i < index->word_len; ++i)
+	{
+		unsigned int pos = index->words[i].hash & mask;
+		while (slots[pos])
+			pos = (pos + 1) & mask;
+		slots[pos] = i + 1;
+	}
+
+	fz_free(ctx, index->slots);
+	index->slots = slots;
+	index->slot_count = new_count;
+}
+
+static int
+intern_word(fz_context *ctx, fz_text_index *index, const char *s, int len)
+{
+	unsigned int h = hash_word(s, len);
+	unsigned int pos;
+	fz_text_word *word;
+	int n = find_word(index, s, len, h);
+
+	if (n >= 0)
+		return n;
+
+	if ((index->word_len + 1) * 2 > index->slot_count)
+		grow_slots(ctx, index);
+
+	if (index->word_len == index->word_cap)
+	{
+		int new_cap = index->word_cap ? index->word_cap * 2 : 1024;
+		index->words = fz_resize_array(ctx, index->words, new_cap, sizeof(*index->words));
+		index->word_cap = new_cap;
+	}
+
+	word = &index->words[index->word_len];
+	word->text = fz_pool_alloc(ctx, index->pool, len + 1);
+	memcpy(word->text, s, len);
+	word->text[len] = 0;
+	word->len = len;
+	word->hash = h;
+	word->count = 0;
+	word->first = word->last = -1;
+
+	pos = h & (index->slot_count - 1);
+	while (index->slots[pos])
+		pos = (pos + 1) & (index->slot_count - 1);
+	index->slots[pos] = index->word_len + 1;
+
+	return index->word_len++;
+}
+
+static void
+add_posting(fz_context *ctx, fz_text_index *index, const char *s, int len, int page, const fz_rect *bbox)
+{
+	int n = intern_word(ctx, index, s, len);
+	fz_text_word *word;
+	fz_text_index_posting *post;
+
+	if (index->post_len == index->post_cap)
+	{
+		int new_cap = index->post_cap ? index->post_cap * 2 : 4096;
+		index->postings = fz_resize_array(ctx, index->postings, new_cap, sizeof(*index->postings));
+		index->post_cap = new_cap;
+	}
+
+	post = &index->postings[index->post_len];
+	post->p.page = page;
+	post->p.bbox = *bbox;
+	post->next = -1;
+
+	word = &index->words[n];
+	if (word->last >= 0)
+		index->postings[word->last].next = index->post_len;
+	else
+		word->first = index->post_len;
+	word->last = index->post_len;
+	word->count++;
+
+	index->post_len++;
+}
+
+/* Fold a string into buf the way fz_search_canon folds the page text. */
+static char *
+fold_string(fz_context *ctx, const char *s, int *lenp)
+{
+	char *buf = fz_malloc(ctx, strlen(s) * FZ_UTFMAX + 1);
+	int len = 0;
+	int c;
+
+	while (*s)
+	{
+		s += fz_chartorune(&c, s);
+		len += fz_runetochar(buf + len, fz_search_canon(c));
+	}
+	buf[len] = 0;
+	*lenp = len;
+	return buf;
+}
+
+void
+fz_index_stext_page(fz_context *ctx, fz_text_index *index, int number, fz_stext_page *text)
+{
+	fz_stext_block *block;
+	fz_stext_line *line;
+	fz_stext_char *ch;
+	char *buf = NULL;
+	int len, cap = 0;
+	fz_rect bbox;
+
+	if (!index || number < 0 || number >= index->page_count || index->indexed[number])
+		return;
+
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		cap = 256;
+		buf = fz_malloc(ctx, cap);
+		for (block = text->first_block; block; block = block->next)
+		{
+			if (block->type != FZ_STEXT_BLOCK_TEXT)
+				continue;
+			for (line = block->u.t.first_line; line; line = line->next)
+			{
+				len = 0;
+				for (ch = line->first_char; ch; ch = ch->next)
+				{
+					int c = fz_search_canon(ch->c);
+					if (c == ' ')
+					{
+						if (len > 0)
+							add_posting(ctx, index, buf, len, number, &bbox);
+						len = 0;
+						continue;
+					}
+					if (len + FZ_UTFMAX > cap)
+					{
+						cap *= 2;
+						buf = fz_resize_array(ctx, buf, cap, 1);
+					}
+					if (len == 0)
+						bbox = ch->bbox;
+					else
+						fz_union_rect(&bbox, &ch->bbox);
+					len += fz_runetochar(buf + len, c);
+				}
+				if (len > 0)
+					add_posting(ctx, index, buf, len, number, &bbox);
+			}
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	index->indexed[number] = 1;
+	index->pages_indexed++;
+}
+
+int
+fz_text_index_has_page(fz_context *ctx, fz_text_index *index, int number)
+{
+	if (!index || number < 0 || number >= index->page_count)
+		return 0;
+	return index->indexed[number];
+}
+
+int
+fz_text_index_is_complete(fz_context *ctx, fz_text_index *index)
+{
+	return index && index->pages_indexed == index->page_count;
+}
+
+int
+fz_lookup_text_index(fz_context *ctx, fz_text_index *index, const char *s, fz_text_posting *postings, int max)
+{
+	char *folded;
+	int len, n, i, k;
+
+	folded = fold_string(ctx, s, &len);
+	n = find_word(index, folded, len, hash_word(folded, len));
+	fz_free(ctx, folded);
+	if (n < 0)
+		return 0;
+
+	if (postings)
+		for (i = index->words[n].first, k = 0; i >= 0 && k < max; i = index->postings[i].next, ++k)
+			postings[k] = index->postings[i].p;
+
+	return index->words[n].count;
+}
+
+enum { MATCH_EXACT, MATCH_PREFIX, MATCH_SUFFIX, MATCH_SUBSTRING };
+
+static int
+word_matches(fz_text_word *word, const char *s, int len, int how)
+{
+	switch (how)
+	{
+	default:
+	case MATCH_EXACT:
+		return word->len == len && !memcmp(word->text, s, len);
+	case MATCH_PREFIX:
+		return word->len >= len && !memcmp(word->text, s, len);
+	case MATCH_SUFFIX:
+		return word->len >= len && !memcmp(word->text + word->len - len, s, len);
+	case MATCH_SUBSTRING:
+		return word->len >= len && strstr(word->text, s) != NULL;
+	}
+}
+
+/* Mark the pages that have a word matching s in pages. */
+static void
+mark_term_pages(fz_text_index *index, const char *s, int len, int how, unsigned char *pages)
+{
+	int n, i;
+
+	if (how == MATCH_EXACT)
+	{
+		n = find_word(index, s, len, hash_word(s, len));
+		if (n >= 0)
+			for (i = index->words[n].first; i >= 0; i = index->postings[i].next)
+				pages[index->postings[i].p.page] = 1;
+		return;
+	}
+
+	for (n = 0; n < index->word_len; ++n)
+		if (word_matches(&index->words[n], s, len, how))
+			for (i = index->words[n].first; i >= 0; i = index->postings[i].next)
+				pages[index->postings[i].p.page] = 1;
+}
+
+/*
+	Work out which indexed pages can possibly hold a match for the
+	folded needle. A relaxed match has to find every inner word of the
+	needle as a whole word on the page, the first word as the tail of
+	a word, the last as the head of one, and a needle with no spaces
+	anywhere inside a word. A strict match compares whole lines, so all
+	of its words must be whole words on the page.
+*/
+static void
+find_candidates(fz_context *ctx, fz_text_index *index, const char *needle, int len, int strict, unsigned char *pages)
+{
+	unsigned char *term = NULL;
+	const char *s, *e, *end = needle + len;
+	int i, nterms = 0, first = 1;
+
+	/* count the words in the needle */
+	for (s = needle; s < end; s = e)
+	{
+		while (s < end && *s == ' ')
+			++s;
+		if (s == end)
+			break;
+		for (e = s; e < end && *e != ' '; ++e)
+			;
+		nterms++;
+	}
+
+	if (nterms == 0)
+	{
+		memset(pages, 1, index->page_count);
+		return;
+	}
+
+	memset(pages, 0, index->page_count);
+
+	fz_var(term);
+	fz_try(ctx)
+	{
+		term = fz_malloc(ctx, fz_maxi(index->page_count, 1));
+		i = 0;
+		for (s = needle; s < end; s = e)
+		{
+			int how;
+
+			while (s < end && *s == ' ')
+				++s;
+			if (s == end)
+				break;
+			for (e = s; e < end && *e != ' '; ++e)
+				;
+
+			if (strict)
+				how = MATCH_EXACT;
+			else if (nterms == 1)
+				how = MATCH_SUBSTRING;
+			else if (i == 0)
+				how = MATCH_SUFFIX;
+			else if (i == nterms - 1)
+				how = MATCH_PREFIX;
+			else
+				how = MATCH_EXACT;
+
+			if (first)
+			{
+				mark_term_pages(index, s, e - s, how, pages);
+				first = 0;
+			}
+			else
+			{
+				int k;
+				memset(term, 0, index->page_count);
+				mark_term_pages(index, s, e - s, how, term);
+				for (k = 0; k < index->page_count; ++k)
+					pages[k] &= term[k];
+			}
+			++i;
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, term);
+	fz_catch(ctx)
+	{
+		/* forget what we know rather than risk skipping a page */
+		memset(pages, 1, index->page_count);
+	}
+}
+
+int
+fz_text_index_may_contain(fz_context *ctx, fz_text_index *index, int number, const char *needle, int strict)
+{
+	char *folded;
+	const char *s;
+	int len;
+
+	if (!fz_text_index_has_page(ctx, index, number))
+		return 1;
+
+	/* Strict matching compares unfolded bytes; only trust the index for ASCII. */
+	if (strict)
+		for (s = needle; *s; ++s)
+			if (*s & 0x80)
+				return 1;
+
+	if (index->memo_needle && index->memo_strict == strict &&
+		index->memo_pages_indexed == index->pages_indexed)
+	{
+		folded = fold_string(ctx, needle, &len);
+		if (!strcmp(folded, index->memo_needle))
+		{
+			fz_free(ctx, folded);
+			return index->memo_pages[number];
+		}
+	}
+	else
+		folded = fold_string(ctx, needle, &len);
+
+	fz_free(ctx, index->memo_needle);
+	index->memo_needle = folded;
+	index->memo_strict = strict;
+	index->memo_pages_indexed = index->pages_indexed;
+	find_candidates(ctx, index, folded, len, strict, index->memo_pages);
+
+	return index->memo_pages[number];
+}
+
+void
+fz_text_index_candidates(fz_context *ctx, fz_text_index *index, const char *needle, int strict, unsigned char *pages)
+{
+	char *folded;
+	const char *s;
+	int len, n;
+
+	if (strict)
+	{
+		for (s = needle; *s; ++s)
+		{
+			if (*s & 0x80)
+			{
+				memset(pages, 1, index->page_count);
+				return;
+			}
+		}
+	}
+
+	folded = fold_string(ctx, needle, &len);
+	fz_try(ctx)
+		find_candidates(ctx, index, folded, len, strict, pages);
+	fz_always(ctx)
+		fz_free(ctx, folded);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	for (n = 0; n < index->page_count; ++n)
+		if (!index->indexed[n])
+			pages[n] = 1;
+}
+
+int
+fz_count_text_index_pages(fz_context *ctx, fz_text_index *index)
+{
+	return index ? index->pages_indexed : 0;
+}
+
+/*
+	On disk the index is a flat little-endian dump:
+
+		magic "FZTXIDX1", 16 byte fingerprint
+		page count, then one indexed flag byte per page
+		word count, then for each word:
+			length, folded UTF-8 bytes
+			posting count, then for each posting:
+				page, x0, y0, x1, y1 (floats as raw bits)
+*/
+
+static const char text_index_magic[8] = { 'F', 'Z', 'T', 'X', 'I', 'D', 'X', '1' };
+
+static void
+write_float(fz_context *ctx, fz_output *out, float f)
+{
+	union { float f; int i; } u;
+	u.f = f;
+	fz_write_int32_le(ctx, out, u.i);
+}
+
+static float
+read_float(fz_context *ctx, fz_stream *stm)
+{
+	union { float f; int i; } u;
+	u.i = fz_read_int32_le(ctx, stm);
+	return u.f;
+}
+
+/* Create a temporary file next to filename that did not exist before.
+ * O_EXCL refuses an existing name, symbolic links included, so nothing
+ * planted at the name can be written through. */
+static FILE *
+create_temp_file(fz_context *ctx, const char *filename, char **tmpname)
+{
+	static unsigned int serial = 0;
+	char *name;
+	FILE *file;
+	int attempt, fd;
+
+	for (attempt = 0; attempt < 100; attempt++)
+	{
+		name = fz_asprintf(ctx, "%s.%d.%u.tmp", filename, (int)getpid(), (unsigned int)(serial++ ^ (unsigned int)time(NULL)));
+#ifdef _WIN32
+		{
+			wchar_t *wname = fz_wchar_from_utf8(name);
+			fd = wname ? _wopen(wname, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE) : -1;
+			free(wname);
+		}
+#else
+		fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+#endif
+		if (fd >= 0)
+		{
+			file = fdopen(fd, "wb");
+			if (!file)
+			{
+				close(fd);
+				remove(name);
+				fz_free(ctx, name);
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open temporary file for '%s'", filename);
+			}
+			*tmpname = name;
+			return file;
+		}
+		fz_free(ctx, name);
+		if (errno != EEXIST)
+			break;
+	}
+
+	fz_throw(ctx, FZ_ERROR_GENERIC, "cannot create temporary file for '%s': %s", filename, strerror(errno));
+}
+
+void
+fz_save_text_index(fz_context *ctx, fz_text_index *index, const char *filename, const unsigned char fingerprint[16])
+{
+	fz_buffer *buf = NULL;
+	fz_output *out = NULL;
+	FILE *file = NULL;
+	char *tmpname = NULL;
+	unsigned char *data;
+	size_t len;
+	int n, i;
+
+	fz_var(buf);
+	fz_var(out);
+	fz_var(file);
+	fz_var(tmpname);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, 4096);
+		out = fz_new_output_with_buffer(ctx, buf);
+		fz_write_data(ctx, out, text_index_magic, sizeof text_index_magic);
+		fz_write_data(ctx, out, fingerprint, 16);
+		fz_write_int32_le(ctx, out, index->page_count);
+		fz_write_data(ctx, out, index->indexed, index->page_count);
+		fz_write_int32_le(ctx, out, index->word_len);
+		for (n = 0; n < index->word_len; ++n)
+		{
+			fz_text_word *word = &index->words[n];
+			fz_write_int32_le(ctx, out, word->len);
+			fz_write_data(ctx, out, word->text, word->len);
+			fz_write_int32_le(ctx, out, word->count);
+			for (i = word->first; i >= 0; i = index->postings[i].next)
+			{
+				fz_text_posting *p = &index->postings[i].p;
+				fz_write_int32_le(ctx, out, p->page);
+				write_float(ctx, out, p->bbox.x0);
+				write_float(ctx, out, p->bbox.y0);
+				write_float(ctx, out, p->bbox.x1);
+				write_float(ctx, out, p->bbox.y1);
+			}
+		}
+		fz_close_output(ctx, out);
+
+		/* Write to a new temporary file and rename, so a reader never sees half a file. */
+		file = create_temp_file(ctx, filename, &tmpname);
+		len = fz_buffer_storage(ctx, buf, &data);
+		if (fwrite(data, 1, len, file) != len || fclose(file) != 0)
+		{
+			file = NULL;
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write '%s'", tmpname);
+		}
+		file = NULL;
+
+		if (rename(tmpname, filename) < 0)
+		{
+			/* Windows will not rename over an existing file. */
+			remove(filename);
+			if (rename(tmpname, filename) < 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot rename '%s' to '%s'", tmpname, filename);
+		}
+		fz_free(ctx, tmpname);
+		tmpname = NULL;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_buffer(ctx, buf);
+		if (file)
+			fclose(file);
+		if (tmpname)
+			remove(tmpname);
+		fz_free(ctx, tmpname);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+fz_text_index *
+fz_load_text_index(fz_context *ctx, const char *filename, const unsigned char fingerprint[16], int page_count)
+{
+	fz_text_index *index = NULL;
+	fz_stream *stm = NULL;
+	unsigned char header[24];
+	char *buf = NULL;
+	int cap = 0;
+	int words, len, count, n, i;
+	fz_rect bbox;
+	int page;
+
+	fz_var(index);
+	fz_var(stm);
+	fz_var(buf);
+	fz_var(cap);
+
+	fz_try(ctx)
+	{
+		stm = fz_open_file(ctx, filename);
+
+		if (fz_read(ctx, stm, header, sizeof header) != sizeof header ||
+			memcmp(header, text_index_magic, 8))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "not a text index: '%s'", filename);
+		if (memcmp(header + 8, fingerprint, 16))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "text index is for a different document: '%s'", filename);
+		if (fz_read_int32_le(ctx, stm) != page_count)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "text index page count mismatch: '%s'", filename);
+
+		index = fz_new_text_index(ctx, page_count);
+		if (fz_read(ctx, stm, index->indexed, page_count) != (size_t)page_count)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of text index");
+		for (n = 0; n < page_count; ++n)
+			if (index->indexed[n])
+				index->pages_indexed++;
+
+		words = fz_read_int32_le(ctx, stm);
+		for (n = 0; n < words; ++n)
+		{
+			len = fz_read_int32_le(ctx, stm);
+			if (len <= 0 || len > (1 << 20))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt text index");
+			if (len > cap)
+			{
+				buf = fz_resize_array(ctx, buf, len, 1);
+				cap = len;
+			}
+			if (fz_read(ctx, stm, (unsigned char *)buf, len) != (size_t)len)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of text index");
+
+			count = fz_read_int32_le(ctx, stm);
+			for (i = 0; i < count; ++i)
+			{
+				page = fz_read_int32_le(ctx, stm);
+				bbox.x0 = read_float(ctx, stm);
+				bbox.y0 = read_float(ctx, stm);
+				bbox.x1 = read_float(ctx, stm);
+				bbox.y1 = read_float(ctx, stm);
+				if (page < 0 || page >= page_count || !index->indexed[page])
+					fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt text index");
+				add_posting(ctx, index, buf, len, page, &bbox);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text_index(ctx, index);
+		fz_rethrow(ctx);
+	}
+
+	return index;
+}
@@ -377,14 +377,14 @@ fz_search_page(fz_context *ctx, fz_page *page, const char *needle, fz_rect *hit_
 int
 fz_search_page_number(fz_context *ctx, fz_document *doc, int number, const char *needle, fz_rect *hit_bbox, int hit_max)
 {
-	fz_page *page;
+	fz_stext_page *text;
 	int count = 0;
 
-	page = fz_load_page(ctx, doc, number);
+	text = fz_load_stext_page(ctx, doc, number, NULL);
 	fz_try(ctx)
-		count = fz_search_page(ctx, page, needle, hit_bbox, hit_max);
+		count = fz_search_stext_page(ctx, text, needle, hit_bbox, hit_max);
 	fz_always(ctx)
-		fz_drop_page(ctx, page);
+		fz_drop_stext_page(ctx, text);
 	fz_catch(ctx)
 		fz_rethrow(ctx);
 	return count;
@@ -0,0 +1,297 @@
+#include "mupdf/helpers/mu-stext.h"
+#include "mupdf/helpers/mu-threads.h"
+
+typedef struct stext_job_s stext_job;
+typedef struct stext_worker_s stext_worker;
+
+/* State shared by all the workers of one mu_new_stext_pages call. */
+struct stext_job_s
+{
+	mu_mutex lock;
+	int threaded;
+	const fz_stext_options *options;
+	int annotations;
+	fz_cookie *cookie;
+	int start, next, end;
+	fz_stext_page **pages;
+};
+
+/* A worker's context and its copy of the document last as long as the
+ * pool; only the thread is started afresh for each call. */
+struct stext_worker_s
+{
+	mu_stext_pool *pool;
+	stext_job *job;
+	fz_context *ctx;
+	fz_document *doc;
+	int failed; /* the document could not be opened */
+	mu_thread thread;
+};
+
+struct mu_stext_pool_s
+{
+	char *filename;
+	char *password;
+	float layout_w, layout_h, layout_em;
+	int count; /* workers, not counting the calling thread */
+	stext_worker *workers;
+};
+
+static void
+lock_job(stext_job *job)
+{
+	if (job->threaded)
+		mu_lock_mutex(&job->lock);
+}
+
+static void
+unlock_job(stext_job *job)
+{
+	if (job->threaded)
+		mu_unlock_mutex(&job->lock);
+}
+
+/* Claim the next page to extract, or -1 when there are none left. */
+static int
+next_page(stext_job *job)
+{
+	int number = -1;
+
+	lock_job(job);
+	if (job->next < job->end && !(job->cookie && job->cookie->abort))
+		number = job->next++;
+	unlock_job(job);
+
+	return number;
+}
+
+static void
+finish_page(stext_job *job, int number, fz_stext_page *text)
+{
+	lock_job(job);
+	job->pages[number - job->start] = text;
+	if (job->cookie)
+		job->cookie->progress++;
+	unlock_job(job);
+}
+
+static fz_document *
+open_worker_document(fz_context *ctx, const mu_stext_pool *pool)
+{
+	fz_document *doc = NULL;
+
+	fz_var(doc);
+
+	fz_try(ctx)
+	{
+		doc = fz_open_document(ctx, pool->filename);
+		if (fz_needs_password(ctx, doc) && !fz_authenticate_password(ctx, doc, pool->password ? pool->password : ""))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate password");
+		fz_layout_document(ctx, doc, pool->layout_w, pool->layout_h, pool->layout_em);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_document(ctx, doc);
+		doc = NULL;
+	}
+
+	return doc;
+}
+
+/* Extract the text of a page as fz_new_stext_page_from_page_number
+ * does, or with annotations as the text writer sees it through
+ * fz_run_page. */
+static fz_stext_page *
+new_stext_page(fz_context *ctx, stext_job *job, fz_document *doc, int number)
+{
+	fz_page *page;
+	fz_device *dev = NULL;
+	fz_stext_page *text = NULL;
+	fz_rect mediabox;
+
+	if (!job->annotations)
+		return fz_new_stext_page_from_page_number(ctx, doc, number, job->options);
+
+	fz_var(dev);
+	fz_var(text);
+
+	page = fz_load_page(ctx, doc, number);
+	fz_try(ctx)
+	{
+		text = fz_new_stext_page(ctx, fz_bound_page(ctx, page, &mediabox));
+		dev = fz_new_stext_device(ctx, text, job->options);
+		fz_run_page(ctx, page, dev, &fz_identity, NULL);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_page(ctx, page);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_stext_page(ctx, text);
+		fz_rethrow(ctx);
+	}
+
+	return text;
+}
+
+/* Extract pages with doc until there are none left. Workers report
+ * nothing but the pages; a page that fails is left NULL. */
+static void
+extract_pages(fz_context *ctx, stext_job *job, fz_document *doc)
+{
+	fz_stext_page *text;
+	int number;
+
+	fz_var(text);
+
+	while ((number = next_page(job)) >= 0)
+	{
+		fz_try(ctx)
+			text = new_stext_page(ctx, job, doc, number);
+		fz_catch(ctx)
+			text = NULL;
+		finish_page(job, number, text);
+	}
+}
+
+static void
+stext_worker_run(void *arg)
+{
+	stext_worker *w = arg;
+
+	/* open the document the first time the worker is used, and keep it */
+	if (!w->doc && !w->failed)
+	{
+		w->doc = open_worker_document(w->ctx, w->pool);
+		w->failed = !w->doc;
+	}
+	if (w->doc)
+		extract_pages(w->ctx, w->job, w->doc);
+}
+
+mu_stext_pool *
+mu_new_stext_pool(fz_context *ctx, const mu_stext_source *src, int threads)
+{
+	mu_stext_pool *pool;
+	int i;
+
+	pool = fz_malloc_struct(ctx, mu_stext_pool);
+	fz_try(ctx)
+	{
+		/* without a file to open, everything runs in the calling thread */
+		if (!src || !src->filename)
+			threads = 1;
+		else
+		{
+			pool->filename = fz_strdup(ctx, src->filename);
+			pool->password = src->password ? fz_strdup(ctx, src->password) : NULL;
+			pool->layout_w = src->layout_w;
+			pool->layout_h = src->layout_h;
+			pool->layout_em = src->layout_em;
+		}
+
+		if (threads > 1)
+			pool->workers = fz_calloc(ctx, threads - 1, sizeof(*pool->workers));
+		for (i = 0; i < threads - 1; i++)
+		{
+			stext_worker *w = &pool->workers[pool->count];
+			w->pool = pool;
+			w->ctx = fz_clone_context(ctx);
+			if (!w->ctx)
+				break;
+			pool->count++;
+		}
+	}
+	fz_catch(ctx)
+	{
+		mu_drop_stext_pool(ctx, pool);
+		fz_rethrow(ctx);
+	}
+
+	return pool;
+}
+
+void
+mu_drop_stext_pool(fz_context *ctx, mu_stext_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+	for (i = 0; i < pool->count; i++)
+	{
+		fz_drop_document(pool->workers[i].ctx, pool->workers[i].doc);
+		fz_drop_context(pool->workers[i].ctx);
+	}
+	fz_free(ctx, pool->workers);
+	fz_free(ctx, pool->filename);
+	fz_free(ctx, pool->password);
+	fz_free(ctx, pool);
+}
+
+fz_stext_page **
+mu_new_stext_pages(fz_context *ctx, mu_stext_pool *pool, fz_document *doc, int start, int end, const fz_stext_options *options, int annotations, fz_cookie *cookie)
+{
+	stext_job job = { 0 };
+	int count = end - start;
+	int started = 0;
+	int threads, i;
+
+	if (count <= 0)
+		return NULL;
+
+	job.options = options;
+	job.annotations = annotations;
+	job.cookie = cookie;
+	job.start = job.next = start;
+	job.end = end;
+	job.pages = fz_calloc(ctx, count, sizeof(*job.pages));
+
+	if (cookie)
+	{
+		cookie->progress = 0;
+		cookie->progress_max = count;
+	}
+
+	threads = pool ? fz_mini(pool->count, count - 1) : 0;
+	if (threads > 0 && !mu_create_mutex(&job.lock))
+	{
+		job.threaded = 1;
+		for (i = 0; i < threads; i++)
+		{
+			stext_worker *w = &pool->workers[i];
+			w->job = &job;
+			if (mu_create_thread(&w->thread, stext_worker_run, w))
+				break;
+			started++;
+		}
+	}
+
+	/* The calling thread works through the same pages with doc. */
+	extract_pages(ctx, &job, doc);
+
+	for (i = 0; i < started; i++)
+	{
+		mu_destroy_thread(&pool->workers[i].thread);
+		pool->workers[i].job = NULL;
+	}
+	if (job.threaded)
+		mu_destroy_mutex(&job.lock);
+
+	return job.pages;
+}
+
+void
+mu_drop_stext_pages(fz_context *ctx, fz_stext_page **pages, int count)
+{
+	int i;
+
+	if (!pages)
+		return;
+	for (i = 0; i < count; i++)
+		fz_drop_stext_page(ctx, pages[i]);
+	fz_free(ctx, pages);
+}
@@ -69,6 +69,7 @@ struct pdf_run_processor_s
 {
 	pdf_processor super;
 	fz_device *dev;
+	int text_only;
 
 	fz_default_colorspaces *default_cs;
 
@@ -775,6 +776,14 @@ pdf_flush_text(fz_context *ctx, pdf_run_processor *pr)
 	if (pr->super.hidden)
 		dostroke = dofill = 0;
 
+	/* A text only device wants the glyphs, not how they are painted,
+	 * so skip the groups, patterns and shadings behind them. */
+	if (pr->text_only && (dofill || dostroke))
+	{
+		doinvisible = 1;
+		dostroke = dofill = 0;
+	}
+
 	fz_try(ctx)
 	{
 		fz_rect tb = pr->tos.text_bbox;
@@ -1233,7 +1242,7 @@ pdf_run_xobject(fz_context *ctx, pdf_run_processor *proc, pdf_obj *xobj, pdf_obj
 
 		pdf_xobject_bbox(ctx, xobj, &xobj_bbox);
 		pdf_xobject_matrix(ctx, xobj, &xobj_matrix);
-		transparency = pdf_xobject_transparency(ctx, xobj);
+		transparency = pr->text_only ? 0 : pdf_xobject_transparency(ctx, xobj);
 
 		/* apply xobject's transform matrix */
 		fz_concat(&local_transform, &xobj_matrix, &local_transform);
@@ -1279,13 +1288,16 @@ pdf_run_xobject(fz_context *ctx, pdf_run_processor *proc, pdf_obj *xobj, pdf_obj
 		pdf_gsave(ctx, pr); /* Save here so the clippath doesn't persist */
 
 		/* clip to the bounds */
-		fz_moveto(ctx, pr->path, xobj_bbox.x0, xobj_bbox.y0);
-		fz_lineto(ctx, pr->path, xobj_bbox.x1, xobj_bbox.y0);
-		fz_lineto(ctx, pr->path, xobj_bbox.x1, xobj_bbox.y1);
-		fz_lineto(ctx, pr->path, xobj_bbox.x0, xobj_bbox.y1);
-		fz_closepath(ctx, pr->path);
-		pr->clip = 1;
-		pdf_show_path(ctx, pr, 0, 0, 0, 0);
+		if (!pr->text_only)
+		{
+			fz_moveto(ctx, pr->path, xobj_bbox.x0, xobj_bbox.y0);
+			fz_lineto(ctx, pr->path, xobj_bbox.x1, xobj_bbox.y0);
+			fz_lineto(ctx, pr->path, xobj_bbox.x1, xobj_bbox.y1);
+			fz_lineto(ctx, pr->path, xobj_bbox.x0, xobj_bbox.y1);
+			fz_closepath(ctx, pr->path);
+			pr->clip = 1;
+			pdf_show_path(ctx, pr, 0, 0, 0, 0);
+		}
 
 		/* run contents */
 
@@ -2092,6 +2104,7 @@ pdf_processor *
 pdf_new_run_processor(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, const char *usage, pdf_gstate *gstate, int nested, fz_default_colorspaces *default_cs)
 {
 	pdf_run_processor *proc = pdf_new_processor(ctx, sizeof *proc);
+	int text_only = (dev->hints & FZ_TEXT_ONLY) != 0;
 	{
 		proc->super.usage = usage;
 
@@ -2112,37 +2125,42 @@ pdf_new_run_processor(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, con
 		proc->super.op_gs_BM = pdf_run_gs_BM;
 		proc->super.op_gs_CA = pdf_run_gs_CA;
 		proc->super.op_gs_ca = pdf_run_gs_ca;
-		proc->super.op_gs_SMask = pdf_run_gs_SMask;
+		if (!text_only)
+			proc->super.op_gs_SMask = pdf_run_gs_SMask;
 
 		/* special graphics state */
 		proc->super.op_q = pdf_run_q;
 		proc->super.op_Q = pdf_run_Q;
 		proc->super.op_cm = pdf_run_cm;
 
-		/* path construction */
-		proc->super.op_m = pdf_run_m;
-		proc->super.op_l = pdf_run_l;
-		proc->super.op_c = pdf_run_c;
-		proc->super.op_v = pdf_run_v;
-		proc->super.op_y = pdf_run_y;
-		proc->super.op_h = pdf_run_h;
-		proc->super.op_re = pdf_run_re;
-
-		/* path painting */
-		proc->super.op_S = pdf_run_S;
-		proc->super.op_s = pdf_run_s;
-		proc->super.op_F = pdf_run_F;
-		proc->super.op_f = pdf_run_f;
-		proc->super.op_fstar = pdf_run_fstar;
-		proc->super.op_B = pdf_run_B;
-		proc->super.op_Bstar = pdf_run_Bstar;
-		proc->super.op_b = pdf_run_b;
-		proc->super.op_bstar = pdf_run_bstar;
-		proc->super.op_n = pdf_run_n;
-
-		/* clipping paths */
-		proc->super.op_W = pdf_run_W;
-		proc->super.op_Wstar = pdf_run_Wstar;
+		/* A text only device has no use for paths, so don't build them */
+		if (!text_only)
+		{
+			/* path construction */
+			proc->super.op_m = pdf_run_m;
+			proc->super.op_l = pdf_run_l;
+			proc->super.op_c = pdf_run_c;
+			proc->super.op_v = pdf_run_v;
+			proc->super.op_y = pdf_run_y;
+			proc->super.op_h = pdf_run_h;
+			proc->super.op_re = pdf_run_re;
+
+			/* path painting */
+			proc->super.op_S = pdf_run_S;
+			proc->super.op_s = pdf_run_s;
+			proc->super.op_F = pdf_run_F;
+			proc->super.op_f = pdf_run_f;
+			proc->super.op_fstar = pdf_run_fstar;
+			proc->super.op_B = pdf_run_B;
+			proc->super.op_Bstar = pdf_run_Bstar;
+			proc->super.op_b = pdf_run_b;
+			proc->super.op_bstar = pdf_run_bstar;
+			proc->super.op_n = pdf_run_n;
+
+			/* clipping paths */
+			proc->super.op_W = pdf_run_W;
+			proc->super.op_Wstar = pdf_run_Wstar;
+		}
 
 		/* text objects */
 		proc->super.op_BT = pdf_run_BT;
@@ -2191,8 +2209,9 @@ pdf_new_run_processor(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, con
 		proc->super.op_k = pdf_run_k;
 
 		/* shadings, images, xobjects */
-		proc->super.op_sh = pdf_run_sh;
-		if (dev->fill_image || dev->fill_image_mask || dev->clip_image_mask)
+		if (!text_only)
+			proc->super.op_sh = pdf_run_sh;
+		if (!text_only && (dev->fill_image || dev->fill_image_mask || dev->clip_image_mask))
 		{
 			proc->super.op_BI = pdf_run_BI;
 			proc->super.op_Do_image = pdf_run_Do_image;
@@ -2220,6 +2239,7 @@ pdf_new_run_processor(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, con
 	}
 
 	proc->dev = dev;
+	proc->text_only = text_only;
 
 	proc->default_cs = fz_keep_default_colorspaces(ctx, default_cs);
 
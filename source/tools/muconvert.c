@@ -3,6 +3,8 @@
  */
 
 #include "mupdf/fitz.h"
+#include "mupdf/helpers/mu-threads.h"
+#include "mupdf/helpers/mu-stext.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -20,12 +22,66 @@ static int layout_use_doc_css = 1;
 static const char *output = NULL;
 static const char *format = NULL;
 static const char *options = "";
+static int num_workers = 0;
 
 static fz_context *ctx;
+static const char *filename;
 static fz_document *doc;
+static mu_stext_pool *text_pool;
 static fz_document_writer *out;
+static fz_stext_options stext_options;
 static int count;
 
+/*
+	Text formats can have their text extracted on several threads at
+	once; the threads share the context, so it needs locking.
+*/
+#ifndef DISABLE_MUTHREADS
+
+static mu_mutex mutexes[FZ_LOCK_MAX];
+
+static void muconvert_lock(void *user, int lock)
+{
+	mu_lock_mutex(&mutexes[lock]);
+}
+
+static void muconvert_unlock(void *user, int lock)
+{
+	mu_unlock_mutex(&mutexes[lock]);
+}
+
+static fz_locks_context muconvert_locks =
+{
+	NULL, muconvert_lock, muconvert_unlock
+};
+
+static void fin_muconvert_locks(void)
+{
+	int i;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		mu_destroy_mutex(&mutexes[i]);
+}
+
+static fz_locks_context *init_muconvert_locks(void)
+{
+	int i;
+	int failed = 0;
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		failed |= mu_create_mutex(&mutexes[i]);
+
+	if (failed)
+	{
+		fin_muconvert_locks();
+		return NULL;
+	}
+
+	return &muconvert_locks;
+}
+
+#endif
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -47,6 +103,11 @@ static void usage(void)
 		"\t\t\tvector: pdf, svg.\n"
 		"\t\t\ttext: html, xhtml, text, stext.\n"
 		"\t-O -\tcomma separated list of options for output format\n"
+#ifndef DISABLE_MUTHREADS
+		"\t-T -\tnumber of threads to use for text extraction (text formats only)\n"
+#else
+		"\t-T -\tnumber of threads to use for text extraction (disabled in this non-threading build)\n"
+#endif
 		"\n"
 		"\tpages\tcomma separated list of page ranges (N=last page)\n"
 		"\n"
@@ -89,13 +150,72 @@ static void runpage(int number)
 		fz_rethrow(ctx);
 }
 
+/* Pages of text extracted at once for each thread. */
+#define TEXT_RUN_PER_THREAD 4
+
+/* Write the text of pages from to to (1-based, either way round),
+ * extracting it a run of pages at a time on num_workers threads. Pages
+ * are run whole, annotations included, as runpage does, so the output
+ * is the same as with one thread. The workers keep their copies of the
+ * document open in text_pool until the next document. */
+static void runtext(int from, int to)
+{
+	mu_stext_source src;
+	fz_stext_page **text = NULL;
+	int run = num_workers * TEXT_RUN_PER_THREAD;
+	int dir = from <= to ? 1 : -1;
+	int first, last, lo, hi, i;
+
+	src.filename = filename;
+	src.password = password;
+	src.layout_w = layout_w;
+	src.layout_h = layout_h;
+	src.layout_em = layout_em;
+
+	if (!text_pool)
+		text_pool = mu_new_stext_pool(ctx, &src, num_workers);
+
+	fz_var(text);
+
+	for (first = from; (to - first) * dir >= 0; first = last + dir)
+	{
+		last = first + dir * (run - 1);
+		if ((last - to) * dir > 0)
+			last = to;
+		lo = fz_mini(first, last);
+		hi = fz_maxi(first, last);
+
+		fz_try(ctx)
+		{
+			text = mu_new_stext_pages(ctx, text_pool, doc, lo - 1, hi, &stext_options, 1, NULL);
+			for (i = first; (last - i) * dir >= 0; i += dir)
+			{
+				/* redo a page that failed as one thread would, for the same output and error */
+				if (!text[i - lo])
+					runpage(i);
+				else
+					fz_write_stext_page(ctx, out, text[i - lo]);
+			}
+		}
+		fz_always(ctx)
+		{
+			mu_drop_stext_pages(ctx, text, hi - lo + 1);
+			text = NULL;
+		}
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+}
+
 static void runrange(const char *range)
 {
 	int start, end, i;
 
 	while ((range = fz_parse_page_range(ctx, range, &start, &end, count)))
 	{
-		if (start < end)
+		if (num_workers > 1 && fz_is_text_writer(ctx, out))
+			runtext(start, end);
+		else if (start < end)
 			for (i = start; i <= end; ++i)
 				runpage(i);
 		else
@@ -106,9 +226,10 @@ static void runrange(const char *range)
 
 int muconvert_main(int argc, char **argv)
 {
+	fz_locks_context *locks = NULL;
 	int i, c;
 
-	while ((c = fz_getopt(argc, argv, "p:A:W:H:S:U:Xo:F:O:")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:A:W:H:S:U:Xo:F:O:T:")) != -1)
 	{
 		switch (c)
 		{
@@ -125,14 +246,34 @@ int muconvert_main(int argc, char **argv)
 		case 'o': output = fz_optarg; break;
 		case 'F': format = fz_optarg; break;
 		case 'O': options = fz_optarg; break;
+
+		case 'T':
+#ifndef DISABLE_MUTHREADS
+			num_workers = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
+#endif
 		}
 	}
 
 	if (fz_optind == argc || (!format && !output))
 		usage();
 
+#ifndef DISABLE_MUTHREADS
+	if (num_workers > 1)
+	{
+		locks = init_muconvert_locks();
+		if (locks == NULL)
+		{
+			fprintf(stderr, "mutex initialisation failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+#endif
+
 	/* Create a context to hold the exception stack and various caches. */
-	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	ctx = fz_new_context(NULL, locks, FZ_STORE_UNLIMITED);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot create mupdf context\n");
@@ -170,9 +311,13 @@ int muconvert_main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (fz_is_text_writer(ctx, out))
+		fz_parse_stext_options(ctx, &stext_options, options);
+
 	for (i = fz_optind; i < argc; ++i)
 	{
-		doc = fz_open_document(ctx, argv[i]);
+		filename = argv[i];
+		doc = fz_open_document(ctx, filename);
 		if (fz_needs_password(ctx, doc))
 			if (!fz_authenticate_password(ctx, doc, password))
 				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate password: %s", argv[i]);
@@ -184,6 +329,8 @@ int muconvert_main(int argc, char **argv)
 		else
 			runrange("1-N");
 
+		mu_drop_stext_pool(ctx, text_pool);
+		text_pool = NULL;
 		fz_drop_document(ctx, doc);
 	}
 
@@ -191,5 +338,9 @@ int muconvert_main(int argc, char **argv)
 
 	fz_drop_document_writer(ctx, out);
 	fz_drop_context(ctx);
+#ifndef DISABLE_MUTHREADS
+	if (locks)
+		fin_muconvert_locks();
+#endif
 	return EXIT_SUCCESS;
 }